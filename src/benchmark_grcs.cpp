@@ -0,0 +1,311 @@
+#include "kokkos.h"
+#include "io/output/output.h"
+#include "util/arg_parser.h"
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sys/resource.h>
+
+#include "reader.h"
+#include "simulator.h"
+#include "feynman_simulator.h"
+#include "multi_feynman_simulator.h"
+#include "util/permutation.h"
+
+/**
+ * End-to-end benchmarks on GRCS circuits
+ *
+ * A fixed matrix of instances (sizes, depths, Schrodinger and Feynman with
+ * several cuts) is run for every requested number of threads:
+ *  - strong scaling: the same work for every number of threads
+ *  - weak scaling: a number of Feynman paths proportional to the threads
+ *
+ * Every case runs in its own process (this executable with --case), such
+ * that the number of threads can be set at Kokkos initialisation and the
+ * peak RSS belongs to the case alone.
+ *
+ * The results can be compared with the output of a previous run (baseline):
+ * a case slower than the baseline by more than the threshold, or in the
+ * baseline but not measured by this run (failed or skipped), is a
+ * regression. The benchmark exits with an error code on a regression or a
+ * failed case.
+ */
+
+struct Arguments {
+    std::string grcs_folder = "GRCS/inst/rectangular/cz_v2";
+    std::vector<double> threads = { 1 };
+    bool weak_scaling = true;
+    int repetitions = 1;
+    std::string output = "benchmark.json";
+    std::string baseline;
+    double threshold = 0.1;
+    int case_idx = -1;
+    size_t paths = 0;
+};
+
+struct Case {
+    std::string size;
+    int depth;
+    std::string engine; // schrodinger, feynman (two-way cut) or multi (k-way cut)
+    int cut; // Cut of the two-way cut (-1: automatic), or number of blocks
+    int nbitstrings; // -1: full statevector
+    size_t paths; // Maximum number of Feynman paths (0: all)
+    size_t weak_paths; // Paths per thread in weak scaling (0: not part of the weak scaling)
+
+    std::string name() const {
+        std::string out = fmt::format("{}_d{}_{}", size, depth, engine);
+        if (engine == "feynman")
+            out += cut >= 0 ? fmt::format("_cut{}", cut) : "_cutauto";
+        if (engine == "multi")
+            out += fmt::format("_{}blocks", cut);
+        if (nbitstrings >= 0)
+            out += fmt::format("_{}bitstrings", nbitstrings);
+        return out;
+    }
+
+    std::string circuit_file(const std::string& folder) const {
+        return fmt::format("{}/{}/inst_{}_{}_0.txt", folder, size, size, depth);
+    }
+};
+
+const std::vector<Case> benchmark_cases = {
+    { "4x4", 10, "schrodinger", -1, -1, 0, 0 },
+    { "4x4", 10, "feynman", 8, -1, 0, 0 },
+    { "4x4", 10, "feynman", -1, 1000, 0, 0 },
+    { "4x5", 10, "schrodinger", -1, -1, 0, 0 },
+    { "4x5", 10, "feynman", 10, 1000, 0, 0 },
+    { "4x5", 10, "multi", 3, 1000, 0, 0 },
+    { "4x5", 20, "schrodinger", -1, -1, 0, 0 },
+    { "4x5", 20, "feynman", 10, 1000, 256, 16 },
+    { "5x5", 10, "schrodinger", -1, -1, 0, 0 },
+    { "5x5", 10, "feynman", -1, 1000, 256, 16 },
+};
+
+struct Measure {
+    std::string name;
+    std::string scaling;
+    int threads = 1;
+    double wall_time = 0;
+    size_t paths = 0;
+    size_t amplitudes = 0;
+    size_t peak_rss = 0; // in bytes
+};
+
+std::string measure_to_json(const Measure& measure) {
+    return fmt::format("{{\"case\": \"{}\", \"scaling\": \"{}\", \"threads\": {}, \"wall_time\": {:.6e}, "
+        "\"paths\": {}, \"paths_per_second\": {:.6e}, \"amplitudes\": {}, \"amplitudes_per_second\": {:.6e}, \"peak_rss\": {}}}",
+        measure.name, measure.scaling, measure.threads, measure.wall_time,
+        measure.paths, measure.paths / measure.wall_time, measure.amplitudes, measure.amplitudes / measure.wall_time,
+        measure.peak_rss);
+}
+
+/** Value of a field in a line written by measure_to_json */
+std::string json_field(const std::string& line, const std::string& name) {
+    std::string key = "\"" + name + "\": ";
+    size_t start = line.find(key);
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += key.size();
+    if (line[start] == '"') {
+        return line.substr(start + 1, line.find('"', start + 1) - start - 1);
+    }
+    return line.substr(start, line.find_first_of(",}", start) - start);
+}
+
+/** Run one case in this process, the result is printed on a line starting with RESULT */
+Measure run_case(const Case& bench, const Arguments& args) {
+    Circuit circuit = read_circuit(bench.circuit_file(args.grcs_folder), false, true);
+    size_t max_memory = 16ull * 1024 * 1024 * 1024;
+    size_t paths = args.paths > 0 ? args.paths : bench.paths;
+
+    Kokkos::View<size_t*> bitstrings;
+    if (bench.nbitstrings >= 0) {
+        bitstrings = Kokkos::View<size_t*>("bitstrings", bench.nbitstrings);
+        KeyedPermutation permutation(0, circuit.num_qubits);
+        Kokkos::parallel_for("generate_bitstrings", bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) {
+            bitstrings(i) = permutation(i);
+        });
+    }
+
+    Measure measure;
+    measure.name = bench.name();
+    measure.threads = ExecSpace().concurrency();
+    measure.amplitudes = bench.nbitstrings >= 0 ? bench.nbitstrings : 1ull << circuit.num_qubits;
+
+    auto limit_paths = [&](auto& simulator) {
+        if (paths > 0)
+            simulator.paths.set_range(0, MIN(paths, simulator.num_paths), simulator.num_paths);
+        measure.paths = simulator.paths.size();
+    };
+
+    Kokkos::fence();
+    Kokkos::Timer timer;
+    if (bench.engine == "schrodinger") {
+        SchrodingerSimulator simulator(circuit);
+        simulator.initialise_state(true);
+        simulator.run(false);
+        measure.paths = 1;
+    }
+    else if (bench.engine == "feynman") {
+        FeynmanSimulator simulator(circuit, 1.0, max_memory, bench.cut);
+        limit_paths(simulator);
+        simulator.run_flat(bitstrings, 1.0, false);
+    }
+    else {
+        MultiFeynmanSimulator simulator(circuit, bench.cut, max_memory);
+        limit_paths(simulator);
+        simulator.run_flat(bitstrings, 1.0, false);
+    }
+    Kokkos::fence();
+    measure.wall_time = timer.seconds();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    measure.peak_rss = usage.ru_maxrss * 1024ull;
+    return measure;
+}
+
+/** Run a case in a child process with the given number of threads */
+bool run_child(const std::string& self, const Arguments& args, int case_idx, size_t paths, int threads, Measure& measure) {
+    std::string command = fmt::format("{} --grcs_folder {} --case {} --paths {} --kokkos-num-threads={}",
+        self, args.grcs_folder, case_idx, paths, threads);
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe) {
+        return false;
+    }
+    std::string result;
+    char buffer[4096];
+    while (fgets(buffer, sizeof(buffer), pipe)) {
+        std::string line = buffer;
+        if (line.rfind("RESULT ", 0) == 0) {
+            result = line.substr(7);
+        }
+    }
+    if (pclose(pipe) != 0 || result.empty()) {
+        return false;
+    }
+    measure.wall_time = std::stod(json_field(result, "wall_time"));
+    measure.paths = std::stoull(json_field(result, "paths"));
+    measure.amplitudes = std::stoull(json_field(result, "amplitudes"));
+    measure.peak_rss = std::stoull(json_field(result, "peak_rss"));
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Arguments args;
+
+    Parser arg_parser("GRCS benchmarks", "0.1");
+    arg_parser.add_argument("--grcs_folder", "Folder of the extracted GRCS circuits (see extract_circuits.sh)", args.grcs_folder);
+    arg_parser.add_argument("--threads", "Comma separated numbers of threads (e.g. 1,2,4,8)", args.threads);
+    arg_parser.add_argument("--weak_scaling", "Also run the weak scaling cases", args.weak_scaling);
+    arg_parser.add_argument("--repetitions", "Number of runs of every case (the best is kept)", args.repetitions);
+    arg_parser.add_argument("-o,--output", "Output the results to file (json)", args.output);
+    arg_parser.add_argument("--baseline", "Results of a previous run to compare with", args.baseline);
+    arg_parser.add_argument("--threshold", "Relative slowdown over the baseline counted as a regression", args.threshold);
+    arg_parser.add_argument("--case", "Run only this case, in this process (used internally)", args.case_idx);
+    arg_parser.add_argument("--paths", "Number of Feynman paths of the case (used internally)", args.paths);
+    arg_parser.parse_known_args(argc, argv);
+
+    // Child process: one case
+    if (args.case_idx >= 0) {
+        Kokkos::initialize(argc, argv);
+        {
+            Measure measure = run_case(benchmark_cases.at(args.case_idx), args);
+            fmt::println("RESULT {}", measure_to_json(measure));
+        }
+        Kokkos::finalize();
+        return 0;
+    }
+
+    std::vector<Measure> measures;
+    int failures = 0;
+    auto run = [&](int case_idx, size_t paths, int threads, const std::string& scaling) {
+        const Case& bench = benchmark_cases[case_idx];
+        Measure best;
+        best.name = bench.name();
+        best.scaling = scaling;
+        best.threads = threads;
+        best.wall_time = 1e300;
+        for (int r = 0;r < args.repetitions;r++) {
+            Measure measure;
+            if (!run_child(argv[0], args, case_idx, paths, threads, measure)) {
+                fmt::println("{}", warning(fmt::format("{} failed with {} threads", bench.name(), threads)));
+                failures++;
+                return;
+            }
+            best.paths = measure.paths;
+            best.amplitudes = measure.amplitudes;
+            best.wall_time = MIN(best.wall_time, measure.wall_time);
+            best.peak_rss = MAX(best.peak_rss, measure.peak_rss);
+        }
+        fmt::println("{:<40} {:<6} threads={:<3} {:>10} {:>10.3e} paths/s {:>10.3e} amplitudes/s, peak RSS {}",
+            best.name, scaling, threads, print_time(best.wall_time),
+            best.paths / best.wall_time, best.amplitudes / best.wall_time, print_filesize(best.peak_rss));
+        measures.push_back(best);
+    };
+
+    for (size_t i = 0;i < benchmark_cases.size();i++) {
+        const Case& bench = benchmark_cases[i];
+        if (!std::ifstream(bench.circuit_file(args.grcs_folder)).good()) {
+            fmt::println("{}", warning(fmt::format("{} not found, skipping {} (run extract_circuits.sh)",
+                bench.circuit_file(args.grcs_folder), bench.name())));
+            continue;
+        }
+        for (double threads : args.threads) {
+            run(i, 0, (int)threads, "strong");
+        }
+        if (args.weak_scaling && bench.weak_paths > 0) {
+            for (double threads : args.threads) {
+                run(i, bench.weak_paths * (size_t)threads, (int)threads, "weak");
+            }
+        }
+    }
+
+    std::string out = "{\n  \"results\": [\n";
+    for (size_t i = 0;i < measures.size();i++) {
+        out += "    " + measure_to_json(measures[i]) + (i + 1 < measures.size() ? ",\n" : "\n");
+    }
+    out += "  ]\n}\n";
+    std::ofstream(args.output) << out;
+
+    // Comparison with the baseline
+    int regressions = 0;
+    if (!args.baseline.empty()) {
+        std::ifstream file(args.baseline);
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not open file: " + args.baseline);
+        }
+        std::map<std::string, double> baseline;
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.find("\"case\"") != std::string::npos) {
+                std::string key = json_field(line, "case") + "/" + json_field(line, "scaling") + "/" + json_field(line, "threads");
+                baseline[key] = std::stod(json_field(line, "wall_time"));
+            }
+        }
+        fmt::println("{}", header("Comparison with " + args.baseline));
+        for (const auto& measure : measures) {
+            std::string key = measure.name + "/" + measure.scaling + "/" + std::to_string(measure.threads);
+            if (baseline.count(key) == 0) {
+                continue;
+            }
+            double ratio = measure.wall_time / baseline[key];
+            bool regression = ratio > 1 + args.threshold;
+            regressions += regression;
+            fmt::println("{:<40} {:<6} threads={:<3} {:>+7.1f}% {}", measure.name, measure.scaling, measure.threads,
+                100 * (ratio - 1), regression ? "REGRESSION" : "");
+            baseline.erase(key);
+        }
+        // Left in the baseline: cases that failed or were skipped in this run
+        for (const auto& [key, wall_time] : baseline) {
+            regressions++;
+            fmt::println("{:<68} REGRESSION (not measured)", key);
+        }
+        fmt::println("{} regression(s) over a threshold of {:.0f}%", regressions, 100 * args.threshold);
+    }
+    if (failures > 0) {
+        fmt::println("{} case(s) failed", failures);
+    }
+    return regressions > 0 || failures > 0 ? 2 : 0;
+}
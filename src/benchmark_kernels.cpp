@@ -0,0 +1,199 @@
+#include "kokkos.h"
+#include "io/output/output.h"
+#include "util/arg_parser.h"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+
+#include "simulator.h"
+#include "feynman_simulator.h"
+#include "util/permutation.h"
+
+/**
+ * Microbenchmarks of the kernels of the simulators
+ *
+ * Every kernel is timed alone, for a range of qubit counts and of
+ * target/control positions, and its effective bandwidth is compared to the
+ * peak bandwidth measured by STREAM-like copy and triad kernels.
+ *
+ * The bytes of a kernel are the minimal traffic of the algorithm (every
+ * amplitude touched is read and written once), so a kernel that moves whole
+ * cache lines for half of their content shows a low fraction of the peak.
+ *
+ * The number of threads is fixed when Kokkos is initialised: sweep it by
+ * running the benchmark with different --kokkos-num-threads (the column
+ * threads reports it).
+ */
+
+struct Arguments {
+    int min_qubits = 16;
+    int max_qubits = 24;
+    int qubit_step = 2;
+    int repetitions = 5;
+    std::string output;
+    std::string state_allocator = "default";
+};
+
+struct Result {
+    std::string kernel;
+    int num_qubits;
+    int target;
+    int control;
+    double best;
+    double mean;
+    double bytes;
+};
+
+/** Best and mean time of a kernel, after one warm-up run */
+std::pair<double, double> time_kernel(const std::function<void()>& kernel, int repetitions) {
+    kernel();
+    Kokkos::fence();
+    double best = 1e300;
+    double total = 0;
+    for (int r = 0;r < repetitions;r++) {
+        Kokkos::Timer timer;
+        kernel();
+        Kokkos::fence();
+        double time = timer.seconds();
+        best = std::min(best, time);
+        total += time;
+    }
+    return { best, total / repetitions };
+}
+
+int main(int argc, char* argv[]) {
+    Arguments args;
+
+    Parser arg_parser("Kernel benchmarks", "0.1");
+    arg_parser.add_argument("--min_qubits", "Smallest number of qubits", args.min_qubits);
+    arg_parser.add_argument("--max_qubits", "Largest number of qubits", args.max_qubits);
+    arg_parser.add_argument("--qubit_step", "Step between the numbers of qubits", args.qubit_step);
+    arg_parser.add_argument("--repetitions", "Number of timed runs of every kernel", args.repetitions);
+    arg_parser.add_argument("--state_allocator", "Allocation of the state vectors: default, first_touch or huge_pages", args.state_allocator);
+    arg_parser.add_argument("-o,--output", "Output the results to file (csv)", args.output);
+    arg_parser.parse_known_args(argc, argv);
+
+    Kokkos::initialize(argc, argv);
+    {
+        int threads = ExecSpace().concurrency();
+        state_allocator() = parse_state_allocator(args.state_allocator);
+        std::vector<Result> results;
+        auto record = [&](const std::string& kernel, int num_qubits, int target, int control, const std::function<void()>& f, double bytes) {
+            auto [best, mean] = time_kernel(f, args.repetitions);
+            results.push_back({ kernel, num_qubits, target, control, best, mean, bytes });
+            fmt::println("{:<16} n={:<3} target={:<3} control={:<3} {:>10} {:>8.2f} GB/s",
+                kernel, num_qubits, target, control, print_time(best), bytes / best * 1e-9);
+        };
+
+        // Peak bandwidth, on arrays larger than the largest statevector
+        size_t stream_size = MAX(2ull << args.max_qubits, 1ull << 25);
+        {
+            Kokkos::View<double*> a("stream_a", stream_size);
+            Kokkos::View<double*> b("stream_b", stream_size);
+            Kokkos::View<double*> c("stream_c", stream_size);
+            Kokkos::deep_copy(a, 1.);
+            Kokkos::deep_copy(b, 2.);
+            Kokkos::deep_copy(c, 3.);
+            record("stream_copy", 0, -1, -1, [&]() {
+                Kokkos::parallel_for("stream_copy", stream_size, KOKKOS_LAMBDA(size_t i) { b(i) = a(i); });
+            }, 2. * sizeof(double) * stream_size);
+            record("stream_triad", 0, -1, -1, [&]() {
+                Kokkos::parallel_for("stream_triad", stream_size, KOKKOS_LAMBDA(size_t i) { a(i) = b(i) + 0.5 * c(i); });
+            }, 3. * sizeof(double) * stream_size);
+        }
+        double peak = 0;
+        for (const auto& result : results) {
+            peak = MAX(peak, result.bytes / result.best);
+        }
+
+        const std::vector<GateType> one_qubit_gates = {
+            GateType::X, GateType::Y, GateType::Z, GateType::H, GateType::SqrtX, GateType::SqrtY,
+            GateType::P0, GateType::P1, GateType::T
+        };
+
+        for (int n = args.min_qubits;n <= args.max_qubits;n += args.qubit_step) {
+            Circuit circuit;
+            circuit.num_qubits = n;
+            circuit.depth = 0;
+            SchrodingerSimulator simulator(circuit);
+            simulator.initialise_state(true);
+            if (state_allocator() != StateAllocator::Default)
+                fmt::println("{}", print_placement("wave", simulator.wave));
+            double amplitude_bytes = sizeof(cmplx) * (double)(1ull << n);
+
+            for (int target : { 0, n / 2, n - 1 }) {
+                for (GateType type : one_qubit_gates) {
+                    Gate gate;
+                    gate.type = type;
+                    gate.target = target;
+                    gate.cycle = 0;
+                    record(gate_to_text(type), n, target, -1, [&]() { simulator.apply_gate(gate, false); }, simulator.gate_bytes(type));
+                }
+                record("projection", n, target, -1, [&]() { simulator.apply_projection(target, 0); }, amplitude_bytes);
+            }
+
+            std::vector<std::pair<int, int>> pairs = { { 0, 1 }, { n / 2, n / 2 + 1 }, { n - 2, n - 1 }, { 0, n - 1 } };
+            for (auto [control, target] : pairs) {
+                for (GateType type : { GateType::CZ, GateType::CX }) {
+                    Gate gate;
+                    gate.type = type;
+                    gate.control = control;
+                    gate.target = target;
+                    gate.cycle = 0;
+                    record(gate_to_text(type), n, target, control, [&]() { simulator.apply_gate(gate, false); }, simulator.gate_bytes(type));
+                }
+            }
+
+            record("normalise", n, -1, -1, [&]() { simulator.normalise(); }, 2 * amplitude_bytes);
+
+            // Leaf accumulation of a Feynman path, on a circuit cut in two halves
+            FeynmanSimulator feynman(circuit, 1.0, -1, n / 2);
+            SchrodingerSimulator sim_1;
+            SchrodingerSimulator sim_2;
+            sim_1.circuit.num_qubits = n / 2;
+            sim_2.circuit.num_qubits = n - n / 2;
+            sim_1.N = feynman.N1;
+            sim_2.N = feynman.N2;
+            sim_1.wave = Kokkos::View<cmplx*>("wave_1", sim_1.N);
+            sim_2.wave = Kokkos::View<cmplx*>("wave_2", sim_2.N);
+            sim_1.initialise_state(true);
+            sim_2.initialise_state(true);
+
+            size_t num_bitstrings = 1ull << (n - 1);
+            Kokkos::View<size_t*> bitstrings("bitstrings", num_bitstrings);
+            KeyedPermutation permutation(0, n);
+            Kokkos::parallel_for("generate_bitstrings", num_bitstrings, KOKKOS_LAMBDA(size_t i) {
+                bitstrings(i) = permutation(i);
+            });
+            SortedBitstrings sorted(bitstrings);
+            feynman.split_bitstrings(sorted.bitstrings);
+            Kokkos::View<cmplx*> gather_wave("global_wave", num_bitstrings);
+            // Split indices, the two half amplitudes, and the accumulator
+            double gather_bytes = (2 * sizeof(uint32_t) + 4 * sizeof(cmplx)) * (double)num_bitstrings;
+            record("feynman_gather", n, n / 2, -1, [&]() { feynman.accumulate(sim_1, sim_2, gather_wave); }, gather_bytes);
+
+            feynman.split_1 = Kokkos::View<uint32_t*>();
+            feynman.split_2 = Kokkos::View<uint32_t*>();
+            Kokkos::View<cmplx*> dense_wave("global_wave", 1ull << n);
+            record("feynman_dense", n, n / 2, -1, [&]() { feynman.accumulate(sim_1, sim_2, dense_wave); }, 2 * amplitude_bytes);
+        }
+
+        std::string out = "kernel,num_qubits,target,control,threads,best_seconds,mean_seconds,bytes,gbps,fraction_of_peak\n";
+        for (const auto& result : results) {
+            double bandwidth = result.bytes / result.best;
+            out += fmt::format("{},{},{},{},{},{:.6e},{:.6e},{:.0f},{:.3f},{:.3f}\n",
+                result.kernel, result.num_qubits, result.target, result.control, threads,
+                result.best, result.mean, result.bytes, bandwidth * 1e-9, bandwidth / peak);
+        }
+        fmt::println("Peak bandwidth: {:.2f} GB/s ({} threads)", peak * 1e-9, threads);
+        if (!args.output.empty()) {
+            std::ofstream file(args.output);
+            file << out;
+        }
+        else {
+            fmt::print("{}", out);
+        }
+    }
+    Kokkos::finalize();
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "kokkos.h"
+#include "io/output/output.h"
+#include "util/arg_parser.h"
+#include <fstream>
+
+#include "reader.h"
+#include "simulator.h"
+#include "feynman_simulator.h"
+#include "circuit_optimizer.h"
+#include "scheduler.h"
+
+/**
+ * Checks of the circuit transformations on GRCS circuits
+ *
+ * The optimization passes (--optimize) and the gate scheduler (--schedule)
+ * rewrite the circuit before any simulator runs it. Every instance is
+ * simulated as read, and after each transformation:
+ *  - --optimize 1 and --schedule 1 (with the diagonal runs of the Schrodinger
+ *    simulator, and on the Feynman simulator for the unpadded circuits) must
+ *    give the same amplitudes
+ *  - --optimize 2 must give the same probabilities
+ *
+ * The GRCS circuits leave little to the passes, so every instance is also
+ * checked padded with removable gates: X and SqrtX on the initial |+>, a
+ * pair of CZ after every CZ, and two more T after every T (merged with it
+ * into a Z).
+ *
+ * The executable exits with an error code if a difference exceeds the
+ * tolerance.
+ */
+
+struct Arguments {
+    std::string grcs_folder = "GRCS/inst/rectangular/cz_v2";
+    std::vector<double> depths = { 10, 20 };
+    double tolerance = 1e-10;
+};
+
+const std::vector<std::string> instance_sizes = { "4x4", "4x5" };
+
+/** The circuit with removable gates inserted (see above) */
+Circuit pad_circuit(const Circuit& circuit) {
+    Circuit padded = circuit;
+    padded.gates.clear();
+    for (int q = 0;q < circuit.num_qubits;q++) {
+        padded.gates.push_back({ q % 2 ? GateType::SqrtX : GateType::X, q, -1, 1 });
+    }
+    for (const auto& gate : circuit.gates) {
+        padded.gates.push_back(gate);
+        if (gate.type == GateType::CZ) {
+            padded.gates.push_back(gate);
+            padded.gates.push_back(gate);
+        }
+        if (gate.type == GateType::T) {
+            padded.gates.push_back(gate);
+            padded.gates.push_back(gate);
+        }
+    }
+    return padded;
+}
+
+Kokkos::View<cmplx*, Kokkos::HostSpace> schrodinger(const Circuit& circuit, const std::vector<std::pair<size_t, size_t>>& diagonal_runs = {}) {
+    SchrodingerSimulator simulator(circuit);
+    simulator.diagonal_runs = diagonal_runs;
+    simulator.initialise_state(true);
+    simulator.run(false);
+    return to_host(simulator.get_statevector()).wave;
+}
+
+Kokkos::View<cmplx*, Kokkos::HostSpace> feynman(const Circuit& circuit) {
+    FeynmanSimulator simulator(circuit, 1.0, 16ull * 1024 * 1024 * 1024, -1);
+    Kokkos::View<size_t*> full_statevector;
+    Kokkos::View<cmplx*> wave = simulator.run_flat(full_statevector, 1.0, false);
+    return to_host(StateVector{ circuit.num_qubits, wave }).wave;
+}
+
+/** Largest difference of the amplitudes (or of the probabilities) */
+double max_difference(const Kokkos::View<cmplx*, Kokkos::HostSpace>& a, const Kokkos::View<cmplx*, Kokkos::HostSpace>& b, bool probabilities) {
+    double diff = 0;
+    for (size_t i = 0;i < a.extent(0);i++) {
+        double d = probabilities ? Kokkos::abs(Kokkos::abs(a(i)) * Kokkos::abs(a(i)) - Kokkos::abs(b(i)) * Kokkos::abs(b(i)))
+            : Kokkos::abs(a(i) - b(i));
+        diff = MAX(diff, d);
+    }
+    return diff;
+}
+
+int main(int argc, char* argv[]) {
+    Arguments args;
+
+    Parser arg_parser("Checks of the circuit transformations", "0.1");
+    arg_parser.add_argument("--grcs_folder", "Folder of the extracted GRCS circuits (see extract_circuits.sh)", args.grcs_folder);
+    arg_parser.add_argument("--depths", "Comma separated depths of the instances", args.depths);
+    arg_parser.add_argument("--tolerance", "Largest difference of the amplitudes (or probabilities) accepted", args.tolerance);
+    arg_parser.parse_known_args(argc, argv);
+
+    Kokkos::initialize(argc, argv);
+    int failures = 0, checks = 0;
+    {
+        auto check = [&](const std::string& name, const std::string& transform, size_t gates, size_t gates_after, double diff) {
+            bool failed = !(diff <= args.tolerance);
+            failures += failed;
+            checks++;
+            fmt::println("{:<24} {:<28} {:>5} -> {:<5} gates  max diff {:.3e}  {}",
+                name, transform, gates, gates_after, diff, failed ? "FAIL" : "ok");
+        };
+
+        for (const auto& size : instance_sizes) {
+            for (double depth : args.depths) {
+                std::string file = fmt::format("{}/{}/inst_{}_{}_0.txt", args.grcs_folder, size, size, (int)depth);
+                if (!std::ifstream(file).good()) {
+                    fmt::println("{}", warning(fmt::format("{} not found, skipping (run extract_circuits.sh)", file)));
+                    continue;
+                }
+                Circuit grcs = read_circuit(file, false, true);
+                for (bool padded : { false, true }) {
+                    Circuit circuit = padded ? pad_circuit(grcs) : grcs;
+                    std::string name = fmt::format("{}_d{}{}", size, (int)depth, padded ? "_padded" : "");
+                    size_t gates = circuit.gates.size();
+                    auto reference = schrodinger(circuit);
+
+                    OptimizationReport report;
+                    Circuit exact = optimize_circuit(circuit, false, report);
+                    check(name, "optimize 1", gates, exact.gates.size(), max_difference(reference, schrodinger(exact), false));
+
+                    Circuit final_phases = optimize_circuit(circuit, true, report);
+                    check(name, "optimize 2 (probabilities)", gates, final_phases.gates.size(), max_difference(reference, schrodinger(final_phases), true));
+
+                    Schedule schedule = schedule_gates(circuit);
+                    Circuit scheduled = apply_schedule(circuit, schedule);
+                    check(name, "schedule", gates, gates, max_difference(reference, schrodinger(scheduled, schedule.diagonal_runs()), false));
+                    // The padding triples the cross CZ, and thus multiplies the Feynman paths
+                    if (!padded)
+                        check(name, "schedule (feynman)", gates, gates, max_difference(reference, feynman(scheduled), false));
+
+                    Schedule optimized_schedule = schedule_gates(exact);
+                    Circuit both = apply_schedule(exact, optimized_schedule);
+                    check(name, "optimize 1 + schedule", gates, both.gates.size(),
+                        max_difference(reference, schrodinger(both, optimized_schedule.diagonal_runs()), false));
+                }
+            }
+        }
+    }
+    Kokkos::finalize();
+
+    fmt::println("{} checks, {} failed (tolerance {:.1e})", checks, failures, args.tolerance);
+    return failures > 0 || checks == 0 ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "io/checkpoint.h"
+#include "io/output/output.h"
+#include "path_selection.h"
+#include "simulator.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <future>
+
+/**
+ * Periodic checkpoints of a Feynman run
+ *
+ * The simulators call update() after every path. When the interval has
+ * elapsed, the partial amplitudes are copied into a host snapshot and written
+ * by a background thread, while the simulation goes on. If the previous
+ * checkpoint is still being written, the new one is simply skipped: a slow
+ * file system never stalls the paths.
+ *
+ * A checkpoint that cannot be written is reported, and the run goes on (the
+ * next one may succeed).
+ *
+ * If the checkpoint file already exists, the run is resumed from it: the
+ * partial amplitudes (and the pruning counts) are restored and the completed
+ * paths are skipped. The
+ * checkpoint must come from the same run (circuit, fidelity, prune
+ * tolerance, paths, cuts and bitstrings), and is removed once the run is
+ * complete.
+ */
+inline uint64_t circuit_hash(const Circuit& circuit) {
+    // FNV-1a over the gates
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](int64_t value) {
+        for (int byte = 0;byte < 8;byte++) {
+            hash ^= (value >> (8 * byte)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    };
+    mix(circuit.num_qubits);
+    for (const auto& gate : circuit.gates) {
+        mix((int)gate.type);
+        mix(gate.target);
+        mix(gate.control);
+        mix(gate.cycle);
+    }
+    return hash;
+}
+
+struct Checkpointer {
+    std::string filename;
+    double interval;
+    Checkpoint state;
+    bool resumed = false;
+    Kokkos::Timer timer;
+    std::future<void> pending;
+
+    Checkpointer(const std::string& filename, double interval) : filename(filename), interval(interval) {
+        if (std::ifstream(filename).good()) {
+            state = read_checkpoint(filename);
+            resumed = true;
+            fmt::println("Resuming from checkpoint {}: paths [{}, {}) done", filename, state.header.path_begin, state.next_path);
+        }
+    }
+
+    ~Checkpointer() {
+        wait();
+    }
+
+    /** Use the bitstrings of the interrupted run */
+    void restore_bitstrings(const Kokkos::View<size_t*>& bitstrings) {
+        if (!resumed || !state.header.has_bitstrings) {
+            return;
+        }
+        if (bitstrings.extent(0) != state.bitstrings.extent(0)) {
+            throw std::runtime_error("Checkpoint was computed on a different number of bitstrings");
+        }
+        Kokkos::deep_copy(bitstrings, state.bitstrings);
+    }
+
+    /**
+     * Start a run
+     *
+     * Checks that the run matches the checkpoint (if any), restores the
+     * partial amplitudes into global_wave and the pruning counts of the paths
+     * done, and returns the first path left to simulate.
+     */
+    size_t start(const Circuit& circuit, float fidelity, precision prune_tolerance, size_t num_paths, const PathSelection& paths,
+        const std::vector<int>& cuts, const Kokkos::View<size_t*>& bitstrings, const Kokkos::View<cmplx*>& global_wave,
+        size_t& pruned_paths, precision& pruned_weight) {
+        int num_qubits = circuit.num_qubits;
+        uint64_t hash = circuit_hash(circuit);
+        ShardHeader header;
+        header.num_qubits = num_qubits;
+        header.num_amplitudes = global_wave.extent(0);
+        header.num_paths = num_paths;
+        header.path_begin = paths.begin;
+        header.path_end = paths.end;
+        header.seed = paths.seed;
+        header.has_bitstrings = bitstrings.extent(0) > 0;
+
+        timer.reset();
+        if (!resumed) {
+            state.header = header;
+            state.cuts = cuts;
+            state.fidelity = fidelity;
+            state.prune_tolerance = prune_tolerance;
+            state.circuit_hash = hash;
+            state.next_path = paths.begin;
+            state.bitstrings = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), bitstrings);
+            state.wave = Kokkos::View<cmplx*, Kokkos::HostSpace>("checkpoint_wave", global_wave.extent(0));
+            return paths.begin;
+        }
+
+        const auto& saved = state.header;
+        if (saved.num_qubits != header.num_qubits || saved.num_amplitudes != header.num_amplitudes
+            || saved.num_paths != header.num_paths || saved.path_begin != header.path_begin
+            || saved.path_end != header.path_end || saved.seed != header.seed
+            || saved.has_bitstrings != header.has_bitstrings || state.cuts != cuts) {
+            throw std::runtime_error("Checkpoint " + filename + " does not belong to this run");
+        }
+        if (state.circuit_hash != hash) {
+            throw std::runtime_error("Checkpoint " + filename + " was computed on a different circuit");
+        }
+        if (state.fidelity != (double)fidelity || state.prune_tolerance != (double)prune_tolerance) {
+            throw std::runtime_error(fmt::format("Checkpoint {} was computed with fidelity {} and prune tolerance {}",
+                filename, state.fidelity, state.prune_tolerance));
+        }
+        if (header.has_bitstrings) {
+            auto bitstrings_host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), bitstrings);
+            for (size_t i = 0;i < bitstrings_host.extent(0);i++) {
+                if (bitstrings_host(i) != state.bitstrings(i)) {
+                    throw std::runtime_error("Checkpoint " + filename + " was computed on different bitstrings");
+                }
+            }
+        }
+        Kokkos::deep_copy(global_wave, state.wave);
+        pruned_paths = state.pruned_paths;
+        pruned_weight = state.pruned_weight;
+        return state.next_path;
+    }
+
+    /** Save a checkpoint if it is due, all the paths before next_path being done */
+    void update(const Kokkos::View<cmplx*>& global_wave, size_t next_path, size_t pruned_paths, precision pruned_weight) {
+        if (timer.seconds() < interval) {
+            return;
+        }
+        if (pending.valid() && pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return;
+        }
+        wait();
+        Kokkos::fence();
+        Kokkos::deep_copy(state.wave, global_wave);
+        state.next_path = next_path;
+        state.pruned_paths = pruned_paths;
+        state.pruned_weight = pruned_weight;
+        pending = std::async(std::launch::async, [this]() {
+            write_checkpoint(filename, state);
+        });
+        timer.reset();
+    }
+
+    /** End of the run: all the paths are done, the checkpoint is removed */
+    void finish() {
+        wait();
+        std::remove(filename.c_str());
+        std::remove((filename + ".tmp").c_str());
+        resumed = false;
+    }
+
+    /** Wait for the checkpoint being written, if any, reporting a failed write */
+    void wait() {
+        if (!pending.valid()) {
+            return;
+        }
+        try {
+            pending.get();
+        }
+        catch (const std::exception& e) {
+            fmt::println("{}", warning(fmt::format("checkpoint not saved, the run goes on: {}", e.what())));
+        }
+    }
+};
@@ -0,0 +1,332 @@
+#pragma once
+
+#include "simulator.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * Optimization passes over a circuit, before any simulator runs it
+ *
+ * Every gate removed saves a sweep of the state in the Schrodinger simulator
+ * and a gate per path in the Feynman simulators, and a cross CZ removed
+ * halves the number of Feynman paths.
+ *
+ * Two gates commute when, on each of their common qubits, both act in the Z
+ * basis (diagonal gates, CX control) or both in the X basis (X, SqrtX, CX
+ * target). The passes use it to find the gates that meet once the gates in
+ * between are commuted out of the way:
+ *  - cancellation: self-inverse pairs (X, Y, Z, H, CX, CZ) are removed,
+ *    SqrtX.SqrtX (SqrtY.SqrtY) become X (Y), and P0.P0 (P1.P1) become P0 (P1)
+ *  - phases: the Z and T of a qubit are merged into the first of them, as
+ *    k eighths of a turn written with at most one Z and three T
+ *  - dead gates: X, SqrtX and the CX whose target is still in the initial
+ *    |+> (of which they leave it unchanged) are removed. When only the
+ *    probabilities are needed, so are the diagonal gates followed only by
+ *    diagonal gates, whose phases do not change the probabilities.
+ *
+ * The passes run again as long as they remove gates (a cancellation may
+ * bring two other gates together). All the simulators start from |+...+>,
+ * the Hadamard gates of cycle 0 being skipped by read_circuit.
+ */
+enum class QubitAction {
+    None,
+    ZBasis,
+    XBasis,
+    Other
+};
+
+inline QubitAction action_on(const Gate& gate, int q) {
+    if (gate.target != q && gate.control != q) {
+        return QubitAction::None;
+    }
+    switch (gate.type) {
+    case GateType::Z:
+    case GateType::T:
+    case GateType::P0:
+    case GateType::P1:
+    case GateType::CZ:
+        return QubitAction::ZBasis;
+    case GateType::X:
+    case GateType::SqrtX:
+        return QubitAction::XBasis;
+    case GateType::CX:
+        return gate.control == q ? QubitAction::ZBasis : QubitAction::XBasis;
+    default:
+        return QubitAction::Other;
+    }
+}
+
+inline bool commutes(const Gate& a, const Gate& b) {
+    for (int q : { a.target, a.control }) {
+        if (q == -1) {
+            continue;
+        }
+        QubitAction action_a = action_on(a, q);
+        QubitAction action_b = action_on(b, q);
+        if (action_b != QubitAction::None && (action_a != action_b || action_a == QubitAction::Other)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool same_qubits(const Gate& a, const Gate& b) {
+    if (a.type == GateType::CZ) {
+        return (a.target == b.target && a.control == b.control) || (a.target == b.control && a.control == b.target);
+    }
+    return a.target == b.target && a.control == b.control;
+}
+
+inline bool is_phase(const Gate& gate) {
+    return gate.type == GateType::Z || gate.type == GateType::T;
+}
+
+/** Diagonal and unitary (P0 and P1 are diagonal projections) */
+inline bool is_diagonal_unitary(const Gate& gate) {
+    return gate.type == GateType::Z || gate.type == GateType::T || gate.type == GateType::CZ;
+}
+
+/**
+ * Gates of a circuit being optimized, with the gates of each qubit in order
+ *
+ * The removed gates stay in the lists (flagged dead) until compact().
+ */
+struct GateLists {
+    std::vector<Gate>& gates;
+    std::vector<bool> alive;
+    std::vector<std::vector<size_t>> on_qubit;
+
+    GateLists(std::vector<Gate>& gates, int num_qubits) : gates(gates), alive(gates.size(), true), on_qubit(num_qubits) {
+    }
+
+    void append(size_t i) {
+        on_qubit[gates[i].target].push_back(i);
+        if (gates[i].control != -1)
+            on_qubit[gates[i].control].push_back(i);
+    }
+
+    /**
+     * Latest gate of qubit q (among the appended ones) that gate i cannot
+     * commute past, or for which partner holds; -1 if none
+     */
+    template<typename F>
+    long scan_back(size_t i, int q, const F& partner) const {
+        const auto& list = on_qubit[q];
+        for (size_t k = list.size();k-- > 0;) {
+            size_t j = list[k];
+            if (!alive[j])
+                continue;
+            if (partner(gates[j]) || !commutes(gates[i], gates[j]))
+                return j;
+        }
+        return -1;
+    }
+
+    /** The gate that gate i meets on all its qubits once the gates in between are commuted away, -1 if none */
+    template<typename F>
+    long find_partner(size_t i, const F& partner) const {
+        const Gate& gate = gates[i];
+        long j = scan_back(i, gate.target, partner);
+        if (j == -1 || !partner(gates[j])) {
+            return -1;
+        }
+        if (gate.control != -1 && scan_back(i, gate.control, partner) != j) {
+            return -1;
+        }
+        return j;
+    }
+
+    /** Remove the dead gates, returns the number removed */
+    size_t compact() {
+        size_t before = gates.size();
+        std::vector<Gate> kept;
+        for (size_t i = 0;i < gates.size();i++) {
+            if (alive[i])
+                kept.push_back(gates[i]);
+        }
+        gates = kept;
+        return before - gates.size();
+    }
+};
+
+/** Remove the self-inverse pairs, and merge the pairs of square roots */
+inline size_t cancel_gates(std::vector<Gate>& gates, int num_qubits) {
+    GateLists lists(gates, num_qubits);
+    for (size_t i = 0;i < gates.size();i++) {
+        Gate& gate = gates[i];
+        auto partner = [&](const Gate& other) {
+            return other.type == gate.type && same_qubits(other, gate);
+        };
+        long j = lists.find_partner(i, partner);
+        if (j == -1) {
+            lists.append(i);
+            continue;
+        }
+        switch (gate.type) {
+        case GateType::SqrtX:
+            gates[j].type = GateType::X;
+            lists.alive[i] = false;
+            break;
+        case GateType::SqrtY:
+            gates[j].type = GateType::Y;
+            lists.alive[i] = false;
+            break;
+        case GateType::T:
+            // Not self-inverse, the phases are merged by merge_phases
+            lists.append(i);
+            break;
+        case GateType::P0:
+        case GateType::P1:
+            // Projections: P.P = P
+            lists.alive[i] = false;
+            break;
+        default:
+            lists.alive[j] = false;
+            lists.alive[i] = false;
+            break;
+        }
+    }
+    return lists.compact();
+}
+
+/** Merge the Z and T of each qubit into its first phase they commute to */
+inline size_t merge_phases(std::vector<Gate>& gates, int num_qubits) {
+    GateLists lists(gates, num_qubits);
+    std::vector<int> eighths(gates.size(), 0); // Phase of the first gate of each merge, in eighths of a turn
+    for (size_t i = 0;i < gates.size();i++) {
+        if (!is_phase(gates[i])) {
+            lists.append(i);
+            continue;
+        }
+        eighths[i] = gates[i].type == GateType::Z ? 4 : 1;
+        long j = lists.find_partner(i, is_phase);
+        if (j == -1) {
+            lists.append(i);
+            continue;
+        }
+        eighths[j] += eighths[i];
+        lists.alive[i] = false;
+    }
+
+    size_t before = gates.size();
+    std::vector<Gate> merged;
+    for (size_t i = 0;i < gates.size();i++) {
+        if (!lists.alive[i])
+            continue;
+        if (!is_phase(gates[i])) {
+            merged.push_back(gates[i]);
+            continue;
+        }
+        Gate phase = gates[i];
+        int k = eighths[i] % 8;
+        if (k & 4) {
+            phase.type = GateType::Z;
+            merged.push_back(phase);
+        }
+        phase.type = GateType::T;
+        for (int t = 0;t < (k & 3);t++) {
+            merged.push_back(phase);
+        }
+    }
+    gates = merged;
+    return before - gates.size();
+}
+
+/** Remove the gates that leave the state unchanged (or its probabilities, if probabilities_only) */
+inline size_t remove_dead_gates(std::vector<Gate>& gates, int num_qubits, bool probabilities_only) {
+    GateLists lists(gates, num_qubits);
+
+    // X|+> = SqrtX|+> = |+>, and CX|c>|+> = |c>|+>
+    std::vector<bool> plus(num_qubits, true);
+    for (size_t i = 0;i < gates.size();i++) {
+        const Gate& gate = gates[i];
+        bool dead = plus[gate.target] && (gate.type == GateType::X || gate.type == GateType::SqrtX || gate.type == GateType::CX);
+        if (dead) {
+            lists.alive[i] = false;
+            continue;
+        }
+        plus[gate.target] = false;
+        if (gate.control != -1)
+            plus[gate.control] = false;
+    }
+
+    // The final diagonal gates commute to the measurement, and only change the phases
+    if (probabilities_only) {
+        std::vector<bool> diagonal_tail(num_qubits, true);
+        for (size_t i = gates.size();i-- > 0;) {
+            const Gate& gate = gates[i];
+            if (!lists.alive[i])
+                continue;
+            bool tail = diagonal_tail[gate.target] && (gate.control == -1 || diagonal_tail[gate.control]);
+            if (tail && is_diagonal_unitary(gate)) {
+                lists.alive[i] = false;
+                continue;
+            }
+            for (int q : { gate.target, gate.control }) {
+                if (q != -1 && action_on(gate, q) != QubitAction::ZBasis)
+                    diagonal_tail[q] = false;
+            }
+        }
+    }
+    return lists.compact();
+}
+
+struct OptimizationReport {
+    size_t gates_before = 0;
+    size_t gates_after = 0;
+    size_t two_qubit_before = 0;
+    size_t two_qubit_after = 0;
+    size_t rounds = 0;
+    std::vector<std::pair<std::string, size_t>> removed; // By pass
+
+    std::string print() const {
+        std::string out = fmt::format("Circuit optimization: {} gates -> {} ({} two-qubit -> {}), {} rounds",
+            gates_before, gates_after, two_qubit_before, two_qubit_after, rounds);
+        for (const auto& [pass, count] : removed) {
+            out += fmt::format("\n  {:<32} {:>8} gates removed", pass, count);
+        }
+        return out;
+    }
+};
+
+inline size_t count_two_qubit_gates(const std::vector<Gate>& gates) {
+    size_t count = 0;
+    for (const auto& gate : gates) {
+        count += gate.control != -1;
+    }
+    return count;
+}
+
+/** Run the passes until they remove no more gates */
+inline Circuit optimize_circuit(const Circuit& circuit, bool probabilities_only, OptimizationReport& report) {
+    int n = circuit.num_qubits;
+    std::vector<std::pair<std::string, std::function<size_t(std::vector<Gate>&)>>> passes = {
+        { "cancellation", [n](std::vector<Gate>& gates) { return cancel_gates(gates, n); } },
+        { "phase merging", [n](std::vector<Gate>& gates) { return merge_phases(gates, n); } },
+        { probabilities_only ? "dead gates (and final phases)" : "dead gates",
+            [n, probabilities_only](std::vector<Gate>& gates) { return remove_dead_gates(gates, n, probabilities_only); } },
+    };
+
+    Circuit optimized = circuit;
+    report = OptimizationReport();
+    report.gates_before = circuit.gates.size();
+    report.two_qubit_before = count_two_qubit_gates(circuit.gates);
+    for (const auto& [name, pass] : passes) {
+        report.removed.push_back({ name, 0 });
+    }
+    size_t removed;
+    do {
+        removed = 0;
+        for (size_t p = 0;p < passes.size();p++) {
+            size_t count = passes[p].second(optimized.gates);
+            report.removed[p].second += count;
+            removed += count;
+        }
+        report.rounds++;
+    } while (removed > 0);
+    report.gates_after = optimized.gates.size();
+    report.two_qubit_after = count_two_qubit_gates(optimized.gates);
+    return optimized;
+}
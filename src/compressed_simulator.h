@@ -0,0 +1,468 @@
+#pragma once
+
+#include "simulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/**
+ * Schrodinger simulation of a compressed state vector
+ *
+ * The amplitudes are stored in blocks of 2^block_qubits (the lowest qubits).
+ * Each real and imaginary part is quantized to bits_per_component bits,
+ * relative to the largest component of its block, and packed into a fixed
+ * number of 64-bit words per block. A block (or a single amplitude) is then
+ * found without any index, and the error of a component is at most
+ * `tolerance` times the largest component of its block.
+ *
+ * The gates are applied in passes of consecutive gates that mix at most
+ * unit_qubits qubits above the blocks (the diagonal gates, and the controls,
+ * do not mix their qubits). A pass runs one thread per unit, the 2^m blocks
+ * that differ by the mixed qubits: the thread decompresses the unit into its
+ * own scratch, applies all the gates of the pass, and recompresses the unit
+ * in place. Every amplitude is thus decoded and encoded once per pass, and
+ * only the compressed state is stored.
+ *
+ * The fidelity is estimated from the error of every recompression: with psi
+ * the state of a pass before and psi' after the quantization, the fidelity
+ * of the pass is |<psi|psi'>|^2 / (<psi|psi> <psi'|psi'>), and the errors of
+ * the passes being independent, the fidelity of the run is their product.
+ */
+constexpr int compressed_block_qubits = 8;
+constexpr int compressed_unit_qubits = 2;
+constexpr size_t compressed_scratch_size = 1ull << (compressed_block_qubits + compressed_unit_qubits);
+
+/** Write the k lowest bits of value at the bit offset of the words (zeroed before) */
+KOKKOS_INLINE_FUNCTION void pack_bits(uint64_t* words, size_t offset, int k, uint64_t value) {
+    size_t w = offset >> 6;
+    int shift = offset & 63;
+    words[w] |= value << shift;
+    if (shift + k > 64) {
+        words[w + 1] |= value >> (64 - shift);
+    }
+}
+
+KOKKOS_INLINE_FUNCTION uint64_t unpack_bits(const uint64_t* words, size_t offset, int k) {
+    size_t w = offset >> 6;
+    int shift = offset & 63;
+    uint64_t value = words[w] >> shift;
+    if (shift + k > 64) {
+        value |= words[w + 1] << (64 - shift);
+    }
+    return value & ((1ull << k) - 1);
+}
+
+/** Apply a one-qubit gate to the pair of amplitudes (|0>, |1>) of its target */
+KOKKOS_INLINE_FUNCTION void apply_pair(GateType type, cmplx& a0, cmplx& a1) {
+    cmplx j = cmplx(0, 1);
+    cmplx new_w[2] = { a0, a1 };
+    switch (type) {
+    case GateType::X:
+        x_gate(a0, a1, new_w);
+        break;
+    case GateType::Y:
+        y_gate(a0, a1, new_w);
+        break;
+    case GateType::Z:
+        z_gate(a0, a1, new_w);
+        break;
+    case GateType::H:
+        h_gate(a0, a1, new_w);
+        break;
+    case GateType::T:
+        new_w[1] = a1 * (1 + j) / Kokkos::sqrt(2.);
+        break;
+    case GateType::P0:
+        p0_gate(a0, a1, new_w);
+        break;
+    case GateType::P1:
+        p1_gate(a0, a1, new_w);
+        break;
+    case GateType::SqrtX:
+        sqrt_x_gate(a0, a1, new_w);
+        break;
+    case GateType::SqrtY:
+        sqrt_y_gate(a0, a1, new_w);
+        break;
+    default:
+        break;
+    }
+    a0 = new_w[0];
+    a1 = new_w[1];
+}
+
+/**
+ * Positions of the qubits in the scratch of a unit
+ *
+ * The scratch holds the blocks of the unit one after the other, the block of
+ * slot s being base | (the bits of s at the block bits of the mixed qubits).
+ * A qubit of the blocks, or a mixed qubit, varies along the scratch with a
+ * stride; any other qubit is constant over the unit (bit of base).
+ */
+struct UnitLayout {
+    int num_qubits;
+    int block_qubits;
+    int num_slots;
+    int slot_bit[compressed_unit_qubits]; // Block bits of the mixed qubits, in increasing order
+    size_t base;
+
+    /** Stride of qubit q along the scratch, 0 if constant */
+    KOKKOS_INLINE_FUNCTION size_t stride(int q) const {
+        int shift = num_qubits - 1 - q;
+        if (shift < block_qubits) {
+            return 1ull << shift;
+        }
+        for (int s = 0;s < num_slots;s++) {
+            if (slot_bit[s] == shift - block_qubits)
+                return 1ull << (block_qubits + s);
+        }
+        return 0;
+    }
+
+    KOKKOS_INLINE_FUNCTION int bit(int q, size_t p) const {
+        size_t step = stride(q);
+        if (step != 0) {
+            return (p & step) != 0;
+        }
+        return (base >> (num_qubits - 1 - q - block_qubits)) & 1;
+    }
+
+    /** Apply a gate to the scratch of size amplitudes (its target varies, unless it is diagonal) */
+    KOKKOS_INLINE_FUNCTION void apply(const Gate& gate, cmplx* scratch, size_t size) const {
+        size_t step = stride(gate.target);
+        if (gate.type == GateType::CZ) {
+            for (size_t p = 0;p < size;p++) {
+                if (bit(gate.control, p) && bit(gate.target, p))
+                    scratch[p] = -scratch[p];
+            }
+        }
+        else if (gate.type == GateType::CX) {
+            for (size_t p = 0;p < size;p++) {
+                if ((p & step) == 0 && bit(gate.control, p)) {
+                    cmplx temp = scratch[p];
+                    scratch[p] = scratch[p + step];
+                    scratch[p + step] = temp;
+                }
+            }
+        }
+        else if (step != 0) {
+            for (size_t p = 0;p < size;p++) {
+                if ((p & step) == 0)
+                    apply_pair(gate.type, scratch[p], scratch[p + step]);
+            }
+        }
+        else {
+            // Diagonal gate on a constant qubit: one factor for the whole unit
+            int value = bit(gate.target, 0);
+            for (size_t p = 0;p < size;p++) {
+                cmplx pair[2] = { 0, 0 };
+                pair[value] = scratch[p];
+                apply_pair(gate.type, pair[0], pair[1]);
+                scratch[p] = pair[value];
+            }
+        }
+    }
+};
+
+struct CompressedSimulator {
+    /** Consecutive gates [first, last), mixing the given qubits above the blocks */
+    struct Pass {
+        size_t first;
+        size_t last;
+        std::vector<int> mixed_qubits;
+    };
+
+    Circuit circuit;
+    precision tolerance;
+    int bits_per_component;
+    int block_qubits;
+    size_t block_size;
+    size_t num_blocks;
+    size_t words_per_block;
+    Kokkos::View<uint64_t*> data;
+    Kokkos::View<precision*> scales; // Largest component of each block
+    Kokkos::View<Gate*> gates;
+    std::vector<Pass> passes;
+    size_t sqrt_counter = 0;
+    precision fidelity = 1; // Estimated, see above
+
+    /** Bits per component such that the error is at most tolerance times the largest component */
+    static int bits_for(precision tolerance) {
+        if (tolerance <= 0 || tolerance > 0.5) {
+            throw std::runtime_error(fmt::format("The compression tolerance must be in (0, 0.5], got {}", tolerance));
+        }
+        double levels = std::ceil(1 / (2 * tolerance));
+        return std::clamp(1 + (int)std::ceil(std::log2(levels + 1)), 2, 32);
+    }
+
+    static int block_qubits_for(int num_qubits) {
+        return MIN(num_qubits, compressed_block_qubits);
+    }
+
+    static size_t words_for(int block_qubits, int bits) {
+        return ((2ull << block_qubits) * bits + 63) / 64;
+    }
+
+    /** Memory of the compressed state, the only large allocation of a run */
+    static MemoryPlan memory_plan(int num_qubits, precision tolerance) {
+        int block_qubits = block_qubits_for(num_qubits);
+        size_t num_blocks = 1ull << (num_qubits - block_qubits);
+        MemoryPlan plan;
+        plan.add("compressed_wave", sizeof(uint64_t) * num_blocks * words_for(block_qubits, bits_for(tolerance)));
+        plan.add("block_scales", sizeof(precision) * num_blocks);
+        return plan;
+    }
+
+    CompressedSimulator(const Circuit& circuit, precision tolerance) : circuit(circuit), tolerance(tolerance),
+        bits_per_component(bits_for(tolerance)),
+        block_qubits(block_qubits_for(circuit.num_qubits)),
+        block_size(1ull << block_qubits),
+        num_blocks(1ull << (circuit.num_qubits - block_qubits)),
+        words_per_block(words_for(block_qubits, bits_per_component)),
+        data(Kokkos::view_alloc(Kokkos::WithoutInitializing, "compressed_wave"), num_blocks * words_per_block),
+        scales("block_scales", num_blocks),
+        gates("gates", circuit.gates.size()) {
+        auto gates_host = Kokkos::create_mirror_view(gates);
+        for (size_t i = 0;i < circuit.gates.size();i++) {
+            gates_host(i) = circuit.gates[i];
+        }
+        Kokkos::deep_copy(gates, gates_host);
+        plan_passes();
+    }
+
+    /** Qubit above the blocks mixed by the gate, -1 if none */
+    int mixed_qubit(const Gate& gate) const {
+        bool diagonal = gate.type == GateType::CZ || gate.type == GateType::Z || gate.type == GateType::T
+            || gate.type == GateType::P0 || gate.type == GateType::P1;
+        if (diagonal || circuit.num_qubits - 1 - gate.target < block_qubits) {
+            return -1;
+        }
+        return gate.target;
+    }
+
+    /** Greedy passes: a gate starts a new pass when it would mix one qubit too many */
+    void plan_passes() {
+        passes.clear();
+        Pass pass{ 0, 0, {} };
+        for (size_t i = 0;i < circuit.gates.size();i++) {
+            int q = mixed_qubit(circuit.gates[i]);
+            bool known = std::find(pass.mixed_qubits.begin(), pass.mixed_qubits.end(), q) != pass.mixed_qubits.end();
+            if (q != -1 && !known) {
+                if (pass.mixed_qubits.size() == compressed_unit_qubits) {
+                    passes.push_back(pass);
+                    pass = Pass{ i, i, {} };
+                }
+                pass.mixed_qubits.push_back(q);
+            }
+            pass.last = i + 1;
+        }
+        if (pass.last > pass.first) {
+            passes.push_back(pass);
+        }
+    }
+
+    /**
+     * Decompress every unit, apply the gates [first, last), and recompress
+     *
+     * Returns the fidelity of the quantization of the pass.
+     */
+    precision apply_pass(size_t first, size_t last, const std::vector<int>& mixed_qubits) {
+        int num_qubits = circuit.num_qubits;
+        UnitLayout layout{ num_qubits, block_qubits, (int)mixed_qubits.size(), {}, 0 };
+        std::vector<int> slot_bits;
+        for (int q : mixed_qubits) {
+            slot_bits.push_back(num_qubits - 1 - q - block_qubits);
+        }
+        std::sort(slot_bits.begin(), slot_bits.end());
+        for (int s = 0;s < layout.num_slots;s++) {
+            layout.slot_bit[s] = slot_bits[s];
+        }
+
+        auto data = this->data;
+        auto scales = this->scales;
+        auto gates = this->gates;
+        size_t block_size = this->block_size;
+        size_t words = words_per_block;
+        int k = bits_per_component;
+        precision levels = (precision)((1ull << (k - 1)) - 1);
+        size_t num_units = num_blocks >> layout.num_slots;
+        size_t unit_blocks = 1ull << layout.num_slots;
+
+        precision overlap_re = 0, overlap_im = 0, norm = 0, norm_quantized = 0;
+        Kokkos::parallel_reduce("compressed_pass", num_units, KOKKOS_LAMBDA(size_t u,
+            precision& overlap_re_, precision& overlap_im_, precision& norm_, precision& norm_quantized_) {
+            UnitLayout unit = layout;
+            size_t base = u;
+            for (int s = 0;s < unit.num_slots;s++) {
+                size_t low = base & ((1ull << unit.slot_bit[s]) - 1);
+                base = ((base >> unit.slot_bit[s]) << (unit.slot_bit[s] + 1)) | low;
+            }
+            unit.base = base;
+            auto block_of = [&](size_t slot) {
+                size_t block = base;
+                for (int s = 0;s < unit.num_slots;s++) {
+                    block |= ((slot >> s) & 1) << unit.slot_bit[s];
+                }
+                return block;
+            };
+
+            cmplx scratch[compressed_scratch_size];
+            for (size_t slot = 0;slot < unit_blocks;slot++) {
+                size_t block = block_of(slot);
+                const uint64_t* in = data.data() + block * words;
+                precision step = scales(block) / levels;
+                for (size_t i = 0;i < block_size;i++) {
+                    precision re = ((precision)unpack_bits(in, 2 * i * k, k) - levels) * step;
+                    precision im = ((precision)unpack_bits(in, (2 * i + 1) * k, k) - levels) * step;
+                    scratch[slot * block_size + i] = cmplx(re, im);
+                }
+            }
+
+            for (size_t g = first;g < last;g++) {
+                unit.apply(gates(g), scratch, unit_blocks * block_size);
+            }
+
+            for (size_t slot = 0;slot < unit_blocks;slot++) {
+                size_t block = block_of(slot);
+                cmplx* amplitudes = scratch + slot * block_size;
+                precision largest = 0;
+                for (size_t i = 0;i < block_size;i++) {
+                    largest = MAX(largest, MAX(ABS(amplitudes[i].real()), ABS(amplitudes[i].imag())));
+                }
+                scales(block) = largest;
+                uint64_t* out = data.data() + block * words;
+                for (size_t w = 0;w < words;w++) {
+                    out[w] = 0;
+                }
+                precision factor = largest > 0 ? levels / largest : 0;
+                precision step = largest / levels;
+                for (size_t i = 0;i < block_size;i++) {
+                    precision re = amplitudes[i].real();
+                    precision im = amplitudes[i].imag();
+                    precision q_re = Kokkos::floor(re * factor + 0.5);
+                    precision q_im = Kokkos::floor(im * factor + 0.5);
+                    pack_bits(out, 2 * i * k, k, (uint64_t)(q_re + levels));
+                    pack_bits(out, (2 * i + 1) * k, k, (uint64_t)(q_im + levels));
+                    precision re_quantized = q_re * step;
+                    precision im_quantized = q_im * step;
+                    overlap_re_ += re * re_quantized + im * im_quantized;
+                    overlap_im_ += re * im_quantized - im * re_quantized;
+                    norm_ += re * re + im * im;
+                    norm_quantized_ += re_quantized * re_quantized + im_quantized * im_quantized;
+                }
+            }
+        }, overlap_re, overlap_im, norm, norm_quantized);
+
+        if (norm == 0 || norm_quantized == 0) {
+            return norm == norm_quantized ? 1 : 0;
+        }
+        return (overlap_re * overlap_re + overlap_im * overlap_im) / (norm * norm_quantized);
+    }
+
+    /** Uniform superposition, stored exactly (every component is the largest of its block) */
+    void initialise_state() {
+        auto data = this->data;
+        auto scales = this->scales;
+        size_t words = words_per_block;
+        int k = bits_per_component;
+        uint64_t one = 2 * ((1ull << (k - 1)) - 1);
+        uint64_t zero = (1ull << (k - 1)) - 1;
+        size_t block_size = this->block_size;
+        Kokkos::parallel_for("initialise_compressed", num_blocks, KOKKOS_LAMBDA(size_t block) {
+            uint64_t* out = data.data() + block * words;
+            for (size_t w = 0;w < words;w++) {
+                out[w] = 0;
+            }
+            for (size_t i = 0;i < block_size;i++) {
+                pack_bits(out, 2 * i * k, k, one);
+                pack_bits(out, (2 * i + 1) * k, k, zero);
+            }
+            scales(block) = 1;
+        });
+        sqrt_counter = circuit.num_qubits;
+        fidelity = 1;
+    }
+
+    void run(bool verbose = true) {
+        Kokkos::Timer timer;
+        initialise_state();
+        for (const auto& pass : passes) {
+            Kokkos::Timer pass_timer;
+            int cycle = circuit.gates[pass.first].cycle;
+            TraceRegion region(fmt::format("compressed pass (cycle {})", cycle), "gate",
+                2. * sizeof(uint64_t) * num_blocks * words_per_block);
+            region.set_args("\"cycle\": {}, \"gates\": {}, \"mixed_qubits\": {}",
+                cycle, pass.last - pass.first, pass.mixed_qubits.size());
+            for (size_t g = pass.first;g < pass.last;g++) {
+                GateType type = circuit.gates[g].type;
+                sqrt_counter += type == GateType::H ? 1 : (type == GateType::SqrtX || type == GateType::SqrtY) ? 2 : 0;
+            }
+            precision pass_fidelity = apply_pass(pass.first, pass.last, pass.mixed_qubits);
+            fidelity *= pass_fidelity;
+            if (verbose) {
+                fmt::println("Cycle: {:>3}, time: {:>10}, {} gates, pass fidelity: {:.10f}",
+                    cycle, print_time(pass_timer.seconds()), pass.last - pass.first, pass_fidelity);
+            }
+        }
+        if (verbose) {
+            Kokkos::fence();
+            fmt::println("Total time: {}", print_time(timer.seconds()));
+        }
+    }
+
+    /** Decoder of the normalised amplitudes, to call in the kernels */
+    struct Decoder {
+        Kokkos::View<uint64_t*> data;
+        Kokkos::View<precision*> scales;
+        size_t words;
+        int block_qubits;
+        int k;
+        precision levels;
+        precision norm;
+
+        KOKKOS_INLINE_FUNCTION cmplx operator()(size_t x) const {
+            size_t block = x >> block_qubits;
+            size_t i = x & ((1ull << block_qubits) - 1);
+            const uint64_t* in = data.data() + block * words;
+            precision step = scales(block) / levels * norm;
+            precision re = ((precision)unpack_bits(in, 2 * i * k, k) - levels) * step;
+            precision im = ((precision)unpack_bits(in, (2 * i + 1) * k, k) - levels) * step;
+            return cmplx(re, im);
+        }
+    };
+
+    Decoder decoder() const {
+        int k = bits_per_component;
+        return Decoder{ data, scales, words_per_block, block_qubits, k,
+            (precision)((1ull << (k - 1)) - 1), 1 / Kokkos::pow(Kokkos::sqrt(2.), sqrt_counter) };
+    }
+
+    /** Normalised amplitudes of the given bitstrings, decoded from their blocks */
+    Kokkos::View<cmplx*> read_amplitudes(const Kokkos::View<size_t*>& bitstrings) const {
+        Kokkos::View<cmplx*> amplitudes("amplitudes", bitstrings.extent(0));
+        Decoder decode = decoder();
+        Kokkos::parallel_for("read_compressed", bitstrings.extent(0), KOKKOS_LAMBDA(size_t s) {
+            amplitudes(s) = decode(bitstrings(s));
+        });
+        return amplitudes;
+    }
+
+    /** The whole normalised statevector (which must fit into memory uncompressed) */
+    StateVector decompress() const {
+        Kokkos::View<cmplx*> wave = allocate_state("wave", 1ull << circuit.num_qubits);
+        Decoder decode = decoder();
+        Kokkos::parallel_for("decompress_state", wave.extent(0), KOKKOS_LAMBDA(size_t i) {
+            wave(i) = decode(i);
+        });
+        return StateVector{ circuit.num_qubits, wave };
+    }
+
+    std::string print() const {
+        size_t bytes = memory_plan(circuit.num_qubits, tolerance).total();
+        size_t full = wave_function_memory_size<precision>(circuit.num_qubits);
+        return fmt::format("Compressed state: {} bits per component, blocks of {} amplitudes, {} ({:.1f}x smaller than {}), {} passes over {} gates",
+            bits_per_component, block_size, print_filesize(bytes), (double)full / bytes, print_filesize(full),
+            passes.size(), circuit.gates.size());
+    }
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include "complex.h"
+#include "types.h"
+
+#ifdef HAS_MPI
+#include <mpi.h>
+#endif
+
+/**
+ * Thin layer over MPI
+ *
+ * Without HAS_MPI, every process is its own world of size 1 and the functions
+ * are no-ops: shards are then combined from files with qc-merge-shards.
+ */
+
+inline void distributed_init(int* argc, char*** argv) {
+#ifdef HAS_MPI
+    MPI_Init(argc, argv);
+#endif
+}
+
+inline void distributed_finalize() {
+#ifdef HAS_MPI
+    MPI_Finalize();
+#endif
+}
+
+inline int process_rank() {
+    int rank = 0;
+#ifdef HAS_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+    return rank;
+}
+
+inline int num_processes() {
+    int size = 1;
+#ifdef HAS_MPI
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+#endif
+    return size;
+}
+
+/** Send the bitstrings of rank 0 to all the processes */
+inline void broadcast_bitstrings(const Kokkos::View<size_t*>& bitstrings) {
+#ifdef HAS_MPI
+    if (num_processes() == 1) {
+        return;
+    }
+    auto host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), bitstrings);
+    const size_t chunk = 1ull << 28;
+    for (size_t i = 0;i < host.extent(0);i += chunk) {
+        int count = MIN(chunk, host.extent(0) - i);
+        MPI_Bcast(host.data() + i, count, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    }
+    Kokkos::deep_copy(bitstrings, host);
+#endif
+}
+
+/** Sum the amplitudes of all the processes into rank 0 */
+inline void reduce_amplitudes(const Kokkos::View<cmplx*>& wave) {
+#ifdef HAS_MPI
+    if (num_processes() == 1) {
+        return;
+    }
+    Kokkos::fence();
+    auto host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), wave);
+    double* data = reinterpret_cast<double*>(host.data());
+    size_t size = 2 * host.extent(0);
+    const size_t chunk = 1ull << 28;
+    for (size_t i = 0;i < size;i += chunk) {
+        int count = MIN(chunk, size - i);
+        if (process_rank() == 0)
+            MPI_Reduce(MPI_IN_PLACE, data + i, count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        else
+            MPI_Reduce(data + i, nullptr, count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+    Kokkos::deep_copy(wave, host);
+#endif
+}
+
+/** Send a value of rank 0 to all the processes */
+inline void broadcast_value(uint64_t& value) {
+#ifdef HAS_MPI
+    MPI_Bcast(&value, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+#endif
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "simulator.h"
+
+#include <vector>
+
+/**
+ * State kept as a tensor product of sub-states over disjoint groups of qubits
+ *
+ * The simulations start from the uniform superposition, a product of n
+ * one-qubit states. A gate within a group only sweeps the sub-state of this
+ * group, and a two-qubit gate across two groups first merges them (outer
+ * product). The first cycles of a GRCS circuit only connect small groups, so
+ * they cost a few small kernels instead of sweeps of 2^n amplitudes.
+ *
+ * Each group is a SchrodingerSimulator over its qubits, the global qubits of
+ * a group being listed in local order (local qubit 0 is the most significant
+ * bit). The groups are merged by concatenating their qubits, such that the
+ * qubit order only matters when the full state is materialised.
+ */
+struct FactorizedState {
+    int num_qubits;
+    std::vector<SchrodingerSimulator> groups;
+    std::vector<std::vector<int>> qubits; // Global qubits of each group, in local order
+    std::vector<int> group_of;
+    std::vector<int> position_of;         // Local position of each qubit in its group
+
+    FactorizedState(int num_qubits) : num_qubits(num_qubits), group_of(num_qubits), position_of(num_qubits, 0) {
+        for (int q = 0;q < num_qubits;q++) {
+            SchrodingerSimulator group;
+            group.circuit.num_qubits = 1;
+            group.N = 2;
+            group.wave = allocate_state("factor", 2);
+            group.initialise_state(true);
+            groups.push_back(group);
+            qubits.push_back({ q });
+            group_of[q] = q;
+        }
+    }
+
+    size_t largest_group() const {
+        size_t largest = 0;
+        for (const auto& group : qubits) {
+            largest = MAX(largest, group.size());
+        }
+        return largest;
+    }
+
+    /** Merge group b into group a, with the qubits of b after the ones of a */
+    void merge(int a, int b) {
+        const auto& group_a = groups[a];
+        const auto& group_b = groups[b];
+        SchrodingerSimulator merged;
+        merged.circuit.num_qubits = group_a.circuit.num_qubits + group_b.circuit.num_qubits;
+        merged.N = group_a.N * group_b.N;
+        merged.wave = allocate_state("factor", merged.N);
+        merged.sqrt_counter = group_a.sqrt_counter + group_b.sqrt_counter;
+
+        auto wave = merged.wave;
+        auto wave_a = group_a.wave;
+        auto wave_b = group_b.wave;
+        size_t n_b = group_b.N;
+        Kokkos::parallel_for("merge_factors", __2D_RANGE_POLICY(group_a.N, group_b.N, ExecSpace), KOKKOS_LAMBDA(size_t i, size_t j) {
+            wave(i * n_b + j) = wave_a(i) * wave_b(j);
+        });
+
+        int shift = qubits[a].size();
+        for (int q : qubits[b]) {
+            position_of[q] += shift;
+            qubits[a].push_back(q);
+        }
+        groups[a] = merged;
+        groups.erase(groups.begin() + b);
+        qubits.erase(qubits.begin() + b);
+        for (int g = 0;g < groups.size();g++) {
+            for (int q : qubits[g]) {
+                group_of[q] = g;
+            }
+        }
+    }
+
+    /**
+     * Apply a gate, merging the groups of its qubits if needed
+     *
+     * Returns false (and does not apply the gate) if the merge would cover
+     * all the qubits: the full state is then needed, see materialise().
+     */
+    bool apply_gate(const Gate& gate) {
+        if (gate.control != -1 && group_of[gate.control] != group_of[gate.target]) {
+            int a = group_of[gate.control];
+            int b = group_of[gate.target];
+            if (qubits[a].size() + qubits[b].size() == num_qubits) {
+                return false;
+            }
+            merge(MIN(a, b), MAX(a, b));
+        }
+        Gate local = gate;
+        local.target = position_of[gate.target];
+        if (gate.control != -1) {
+            local.control = position_of[gate.control];
+        }
+        groups[group_of[gate.target]].apply_gate(local, false);
+        return true;
+    }
+
+    /**
+     * Write the full state (unnormalised, in the global qubit order) into the
+     * wavefunction of the simulator, and set its sqrt counter
+     *
+     * Each amplitude is the product of one amplitude per group, whose local
+     * index gathers the bits of the global index of the qubits of the group.
+     */
+    void materialise(SchrodingerSimulator& simulator) {
+        int num_groups = groups.size();
+        std::vector<size_t> offsets(num_groups + 1, 0);
+        for (int g = 0;g < num_groups;g++) {
+            offsets[g + 1] = offsets[g] + groups[g].N;
+        }
+
+        // All the factors in one buffer, and the qubits grouped in local order
+        Kokkos::View<cmplx*> factors("factors", offsets.back());
+        Kokkos::View<size_t*> factor_offset("factor_offset", num_groups);
+        Kokkos::View<int*> group_end("group_end", num_groups);
+        Kokkos::View<int*> qubit_shift("qubit_shift", num_qubits);
+        auto offset_host = Kokkos::create_mirror_view(factor_offset);
+        auto end_host = Kokkos::create_mirror_view(group_end);
+        auto shift_host = Kokkos::create_mirror_view(qubit_shift);
+        size_t sqrt_counter = 0;
+        int next = 0;
+        for (int g = 0;g < num_groups;g++) {
+            Kokkos::deep_copy(Kokkos::subview(factors, std::make_pair(offsets[g], offsets[g + 1])), groups[g].wave);
+            offset_host(g) = offsets[g];
+            for (int q : qubits[g]) {
+                shift_host(next++) = num_qubits - 1 - q;
+            }
+            end_host(g) = next;
+            sqrt_counter += groups[g].sqrt_counter;
+        }
+        Kokkos::deep_copy(factor_offset, offset_host);
+        Kokkos::deep_copy(group_end, end_host);
+        Kokkos::deep_copy(qubit_shift, shift_host);
+
+        auto wave = simulator.wave;
+        Kokkos::parallel_for("materialise_factors", simulator.N, KOKKOS_LAMBDA(size_t idx) {
+            cmplx amplitude = 1.;
+            int k = 0;
+            for (int g = 0;g < num_groups;g++) {
+                size_t local = 0;
+                for (;k < group_end(g);k++) {
+                    local = (local << 1) | ((idx >> qubit_shift(k)) & 1);
+                }
+                amplitude *= factors(factor_offset(g) + local);
+            }
+            wave(idx) = amplitude;
+        });
+        simulator.sqrt_counter = sqrt_counter;
+    }
+};
+
+/**
+ * Apply gates from the uniform superposition, factorized as long as the state
+ * is not entangled over all the qubits
+ *
+ * The state is then materialised into the simulator, and the index of the
+ * first gate left to apply is returned (see SchrodingerSimulator::run).
+ */
+inline size_t apply_factorized(SchrodingerSimulator& simulator, const std::vector<Gate>& gates, bool verbose = false) {
+    FactorizedState state(simulator.circuit.num_qubits);
+    size_t i = 0;
+    while (i < gates.size() && state.apply_gate(gates[i])) {
+        i++;
+    }
+    if (verbose) {
+        int cycle = i < gates.size() ? gates[i].cycle : (gates.empty() ? 0 : gates.back().cycle);
+        fmt::println("Factorized state: {} gates applied (until cycle {}), {} groups, largest group: {} qubits",
+            i, cycle, state.groups.size(), state.largest_group());
+    }
+    state.materialise(simulator);
+    return i;
+}
@@ -1,6 +1,10 @@
 #pragma once
 
 #include "simulator.h"
+#include "factorized_state.h"
+#include "path_selection.h"
+#include "checkpointer.h"
+#include "sorted_bitstrings.h"
 
 #include <vector>
 #include <map>
@@ -9,15 +13,6 @@
 
 using Amplitude = Kokkos::View<cmplx*>;
 
-KOKKOS_INLINE_FUNCTION cmplx get_amplitude(const Amplitude& wave_1, const Amplitude& wave_2, int num_qubits, int cut_idx, int idx) {
-    size_t mask_1 = (1ull << cut_idx) - 1;
-    mask_1 = mask_1 << (num_qubits - cut_idx);
-    size_t mask_2 = (1ull << (num_qubits - cut_idx)) - 1;
-    size_t idx_1 = (idx & mask_1) >> (num_qubits - cut_idx);
-    size_t idx_2 = idx & mask_2;
-    return wave_1(idx_1) * wave_2(idx_2);
-}
-
 struct FeynmanSimulator {
     Circuit global_circuit;
     int cut_idx;
@@ -26,9 +21,24 @@ struct FeynmanSimulator {
     float fidelity;
     int num_qubits;
     size_t max_memory;
+    size_t num_amplitudes; // Requested amplitudes per run, 0 for the full statevector
+    bool recursive;
+    bool factorized = false; // Apply the gates before the first cross gate with a factorized state
+    MemoryPlan memory;
     size_t counter = 0;
     size_t N1;
     size_t N2;
+    PathSelection paths;
+    std::shared_ptr<Checkpointer> checkpointer;
+
+    // Pruning of the paths whose weight (product of the half-state norms) is below the tolerance
+    precision prune_tolerance = 0;
+    size_t pruned_paths = 0;
+    precision pruned_weight = 0;
+
+    // Indices in wave_1 and wave_2 of the (sorted) requested bitstrings, empty for the full statevector
+    Kokkos::View<uint32_t*> split_1;
+    Kokkos::View<uint32_t*> split_2;
 
     int count_number_of_cross_CZ(int cut) {
         int count = 0;
@@ -42,19 +52,61 @@ struct FeynmanSimulator {
         return count;
     }
 
+    /**
+     * Peak memory of a run with the given cut
+     *
+     * The flat simulation keeps the initial halves and the halves of the
+     * current path, the recursive one keeps a copy of the halves per level
+     * of the tree of paths. In factorized mode, the groups of each initial
+     * half take at most 3/4 of it (see the Schrodinger simulator), the
+     * halves being factorized one after the other.
+     */
+    MemoryPlan memory_plan(int cut, int num_cross, size_t amplitudes, bool recursive) const {
+        MemoryPlan plan;
+        size_t copies = recursive ? num_cross + 1 : 2;
+        plan.add("wave_1", wave_function_memory_size<precision>(cut), copies);
+        plan.add("wave_2", wave_function_memory_size<precision>(num_qubits - cut), copies);
+        if (factorized)
+            plan.add("factors", wave_function_memory_size<precision>(MAX(cut, num_qubits - cut)) / 4 * 3);
+        plan.add(SortedBitstrings::memory_plan(amplitudes, num_qubits));
+        if (amplitudes > 0) {
+            plan.add("split_1 + split_2", 2 * sizeof(uint32_t) * amplitudes);
+        }
+        return plan;
+    }
+
+    /** Plan of the chosen cut, falling back to the flat simulation if the recursive one does not fit */
+    void plan_memory() {
+        memory = memory_plan(cut_idx, num_xCZ, num_amplitudes, recursive);
+        if (!memory.fits(max_memory) && recursive) {
+            MemoryPlan flat = memory_plan(cut_idx, num_xCZ, num_amplitudes, false);
+            if (flat.fits(max_memory)) {
+                fmt::println("The recursive simulation needs {} (over the budget of {}), running the flat simulation",
+                    print_filesize(memory.total()), print_filesize(max_memory));
+                recursive = false;
+                memory = flat;
+            }
+        }
+        if (!memory.fits(max_memory)) {
+            throw std::runtime_error(fmt::format("The simulation needs {}, over the memory budget of {}:\n{}",
+                print_filesize(memory.total()), print_filesize(max_memory), memory.print()));
+        }
+        fmt::println("Memory plan:\n{}", memory.print());
+    }
+
     int find_optimal_cut() {
         int optimal_cut;
         int max_num_xCZ = 1e9;
         bool found = false;
         fmt::println("Finding optimal circuit cut that fits into memory");
         for (int i = 1;i < num_qubits;i++) {
-            size_t memory_1 = wave_function_memory_size<precision>(i);
-            size_t memory_2 = wave_function_memory_size<precision>(num_qubits - i);
             int num_xCZ = count_number_of_cross_CZ(i);
-            if (memory_1 * 4 + memory_2 * 4 <= max_memory) {
+            // A recursive plan that does not fit may still run flat, see plan_memory()
+            MemoryPlan plan = memory_plan(i, num_xCZ, num_amplitudes, false);
+            if (plan.fits(max_memory)) {
                 found = true;
-                fmt::println("  Cut idx: {}, Number of cross CZ: {}, Memory left: {}, Memory right: {}",
-                    i, num_xCZ, print_filesize(memory_1), print_filesize(memory_2));
+                fmt::println("  Cut idx: {}, Number of cross CZ: {}, Memory: {}",
+                    i, num_xCZ, print_filesize(plan.total()));
                 if (num_xCZ < max_num_xCZ) {
                     max_num_xCZ = num_xCZ;
                     optimal_cut = i;
@@ -73,7 +125,17 @@ struct FeynmanSimulator {
         return optimal_cut;
     }
 
-    FeynmanSimulator(const Circuit& global_circuit, float fidelity, size_t max_memory, int cut_at) : global_circuit(global_circuit), fidelity(fidelity), max_memory(max_memory) {
+    /**
+     * @param max_memory memory budget in bytes (0 for no limit)
+     * @param num_amplitudes amplitudes requested per run (0 for the full
+     * statevector), to plan the memory of the runs
+     * @param recursive planned mode, may fall back to flat to fit the budget
+     * @param factorized initial halves computed as factorized states
+     */
+    FeynmanSimulator(const Circuit& global_circuit, float fidelity, size_t max_memory, int cut_at, size_t num_amplitudes = 0,
+        bool recursive = false, bool factorized = false)
+        : global_circuit(global_circuit), fidelity(fidelity), max_memory(max_memory), num_amplitudes(num_amplitudes),
+        recursive(recursive), factorized(factorized) {
         num_qubits = global_circuit.num_qubits;
         if (cut_at >= 0) {
             cut_idx = cut_at;
@@ -87,21 +149,129 @@ struct FeynmanSimulator {
 
         N1 = 1ull << cut_idx;
         N2 = 1ull << (num_qubits - cut_idx);
+        paths = PathSelection(num_paths);
+        plan_memory();
+    }
+
+    /**
+     * Split the requested bitstrings at the cut, once per run
+     *
+     * The bitstrings are expected sorted, such that the gathers of every path
+     * read wave_1 and wave_2 monotonically.
+     */
+    void split_bitstrings(const Kokkos::View<size_t*>& bitstrings) {
+        if (cut_idx > 32 || num_qubits - cut_idx > 32) {
+            throw std::runtime_error("The halves of the cut must have at most 32 qubits");
+        }
+        split_1 = Kokkos::View<uint32_t*>("split_1", bitstrings.extent(0));
+        split_2 = Kokkos::View<uint32_t*>("split_2", bitstrings.extent(0));
+        auto idx_1 = split_1;
+        auto idx_2 = split_2;
+        int shift = num_qubits - cut_idx;
+        size_t mask_2 = N2 - 1;
+        Kokkos::parallel_for("split_bitstrings", bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) {
+            size_t idx = bitstrings(i);
+            idx_1(i) = idx >> shift;
+            idx_2(i) = idx & mask_2;
+        });
+    }
+
+    /**
+     * Add the contribution of one Feynman path to the accumulator
+     *
+     * If no bitstrings were requested, the full statevector is requested: the
+     * outer product of sim_1.wave and sim_2.wave is added directly to
+     * global_wave (of size N1 * N2), with idx = idx_1 * N2 + idx_2. This
+     * avoids any index array, and writes global_wave contiguously.
+     * Otherwise, the amplitudes of the requested bitstrings are gathered from
+     * the precomputed split indices.
+     */
+    void accumulate(
+        const SchrodingerSimulator& sim_1, const SchrodingerSimulator& sim_2,
+        Kokkos::View<cmplx*>& global_wave
+    ) {
+        auto wave_1 = sim_1.wave;
+        auto wave_2 = sim_2.wave;
+        if (split_1.extent(0) == 0) {
+            size_t n2 = N2;
+            TraceRegion region("accumulate_dense", "kernel", 2. * sizeof(cmplx) * global_wave.extent(0));
+            Kokkos::parallel_for("accumulate_dense", __2D_RANGE_POLICY(N1, N2, ExecSpace), KOKKOS_LAMBDA(size_t i1, size_t i2) {
+                global_wave(i1 * n2 + i2) += wave_1(i1) * wave_2(i2);
+            });
+        }
+        else {
+            auto idx_1 = split_1;
+            auto idx_2 = split_2;
+            // Split indices, the two half amplitudes, and the accumulator
+            TraceRegion region("accumulate_gather", "kernel", (2. * sizeof(uint32_t) + 4. * sizeof(cmplx)) * global_wave.extent(0));
+            Kokkos::parallel_for("accumulate_gather", global_wave.extent(0), KOKKOS_LAMBDA(size_t i) {
+                global_wave(i) += wave_1(idx_1(i)) * wave_2(idx_2(i));
+            });
+        }
+    }
+
+    /**
+     * Apply P0 (value = 0) or P1 (value = 1) on the target
+     *
+     * When pruning, returns the squared norm of the projected half-state
+     * (computed in the same sweep), otherwise the norm is not tracked.
+     */
+    precision project(SchrodingerSimulator& sim, int target, int value, precision norm) {
+        if (prune_tolerance <= 0) {
+            Gate gate;
+            gate.type = value ? GateType::P1 : GateType::P0;
+            gate.target = target;
+            sim.apply_gate(gate, false);
+            return norm;
+        }
+        return sim.apply_projection(target, value);
+    }
+
+    /**
+     * Decide whether to discard the num_discarded paths that continue from
+     * the half-states of squared norms norm_1 and norm_2
+     *
+     * The rest of the circuit (including the sum over the remaining paths) is
+     * unitary, so sqrt(norm_1 * norm_2) is exactly the norm of what these
+     * paths add to the statevector, and the sum of the pruned weights bounds
+     * the error on the statevector (2-norm).
+     */
+    bool prune(precision norm_1, precision norm_2, size_t num_discarded) {
+        precision weight = Kokkos::sqrt(norm_1 * norm_2);
+        if (prune_tolerance <= 0 || weight >= prune_tolerance) {
+            return false;
+        }
+        pruned_paths += num_discarded;
+        pruned_weight += weight;
+        return true;
+    }
+
+    void print_pruning() {
+        if (prune_tolerance > 0) {
+            fmt::println("Pruned paths: {}, discarded weight (error bound on the statevector): {:.3e}", pruned_paths, pruned_weight);
+        }
     }
 
     void recursive_path(
-        std::mt19937& rng,
+        size_t path,
         float fidelity,
-        const Kokkos::View<size_t*>& bitstrings,
         Kokkos::View<cmplx*>& global_wave,
         SchrodingerSimulator& sim_1, SchrodingerSimulator& sim_2,
+        precision norm_1, precision norm_2,
         int gate_idx, int level, int verbose
     ) {
+        // Skip the subtrees that do not contain any selected path
+        size_t subtree_size = 1ull << (num_xCZ - level);
+        if (!paths.overlaps(path * subtree_size, (path + 1) * subtree_size)) {
+            return;
+        }
+        TraceRegion region(level == num_xCZ ? fmt::format("path {}", path) : fmt::format("subtree {} (level {})", path, level), "path");
         if (level == num_xCZ) { // Last level (leaf in tree of paths)
             counter++;
-            std::uniform_real_distribution<precision> dist(0.0, 1.0);
-            precision r = dist(rng);
-            if (r > fidelity) { // Discard path with probability fidelity
+            if (checkpointer) { // All the paths before this one are done
+                checkpointer->update(global_wave, path, pruned_paths, pruned_weight);
+            }
+            if (!paths.keep(path, fidelity)) { // Discard path with probability fidelity
                 return;
             }
         }
@@ -150,11 +320,7 @@ struct FeynmanSimulator {
             // Add the end of run, add the wave to the accumulator
             sim_1.normalise();
             sim_2.normalise();
-            Kokkos::parallel_for(bitstrings.extent(0), KOKKOS_CLASS_LAMBDA(size_t i) {
-                size_t idx = bitstrings(i);
-                auto ampl = get_amplitude(sim_1.wave, sim_2.wave, num_qubits, cut_idx, idx);
-                global_wave(i) += ampl;
-            });
+            accumulate(sim_1, sim_2, global_wave);
             return;
         }
 
@@ -163,26 +329,26 @@ struct FeynmanSimulator {
         auto sim_2_cpy = sim_2.copy();
         auto gate_cpy = global_circuit.gates[diverging_idx];
 
+        size_t child_size = subtree_size / 2;
+
         // Left path first (replace the ctrl with P0)
+        precision left_1 = norm_1;
+        precision left_2 = norm_2;
         if (is_control_in_1) {
-            Gate gate;
-            gate.type = GateType::P0;
-            gate.target = gate_cpy.control;
-            sim_1.apply_gate(gate, false);
+            left_1 = project(sim_1, gate_cpy.control, 0, norm_1);
         }
         else {
-            Gate gate;
-            gate.type = GateType::P0;
-            gate.target = gate_cpy.control - cut_idx;
-            sim_2.apply_gate(gate, false);
+            left_2 = project(sim_2, gate_cpy.control - cut_idx, 0, norm_2);
+        }
+        if (!prune(left_1, left_2, paths.count(2 * path * child_size, (2 * path + 1) * child_size))) {
+            recursive_path(2 * path, fidelity, global_wave, sim_1, sim_2, left_1, left_2, diverging_idx + 1, level + 1, verbose);
         }
-        recursive_path(rng, fidelity, bitstrings, global_wave, sim_1, sim_2, diverging_idx + 1, level + 1, verbose);
         // Right path (replace the ctrl with P1 and target with Z)
+        precision right_1 = norm_1;
+        precision right_2 = norm_2;
         if (is_control_in_1) {
+            right_1 = project(sim_1_cpy, gate_cpy.control, 1, norm_1);
             Gate gate;
-            gate.type = GateType::P1;
-            gate.target = gate_cpy.control;
-            sim_1_cpy.apply_gate(gate, false);
             gate.type = GateType::Z;
             gate.target = gate_cpy.target - cut_idx;
             sim_2_cpy.apply_gate(gate, false);
@@ -192,74 +358,149 @@ struct FeynmanSimulator {
             gate.type = GateType::Z;
             gate.target = gate_cpy.target;
             sim_1_cpy.apply_gate(gate, false);
-            gate.type = GateType::P1;
-            gate.target = gate_cpy.control - cut_idx;
-            sim_2_cpy.apply_gate(gate, false);
+            right_2 = project(sim_2_cpy, gate_cpy.control - cut_idx, 1, norm_2);
+        }
+        if (!prune(right_1, right_2, paths.count((2 * path + 1) * child_size, (2 * path + 2) * child_size))) {
+            recursive_path(2 * path + 1, fidelity, global_wave, sim_1_cpy, sim_2_cpy, right_1, right_2, diverging_idx + 1, level + 1, verbose);
         }
-        recursive_path(rng, fidelity, bitstrings, global_wave, sim_1_cpy, sim_2_cpy, diverging_idx + 1, level + 1, verbose);
     }
 
-    Kokkos::View<cmplx*> run(const Kokkos::View<size_t*>& bitstrings, float fidelity, int verbose = true) {
-        std::random_device dev;
-        std::mt19937 rng(dev());
+    /**
+     * Initial halves, shared by all the paths
+     *
+     * The gates before the first cross gate are the same for every path: in
+     * factorized mode, they are applied once to the initial halves, each one
+     * as a factorized state (see FactorizedState), and the paths start from
+     * the first cross gate. Returns the index of the first gate of the paths.
+     */
+    int initialise_halves(SchrodingerSimulator& sim_1, SchrodingerSimulator& sim_2) {
+        if (!factorized) {
+            sim_1.initialise_state(true);
+            sim_2.initialise_state(true);
+            return 0;
+        }
+        std::vector<Gate> gates_1;
+        std::vector<Gate> gates_2;
+        int prefix = 0;
+        for (;prefix < global_circuit.gates.size();prefix++) {
+            Gate gate = global_circuit.gates[prefix];
+            bool is_target_in_1 = gate.target < cut_idx;
+            bool is_control_in_1 = gate.control < cut_idx;
+            if (gate.control != -1 && is_target_in_1 != is_control_in_1) {
+                break;
+            }
+            if (is_target_in_1) {
+                gates_1.push_back(gate);
+            }
+            else {
+                gate.target -= cut_idx;
+                if (gate.control != -1)
+                    gate.control -= cut_idx;
+                gates_2.push_back(gate);
+            }
+        }
+        for (auto [sim, gates] : { std::make_pair(&sim_1, &gates_1), std::make_pair(&sim_2, &gates_2) }) {
+            for (size_t i = apply_factorized(*sim, *gates);i < gates->size();i++) {
+                sim->apply_gate((*gates)[i], false);
+            }
+        }
+        fmt::println("Gates shared by all the paths: {} (until cycle {})", prefix,
+            prefix < global_circuit.gates.size() ? global_circuit.gates[prefix].cycle : global_circuit.depth);
+        return prefix;
+    }
 
+    /**
+     * Run the simulation on the requested bitstrings
+     *
+     * Pass an empty bitstrings View to get the full statevector.
+     */
+    Kokkos::View<cmplx*> run(const Kokkos::View<size_t*>& bitstrings, float fidelity, int verbose = true) {
         Kokkos::Timer timer;
 
         SchrodingerSimulator simulator_1;
         SchrodingerSimulator simulator_2;
         simulator_1.N = N1;
         simulator_2.N = N2;
-        simulator_1.wave = Amplitude("wave_1", N1);
-        simulator_2.wave = Amplitude("wave_2", N2);
+        simulator_1.wave = allocate_state("wave_1", N1);
+        simulator_2.wave = allocate_state("wave_2", N2);
         simulator_1.circuit.num_qubits = cut_idx;
         simulator_2.circuit.num_qubits = num_qubits - cut_idx;
-        simulator_1.initialise_state(true);
-        simulator_2.initialise_state(true);
+        int first_gate = initialise_halves(simulator_1, simulator_2);
 
         counter = 0;
+        pruned_paths = 0;
+        pruned_weight = 0;
+
+        SortedBitstrings sorted(bitstrings);
+        split_bitstrings(sorted.bitstrings);
 
-        Kokkos::View<cmplx*> global_wave("global_wave", bitstrings.size());
+        size_t num_amplitudes = bitstrings.extent(0) == 0 ? N1 * N2 : bitstrings.extent(0);
+        Kokkos::View<cmplx*> global_wave("global_wave", num_amplitudes);
+
+        PathSelection selection = paths;
+        if (checkpointer) {
+            paths.begin = checkpointer->start(global_circuit, fidelity, prune_tolerance, num_paths, paths, { 0, cut_idx, num_qubits }, sorted.bitstrings, global_wave, pruned_paths, pruned_weight);
+        }
 
-        recursive_path(rng, fidelity, bitstrings, global_wave, simulator_1, simulator_2, 0, 0, verbose);
+        recursive_path(0, fidelity, global_wave, simulator_1, simulator_2, 1, 1, first_gate, 0, verbose);
+
+        paths = selection;
+        if (checkpointer) {
+            checkpointer->finish();
+        }
+        print_pruning();
 
         if (verbose) {
             Kokkos::fence();
             fmt::println("Total time: {}", print_time(timer.seconds()));
         }
-        return global_wave;
+        return sorted.unpermute(global_wave);
     }
 
     Kokkos::View<cmplx*> run_flat(const Kokkos::View<size_t*>& bitstrings, float fidelity, int verbose = true) {
-        std::random_device dev;
-        std::mt19937 rng(dev());
-
         SchrodingerSimulator simulator_1;
         SchrodingerSimulator simulator_2;
         simulator_1.N = N1;
         simulator_2.N = N2;
-        simulator_1.wave = Amplitude("wave_1", N1);
-        simulator_2.wave = Amplitude("wave_2", N2);
+        simulator_1.wave = allocate_state("wave_1", N1);
+        simulator_2.wave = allocate_state("wave_2", N2);
         simulator_1.circuit.num_qubits = cut_idx;
         simulator_2.circuit.num_qubits = num_qubits - cut_idx;
-        simulator_1.initialise_state(true);
-        simulator_2.initialise_state(true);
+        int first_gate = initialise_halves(simulator_1, simulator_2);
 
-        Kokkos::View<cmplx*> global_wave("global_wave", bitstrings.size());
+        SortedBitstrings sorted(bitstrings);
+        split_bitstrings(sorted.bitstrings);
+
+        size_t num_amplitudes = bitstrings.extent(0) == 0 ? N1 * N2 : bitstrings.extent(0);
+        Kokkos::View<cmplx*> global_wave("global_wave", num_amplitudes);
+
+        // Restored by the checkpoint, if any
+        pruned_paths = 0;
+        pruned_weight = 0;
+        size_t first_path = paths.begin;
+        if (checkpointer) {
+            first_path = checkpointer->start(global_circuit, fidelity, prune_tolerance, num_paths, paths, { 0, cut_idx, num_qubits }, sorted.bitstrings, global_wave, pruned_paths, pruned_weight);
+        }
 
         Kokkos::Timer timer;
-        for (size_t p = 0;p < num_paths;p++) {
-            std::uniform_real_distribution<precision> dist(0.0, 1.0);
-            precision r = dist(rng);
-            if (r > fidelity) { // Discard path with probability fidelity
+        for (size_t p = first_path;p < paths.end;p++) {
+            if (checkpointer) { // All the paths before p are done
+                checkpointer->update(global_wave, p, pruned_paths, pruned_weight);
+            }
+            if (!paths.keep(p, fidelity)) { // Discard path with probability fidelity
                 continue;
             }
+            TraceRegion region(fmt::format("path {}", p), "path");
             auto sim_1 = simulator_1.copy();
             auto sim_2 = simulator_2.copy();
 
             Kokkos::Timer path_timer;
 
+            precision norm_1 = 1;
+            precision norm_2 = 1;
+            bool pruned = false;
             int xCZ_idx = 0;
-            for (int i = 0;i < global_circuit.gates.size();i++) {
+            for (int i = first_gate;i < global_circuit.gates.size() && !pruned;i++) {
                 auto gate = global_circuit.gates[i];
                 bool is_target_in_1 = gate.target < cut_idx;
                 bool is_control_in_1 = gate.control < cut_idx;
@@ -282,27 +523,19 @@ struct FeynmanSimulator {
                         sim_2.apply_gate(gate, false);
                     }
                     else {
-                        size_t xCZ_mask = 1ull << xCZ_idx;
-                        if (xCZ_mask & p) {
+                        size_t xCZ_mask = 1ull << (num_xCZ - 1 - xCZ_idx);
+                        if (!(xCZ_mask & p)) {
                             if (is_control_in_1) {
-                                Gate new_gate;
-                                new_gate.type = GateType::P0;
-                                new_gate.target = gate.control;
-                                sim_1.apply_gate(new_gate, false);
+                                norm_1 = project(sim_1, gate.control, 0, norm_1);
                             }
                             else {
-                                Gate new_gate;
-                                new_gate.type = GateType::P0;
-                                new_gate.target = gate.control - cut_idx;
-                                sim_2.apply_gate(new_gate, false);
+                                norm_2 = project(sim_2, gate.control - cut_idx, 0, norm_2);
                             }
                         }
                         else {
                             if (is_control_in_1) {
+                                norm_1 = project(sim_1, gate.control, 1, norm_1);
                                 Gate new_gate;
-                                new_gate.type = GateType::P1;
-                                new_gate.target = gate.control;
-                                sim_1.apply_gate(new_gate, false);
                                 new_gate.type = GateType::Z;
                                 new_gate.target = gate.target - cut_idx;
                                 sim_2.apply_gate(new_gate, false);
@@ -312,30 +545,33 @@ struct FeynmanSimulator {
                                 new_gate.type = GateType::Z;
                                 new_gate.target = gate.target;
                                 sim_1.apply_gate(new_gate, false);
-                                new_gate.type = GateType::P1;
-                                new_gate.target = gate.control - cut_idx;
-                                sim_2.apply_gate(new_gate, false);
+                                norm_2 = project(sim_2, gate.control - cut_idx, 1, norm_2);
                             }
                         }
+                        pruned = prune(norm_1, norm_2, 1);
                         xCZ_idx++;
                     }
                 }
             }
 
+            if (pruned) {
+                continue;
+            }
+
             sim_1.normalise();
             sim_2.normalise();
-            Kokkos::parallel_for(bitstrings.extent(0), KOKKOS_CLASS_LAMBDA(size_t i) {
-                size_t idx = bitstrings(i);
-                auto ampl = get_amplitude(sim_1.wave, sim_2.wave, num_qubits, cut_idx, idx);
-                global_wave(i) += ampl;
-            });
+            accumulate(sim_1, sim_2, global_wave);
             Kokkos::fence();
             double time = path_timer.seconds();
             if (verbose) {
-                fmt::println("Path {} ({:.0f}%) , ETA {}", p, 100.0 * p / num_paths, print_time(time * (num_paths - p) * fidelity));
+                fmt::println("Path {} ({:.0f}%) , ETA {}", p, 100.0 * (p - paths.begin) / paths.size(), print_time(time * (paths.end - p) * fidelity));
             }
         }
+        if (checkpointer) {
+            checkpointer->finish();
+        }
+        print_pruning();
         fmt::println("Simulating all paths: {}", print_time(timer.seconds()));
-        return global_wave;
+        return sorted.unpermute(global_wave);
     }
 };
\ No newline at end of file
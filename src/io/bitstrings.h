@@ -0,0 +1,75 @@
+#pragma once
+#include "kokkos.h"
+#include <fmt/core.h>
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Read a list of bitstrings to query
+ *
+ * Two formats are accepted:
+ *  - binary (.bin extension): raw uint64 bitstrings, little endian
+ *  - text: one bitstring per line, written with num_qubits binary digits,
+ *    qubit 0 first. Anything after the bitstring (e.g. ": amplitude" in the
+ *    output files of the simulator) is ignored, as well as empty lines.
+ *
+ * A file without any bitstring is an error.
+ */
+Kokkos::View<size_t*> read_bitstrings(const std::string& filename, int num_qubits) {
+    bool binary = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0;
+    std::ifstream in(filename, binary ? std::ios::binary : std::ios::in);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+
+    std::vector<size_t> values;
+    if (binary) {
+        in.seekg(0, std::ios::end);
+        size_t size = in.tellg();
+        in.seekg(0, std::ios::beg);
+        if (size % sizeof(uint64_t) != 0) {
+            throw std::runtime_error("Binary bitstring file " + filename + " is not a list of uint64");
+        }
+        values.resize(size / sizeof(uint64_t));
+        in.read(reinterpret_cast<char*>(values.data()), size);
+    }
+    else {
+        std::string line;
+        size_t line_number = 0;
+        while (std::getline(in, line)) {
+            line_number++;
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos) {
+                continue;
+            }
+            size_t last = line.find_first_not_of("01", first);
+            if (last == std::string::npos) {
+                last = line.size();
+            }
+            if (last - first != num_qubits) {
+                throw std::runtime_error(fmt::format("{}:{}: expected a bitstring of {} qubits", filename, line_number, num_qubits));
+            }
+            values.push_back(std::stoull(line.substr(first, last - first), nullptr, 2));
+        }
+    }
+
+    // An empty list would reach the simulators as a request for the full statevector
+    if (values.empty()) {
+        throw std::runtime_error("No bitstring in " + filename);
+    }
+
+    size_t N = 1ull << num_qubits;
+    for (size_t value : values) {
+        if (value >= N) {
+            throw std::runtime_error(fmt::format("Bitstring {} of {} does not fit in {} qubits", value, filename, num_qubits));
+        }
+    }
+
+    Kokkos::View<size_t*> bitstrings("bitstrings", values.size());
+    Kokkos::View<size_t*, Kokkos::HostSpace, Kokkos::MemoryTraits<Kokkos::Unmanaged>> host(values.data(), values.size());
+    Kokkos::deep_copy(bitstrings, host);
+    return bitstrings;
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include "io/shard.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+/**
+ * Binary file holding the state of an interrupted Feynman run
+ *
+ * Layout:
+ *   char[8]   magic "QCCHKP3"
+ *   shard header (see shard.h), describing the run
+ *   uint64    next_path: all the paths in [path_begin, next_path) are done
+ *   uint64    number of cut positions, followed by the positions (int32)
+ *   double    fidelity of the run
+ *   double    prune tolerance of the run
+ *   uint64    hash of the circuit (see circuit_hash)
+ *   uint64    pruned paths among the paths done
+ *   double    weight of the pruned paths
+ *   uint64[]  bitstrings (if has_bitstrings)
+ *   double[]  partial amplitudes (real, imag interleaved)
+ *
+ * Both Feynman modes go through the paths in increasing index, so the set of
+ * completed paths is always a prefix of the range of the run. The fidelity
+ * selection is a counter-based generator, its state is thus the seed.
+ */
+struct Checkpoint {
+    ShardHeader header;
+    uint64_t next_path = 0;
+    std::vector<int> cuts;
+    double fidelity = 1;
+    double prune_tolerance = 0;
+    uint64_t circuit_hash = 0;
+    uint64_t pruned_paths = 0;
+    double pruned_weight = 0;
+    Kokkos::View<size_t*, Kokkos::HostSpace> bitstrings;
+    Kokkos::View<cmplx*, Kokkos::HostSpace> wave;
+};
+
+static const char CHECKPOINT_MAGIC[8] = "QCCHKP3";
+
+/**
+ * Write the checkpoint next to filename first, then rename it, such that
+ * filename always holds a complete checkpoint
+ *
+ * Only touches host memory, can be called from a background thread.
+ */
+void write_checkpoint(const std::string& filename, const Checkpoint& checkpoint) {
+    std::string tmp_filename = filename + ".tmp";
+    {
+        std::ofstream out(tmp_filename, std::ios::binary);
+        if (!out.is_open()) {
+            throw std::runtime_error("Could not open file: " + tmp_filename);
+        }
+        out.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        write_shard_header(out, checkpoint.header);
+        write_binary(out, checkpoint.next_path);
+        write_binary(out, (uint64_t)checkpoint.cuts.size());
+        for (int32_t cut : checkpoint.cuts) {
+            write_binary(out, cut);
+        }
+        write_binary(out, checkpoint.fidelity);
+        write_binary(out, checkpoint.prune_tolerance);
+        write_binary(out, checkpoint.circuit_hash);
+        write_binary(out, checkpoint.pruned_paths);
+        write_binary(out, checkpoint.pruned_weight);
+        if (checkpoint.header.has_bitstrings) {
+            out.write(reinterpret_cast<const char*>(checkpoint.bitstrings.data()), sizeof(size_t) * checkpoint.header.num_amplitudes);
+        }
+        out.write(reinterpret_cast<const char*>(checkpoint.wave.data()), sizeof(cmplx) * checkpoint.header.num_amplitudes);
+        out.flush();
+        if (!out) {
+            throw std::runtime_error("Could not write checkpoint: " + tmp_filename);
+        }
+    }
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        throw std::runtime_error("Could not rename checkpoint: " + tmp_filename);
+    }
+}
+
+Checkpoint read_checkpoint(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) {
+        throw std::runtime_error("Not a checkpoint file: " + filename);
+    }
+
+    Checkpoint checkpoint;
+    auto& header = checkpoint.header;
+    read_shard_header(in, header);
+    read_binary(in, checkpoint.next_path);
+    uint64_t num_cuts;
+    read_binary(in, num_cuts);
+    checkpoint.cuts.resize(num_cuts);
+    for (auto& cut : checkpoint.cuts) {
+        int32_t value;
+        read_binary(in, value);
+        cut = value;
+    }
+    read_binary(in, checkpoint.fidelity);
+    read_binary(in, checkpoint.prune_tolerance);
+    read_binary(in, checkpoint.circuit_hash);
+    read_binary(in, checkpoint.pruned_paths);
+    read_binary(in, checkpoint.pruned_weight);
+    if (header.has_bitstrings) {
+        checkpoint.bitstrings = Kokkos::View<size_t*, Kokkos::HostSpace>("bitstrings", header.num_amplitudes);
+        in.read(reinterpret_cast<char*>(checkpoint.bitstrings.data()), sizeof(size_t) * header.num_amplitudes);
+    }
+    checkpoint.wave = Kokkos::View<cmplx*, Kokkos::HostSpace>("wave", header.num_amplitudes);
+    in.read(reinterpret_cast<char*>(checkpoint.wave.data()), sizeof(cmplx) * header.num_amplitudes);
+    if (!in) {
+        throw std::runtime_error("Truncated checkpoint: " + filename);
+    }
+    return checkpoint;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "print.h"
+
+#include <chrono>
+#include <fmt/core.h>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Output files of the runs
+ *
+ * By default a file is formatted and written before write() returns. In
+ * background mode (batch runs), it is formatted and written by a thread of
+ * its own, while the next job computes. The producer therefore only reads
+ * host data and makes no Kokkos call: the callers copy the results to the
+ * host first (see to_host), on the thread that runs the kernels. The host
+ * copies keep their buffers alive (on the host backends, the buffers of the
+ * state, kept out of the state pool, see allocate_state) until the file is
+ * written. Each write is tagged with the job that requested it, such that
+ * a failed write is reported as a failure of its job.
+ */
+struct OutputWriter {
+    struct PendingWrite {
+        size_t job;
+        std::future<void> done;
+    };
+    struct FailedWrite {
+        size_t job;
+        std::string error;
+    };
+
+    bool background = false;
+    size_t job = 0; // Job of the next writes
+    std::vector<PendingWrite> pending;
+    std::vector<FailedWrite> failures;
+
+    void write(const std::string& filename, std::function<void(std::ostream&)> producer) {
+        // The producer (and the Views it captured) is released as soon as the file is written
+        auto task = [filename, producer]() mutable {
+            std::ofstream out(filename);
+            if (!out.is_open()) {
+                throw std::runtime_error("Could not open file: " + filename);
+            }
+            producer(out);
+            producer = nullptr;
+        };
+        if (!background) {
+            task();
+            return;
+        }
+        collect(false);
+        pending.push_back({ job, std::async(std::launch::async, task) });
+    }
+
+    /** Collect the written files (all of them if wait_all), reporting the failed writes */
+    void collect(bool wait_all) {
+        std::vector<PendingWrite> running;
+        for (auto& write : pending) {
+            if (!wait_all && write.done.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                running.push_back(std::move(write));
+                continue;
+            }
+            try {
+                write.done.get();
+            }
+            catch (const std::exception& e) {
+                fmt::println("{}", warning(fmt::format("job {}: {}", write.job, e.what())));
+                failures.push_back({ write.job, e.what() });
+            }
+        }
+        pending = std::move(running);
+    }
+
+    void wait() {
+        collect(true);
+    }
+};
+
+/** Escape the quotes, backslashes and control characters of a JSON string */
+inline std::string escape_json(const std::string& text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c < 0x20)
+            out += fmt::format("\\u{:04x}", (int)c);
+        else
+            out += c;
+    }
+    return out;
+}
+
+inline OutputWriter& output_writer() {
+    static OutputWriter writer;
+    return writer;
+}
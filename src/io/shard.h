@@ -0,0 +1,124 @@
+#pragma once
+#include "complex.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+/**
+ * Binary file holding the partial amplitudes of a range of Feynman paths
+ *
+ * Layout (little endian, as written by the host):
+ *   char[8]   magic "QCSHARD"
+ *   uint32    version
+ *   int32     num_qubits
+ *   uint64    num_amplitudes
+ *   uint64    num_paths, path_begin, path_end
+ *   uint64    seed
+ *   uint64    has_bitstrings (0: full statevector)
+ *   uint64[]  bitstrings (if has_bitstrings)
+ *   double[]  amplitudes (real, imag interleaved)
+ *
+ * Shards of the same run can be summed into the amplitudes of the whole run.
+ */
+struct ShardHeader {
+    uint32_t version = 1;
+    int32_t num_qubits = 0;
+    uint64_t num_amplitudes = 0;
+    uint64_t num_paths = 0;
+    uint64_t path_begin = 0;
+    uint64_t path_end = 0;
+    uint64_t seed = 0;
+    uint64_t has_bitstrings = 0;
+};
+
+struct Shard {
+    ShardHeader header;
+    Kokkos::View<size_t*, Kokkos::HostSpace> bitstrings;
+    Kokkos::View<cmplx*, Kokkos::HostSpace> wave;
+};
+
+static const char SHARD_MAGIC[8] = "QCSHARD";
+
+template<typename T>
+void write_binary(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+void read_binary(std::ifstream& in, T& value) {
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+void write_shard_header(std::ofstream& out, const ShardHeader& header) {
+    write_binary(out, header.version);
+    write_binary(out, header.num_qubits);
+    write_binary(out, header.num_amplitudes);
+    write_binary(out, header.num_paths);
+    write_binary(out, header.path_begin);
+    write_binary(out, header.path_end);
+    write_binary(out, header.seed);
+    write_binary(out, header.has_bitstrings);
+}
+
+void read_shard_header(std::ifstream& in, ShardHeader& header) {
+    read_binary(in, header.version);
+    read_binary(in, header.num_qubits);
+    read_binary(in, header.num_amplitudes);
+    read_binary(in, header.num_paths);
+    read_binary(in, header.path_begin);
+    read_binary(in, header.path_end);
+    read_binary(in, header.seed);
+    read_binary(in, header.has_bitstrings);
+}
+
+void write_shard(const std::string& filename, ShardHeader header, const Kokkos::View<size_t*>& bitstrings, const Kokkos::View<cmplx*>& wave) {
+    Kokkos::fence();
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+    header.num_amplitudes = wave.extent(0);
+    header.has_bitstrings = bitstrings.extent(0) > 0;
+
+    out.write(SHARD_MAGIC, sizeof(SHARD_MAGIC));
+    write_shard_header(out, header);
+
+    if (header.has_bitstrings) {
+        auto bitstrings_host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), bitstrings);
+        out.write(reinterpret_cast<const char*>(bitstrings_host.data()), sizeof(size_t) * bitstrings_host.extent(0));
+    }
+    auto wave_host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), wave);
+    out.write(reinterpret_cast<const char*>(wave_host.data()), sizeof(cmplx) * wave_host.extent(0));
+    if (!out) {
+        throw std::runtime_error("Could not write shard: " + filename);
+    }
+}
+
+Shard read_shard(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+    char magic[sizeof(SHARD_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, SHARD_MAGIC, sizeof(magic)) != 0) {
+        throw std::runtime_error("Not a shard file: " + filename);
+    }
+
+    Shard shard;
+    auto& header = shard.header;
+    read_shard_header(in, header);
+
+    if (header.has_bitstrings) {
+        shard.bitstrings = Kokkos::View<size_t*, Kokkos::HostSpace>("bitstrings", header.num_amplitudes);
+        in.read(reinterpret_cast<char*>(shard.bitstrings.data()), sizeof(size_t) * header.num_amplitudes);
+    }
+    shard.wave = Kokkos::View<cmplx*, Kokkos::HostSpace>("wave", header.num_amplitudes);
+    in.read(reinterpret_cast<char*>(shard.wave.data()), sizeof(cmplx) * header.num_amplitudes);
+    if (!in) {
+        throw std::runtime_error("Truncated shard: " + filename);
+    }
+    return shard;
+}
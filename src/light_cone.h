@@ -0,0 +1,201 @@
+#pragma once
+
+#include "circuit_optimizer.h"
+#include "simulator.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Light cone of the measurement of a subset of the qubits
+ *
+ * The marginal distribution of the measured qubits only depends on the gates
+ * of their backward light cone: going from the last gate to the first, a gate
+ * is kept if it touches a qubit of the cone, whose qubits then join the cone.
+ * The other gates act on qubits that are traced out without interacting with
+ * the measured ones again, and cancel in the partial trace. A diagonal gate
+ * followed only by diagonal gates on its qubits commutes to the measurement
+ * (or the partial trace), and is dropped as well. The projections P0 and P1
+ * are not unitary: they scale the whole state, and are always kept (their
+ * qubit joining the cone).
+ *
+ * The reduced circuit runs on the qubits of the cone only (in their original
+ * order), the qubits that never enter it being traced out from the start.
+ */
+struct LightCone {
+    std::vector<int> measured;       // Measured qubits, in increasing order
+    std::vector<int> qubits;         // Qubits of the cone (global index of each reduced qubit)
+    std::vector<int> measured_local; // Reduced index of each measured qubit
+    Circuit reduced;
+    int num_qubits;                  // Of the whole circuit
+    size_t num_gates;
+
+    LightCone(const Circuit& circuit, std::vector<int> measured_qubits) : measured(measured_qubits) {
+        std::sort(measured.begin(), measured.end());
+        measured.erase(std::unique(measured.begin(), measured.end()), measured.end());
+        for (int q : measured) {
+            if (q < 0 || q >= circuit.num_qubits) {
+                throw std::runtime_error(fmt::format("Measured qubit {} out of the {} qubits of the circuit", q, circuit.num_qubits));
+            }
+        }
+        num_qubits = circuit.num_qubits;
+        num_gates = circuit.gates.size();
+
+        std::vector<bool> in_cone(circuit.num_qubits, false);
+        std::vector<bool> diagonal_tail(circuit.num_qubits, true);
+        for (int q : measured) {
+            in_cone[q] = true;
+        }
+        std::vector<Gate> kept;
+        for (size_t i = circuit.gates.size();i-- > 0;) {
+            const Gate& gate = circuit.gates[i];
+            bool touches = in_cone[gate.target] || (gate.control != -1 && in_cone[gate.control]);
+            bool tail = diagonal_tail[gate.target] && (gate.control == -1 || diagonal_tail[gate.control]);
+            bool projection = gate.type == GateType::P0 || gate.type == GateType::P1;
+            if (!projection && (!touches || (tail && is_diagonal_unitary(gate)))) {
+                continue;
+            }
+            kept.push_back(gate);
+            for (int q : { gate.target, gate.control }) {
+                if (q == -1)
+                    continue;
+                in_cone[q] = true;
+                if (action_on(gate, q) != QubitAction::ZBasis)
+                    diagonal_tail[q] = false;
+            }
+        }
+        std::reverse(kept.begin(), kept.end());
+
+        std::vector<int> local(circuit.num_qubits, -1);
+        for (int q = 0;q < circuit.num_qubits;q++) {
+            if (in_cone[q]) {
+                local[q] = qubits.size();
+                qubits.push_back(q);
+            }
+        }
+        for (int q : measured) {
+            measured_local.push_back(local[q]);
+        }
+        reduced.num_qubits = qubits.size();
+        reduced.depth = circuit.depth;
+        for (Gate gate : kept) {
+            gate.target = local[gate.target];
+            if (gate.control != -1)
+                gate.control = local[gate.control];
+            reduced.gates.push_back(gate);
+        }
+    }
+
+    std::string print() const {
+        return fmt::format("Light cone of {} measured qubits: {} qubits (of {}), {} gates (of {})",
+            measured.size(), qubits.size(), num_qubits, reduced.gates.size(), num_gates);
+    }
+};
+
+/**
+ * Number of partial histograms of marginal_probabilities, 0 if the outcomes
+ * are accumulated directly
+ *
+ * With few outcomes, all the threads would add to the same few bins (the
+ * same cache lines). Each block of the state is then summed into a
+ * histogram of its own, at least marginal_block_size amplitudes per block
+ * and at most marginal_partial_bins bins in all, and the histograms are
+ * added at the end. With many outcomes, the atomic additions are spread
+ * over enough bins.
+ */
+constexpr size_t marginal_block_size = 1024;
+constexpr size_t marginal_partial_bins = 1ull << 20;
+constexpr size_t marginal_row_padding = 8;
+
+inline size_t marginal_partials(int num_qubits, int num_measured) {
+    size_t bins = 1ull << num_measured;
+    if (bins > marginal_block_size)
+        return 0;
+    size_t blocks = MAX((1ull << num_qubits) / marginal_block_size, (size_t)1);
+    return MIN(blocks, marginal_partial_bins / MAX(bins, marginal_row_padding));
+}
+
+/** Outcome of the amplitude idx: its bits at the shifts of the measured qubits */
+KOKKOS_INLINE_FUNCTION size_t marginal_outcome(size_t idx, const Kokkos::View<int*>& shifts, int num_measured) {
+    size_t outcome = 0;
+    for (int m = 0;m < num_measured;m++) {
+        outcome = (outcome << 1) | ((idx >> shifts(m)) & 1);
+    }
+    return outcome;
+}
+
+/**
+ * Marginal probabilities of the measured qubits (the first measured qubit is
+ * the most significant bit of the outcome) of a normalised state
+ */
+inline Kokkos::View<precision*> marginal_probabilities(const StateVector& state, const std::vector<int>& measured) {
+    int num_measured = measured.size();
+    Kokkos::View<int*> shifts("measured_shifts", num_measured);
+    auto shifts_host = Kokkos::create_mirror_view(shifts);
+    for (int m = 0;m < num_measured;m++) {
+        shifts_host(m) = state.num_qubits - 1 - measured[m];
+    }
+    Kokkos::deep_copy(shifts, shifts_host);
+
+    size_t num_outcomes = 1ull << num_measured;
+    Kokkos::View<precision*> marginal("marginal", num_outcomes);
+    auto wave = state.wave;
+
+    size_t num_partials = marginal_partials(state.num_qubits, num_measured);
+    if (num_partials == 0) {
+        Kokkos::parallel_for("marginal_probabilities", wave.extent(0), KOKKOS_LAMBDA(size_t idx) {
+            precision p = wave(idx).real() * wave(idx).real() + wave(idx).imag() * wave(idx).imag();
+            Kokkos::atomic_add(&marginal(marginal_outcome(idx, shifts, num_measured)), p);
+        });
+        return marginal;
+    }
+
+    // One histogram per block of amplitudes, then the sum of the histograms
+    size_t N = wave.extent(0);
+    size_t block_size = (N + num_partials - 1) / num_partials;
+    // The histograms of two threads do not share a cache line (on the host)
+    Kokkos::View<precision**> partials("marginal_partials", num_partials, MAX(num_outcomes, marginal_row_padding));
+    Kokkos::parallel_for("marginal_partials", num_partials, KOKKOS_LAMBDA(size_t b) {
+        size_t end = MIN((b + 1) * block_size, N);
+        for (size_t idx = b * block_size;idx < end;idx++) {
+            partials(b, marginal_outcome(idx, shifts, num_measured)) += wave(idx).real() * wave(idx).real() + wave(idx).imag() * wave(idx).imag();
+        }
+    });
+    Kokkos::parallel_for("marginal_probabilities", num_outcomes, KOKKOS_LAMBDA(size_t outcome) {
+        precision p = 0;
+        for (size_t b = 0;b < num_partials;b++) {
+            p += partials(b, outcome);
+        }
+        marginal(outcome) = p;
+    });
+    return marginal;
+}
+
+/** Outcomes drawn from the marginal distribution, with their probabilities */
+inline std::vector<std::pair<size_t, precision>> sample_marginal(const Kokkos::View<precision*>& marginal, size_t num_samples, uint64_t seed) {
+    auto marginal_host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), marginal);
+    std::vector<precision> cumulative(marginal_host.extent(0));
+    precision total = 0;
+    for (size_t i = 0;i < cumulative.size();i++) {
+        total += marginal_host(i);
+        cumulative[i] = total;
+    }
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<precision> uniform(0, total);
+    std::vector<std::pair<size_t, precision>> samples;
+    for (size_t s = 0;s < num_samples;s++) {
+        size_t outcome = std::upper_bound(cumulative.begin(), cumulative.end(), uniform(rng)) - cumulative.begin();
+        outcome = MIN(outcome, cumulative.size() - 1);
+        samples.push_back({ outcome, marginal_host(outcome) });
+    }
+    return samples;
+}
+
+/** One line per outcome (or sample): the bits of the measured qubits, and the probability */
+inline void write_marginal(std::ostream& out, const std::vector<std::pair<size_t, precision>>& outcomes, int num_measured) {
+    for (const auto& [outcome, p] : outcomes) {
+        out << fmt::format("{:0{}b}: {}\n", outcome, num_measured, p);
+    }
+}
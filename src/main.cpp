@@ -2,11 +2,25 @@
 #include "io/output/output.h"
 #include "util/arg_parser.h"
 #include <fstream>
-#include <Kokkos_UnorderedMap.hpp>
+#include <functional>
 
 #include "reader.h"
 #include "simulator.h"
+#include "factorized_state.h"
+#include "compressed_simulator.h"
+#include "circuit_optimizer.h"
+#include "light_cone.h"
+#include "scheduler.h"
 #include "feynman_simulator.h"
+#include "multi_feynman_simulator.h"
+#include "tensor_network.h"
+#include "rejection_sampler.h"
+#include "noise.h"
+#include "statistics.h"
+#include "distributed.h"
+#include "io/shard.h"
+#include "io/bitstrings.h"
+#include "io/output/writer.h"
 
 struct Arguments {
     std::string circuit_file;
@@ -16,247 +30,768 @@ struct Arguments {
     int nbitstrings = -1;
     double epsilon = 5e-4;
     int use_feynman = 0;
+    bool use_tensor_network = false;
     bool use_rejection = true;
     int cut_at = -1;
+    std::vector<double> cuts;
     double fidelity = 1.0;
     int recursive = 0;
-    size_t max_memory = 16; // in GB
+    double max_memory = 16; // in GB
+    uint64_t seed = 0;
+    bool has_seed = false; // Otherwise a random seed is drawn (and printed)
+    int shard_id = 0;
+    int num_shards = 1;
+    size_t path_begin = 0;
+    size_t path_end = 0;
+    std::string output_shard;
+    std::string checkpoint;
+    double checkpoint_interval = 600; // in seconds
+    double prune_tolerance = 0;
+    std::string output_statistics;
+    int histogram_bins = 0; // 0: no statistics, unless --output_statistics is given
+    std::string bitstrings_file;
+    std::string trace;
+    std::string state_allocator = "default";
+    bool factorized = false;
+    double compression_tolerance = 0;
+    int optimize = 0;
+    bool schedule = false;
+    std::vector<double> marginal;
+    std::string noise;
+    size_t trajectories = 1000;
+    size_t shots = 1;
+    std::string batch;
+    std::string batch_report;
 };
 
-int main(int argc, char* argv[]) {
-#ifdef KOKKOS_ENABLE_CUDA
-    fmt::println("Using CUDA");
-#else
-    fmt::println("Using OpenMP");
-#endif
-
-    Arguments args;
-
-    Parser arg_parser("Quantum Simulator", "0.1");
-    arg_parser.add_argument("-c,--circuit", "Path to the circuit file", args.circuit_file);
-    arg_parser.add_argument("-v,--verbose", "Print verbose output", args.verbose);
-    arg_parser.add_argument("--output_statevector", "Output the whole statevector to file", args.output_statevector);
-    arg_parser.add_argument("--output_probabilities", "Output the probabilities to file", args.output_statevector);
-    arg_parser.add_argument("--use_feynman", "Use the Feynman simulator (divide the circuit into n circuits)", args.use_feynman);
-    arg_parser.add_argument("--cut_at", "Cut the circuit at a specific qubit (if not specified, automatic)", args.cut_at);
-    arg_parser.add_argument("--fidelity", "Fidelity of the Feynman simulator", args.fidelity);
-    arg_parser.add_argument("--nbitstrings", "Number of bitstrings (-1 for full vector)", args.nbitstrings);
-    arg_parser.add_argument("--use_rejection", "Use rejection sampling", args.use_rejection);
-    arg_parser.add_argument("--epsilon", "Epsilon for fidelity of sampling", args.epsilon);
-    arg_parser.add_argument("--max_memory", "Maximum memory in GB", args.max_memory);
-    arg_parser.add_argument("--recursive", "Recursive Feynman", args.recursive);
-    arg_parser.parse_known_args(argc, argv);
-
+/** The seed of the run, or a random one */
+uint64_t run_seed(const Arguments& args) {
+    if (args.has_seed)
+        return args.seed;
+    std::random_device dev;
+    std::mt19937_64 rng(dev());
+    return rng();
+}
+
+/** Register the options of a run, stored into args */
+void add_arguments(Parser& parser, Arguments& args) {
+    parser.add_argument("-c,--circuit", "Path to the circuit file", args.circuit_file);
+    parser.add_argument("-v,--verbose", "Print verbose output", args.verbose);
+    parser.add_argument("--output_statevector", "Output the whole statevector to file", args.output_statevector);
+    parser.add_argument("--output_probabilities", "Output the probabilities to file", args.output_probabilities);
+    parser.add_argument("--use_feynman", "Use the Feynman simulator (divide the circuit into n circuits)", args.use_feynman);
+    parser.add_argument("--use_tensor_network", "Compute the amplitudes by contraction of the tensor network of the circuit (sliced to fit --max_memory)", args.use_tensor_network);
+    parser.add_argument("--optimize", "Optimize the circuit before the simulation: 1 removes the gates without effect, 2 also the final phases (exact probabilities, amplitudes up to a phase)", args.optimize);
+    parser.add_argument("--schedule", "Reorder the gates within their dependencies, into runs on few qubits and runs of diagonal gates", args.schedule);
+    parser.add_argument("--cut_at", "Cut the circuit at a specific qubit (if not specified, automatic)", args.cut_at);
+    parser.add_argument("--cuts", "Comma separated qubits where to cut the circuit into blocks (e.g. 4,8,12)", args.cuts);
+    parser.add_argument("--fidelity", "Fidelity of the Feynman simulator", args.fidelity);
+    parser.add_argument("--nbitstrings", "Number of bitstrings (-1 for full vector)", args.nbitstrings);
+    parser.add_argument("--bitstrings_file", "Compute the amplitudes of the bitstrings listed in this file (text, or uint64 if .bin)", args.bitstrings_file);
+    parser.add_argument("--use_rejection", "Use rejection sampling", args.use_rejection);
+    parser.add_argument("--epsilon", "Epsilon for fidelity of sampling", args.epsilon);
+    parser.add_argument("--max_memory", "Memory budget in GB, checked against the plan of the run before it starts (0 for no limit)", args.max_memory);
+    parser.add_argument("--recursive", "Recursive Feynman", args.recursive);
+    parser.add_argument("--seed", "Seed of the run (64-bit), must be the same for all shards (-1 for random)", [&args](const std::string& value) {
+        if (value == "-1") {
+            args.has_seed = false;
+            return;
+        }
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+            throw std::runtime_error("Invalid seed: " + value);
+        }
+        args.seed = std::stoull(value);
+        args.has_seed = true;
+    });
+    parser.add_argument("--shard_id", "Index of the shard of Feynman paths to simulate (MPI rank if available)", args.shard_id);
+    parser.add_argument("--num_shards", "Number of shards the Feynman paths are split into (MPI size if available)", args.num_shards);
+    parser.add_argument("--path_begin", "First Feynman path to simulate (overrides shards)", args.path_begin);
+    parser.add_argument("--path_end", "Last Feynman path to simulate, excluded (0 for all)", args.path_end);
+    parser.add_argument("--output_shard", "Output the partial amplitudes of the simulated paths (binary)", args.output_shard);
+    parser.add_argument("--checkpoint", "Checkpoint file of the Feynman run (resumes from it if it exists)", args.checkpoint);
+    parser.add_argument("--checkpoint_interval", "Time between two checkpoints in seconds", args.checkpoint_interval);
+    parser.add_argument("--prune_tolerance", "Discard the Feynman paths whose norm falls below this tolerance (0 to disable)", args.prune_tolerance);
+    parser.add_argument("--output_statistics", "Output the XEB and Porter-Thomas statistics of the result to file (json)", args.output_statistics);
+    parser.add_argument("--histogram_bins", "Compute the statistics, with this number of bins of the Porter-Thomas histogram of Np in [0, 10) (100 with --output_statistics)", args.histogram_bins);
+    parser.add_argument("--state_allocator", "Allocation of the state vectors: default, first_touch (NUMA placement by the gate kernels) or huge_pages (first touch and transparent huge pages)", args.state_allocator);
+    parser.add_argument("--factorized", "Apply the first gates to a factorized state, until the qubits are entangled", args.factorized);
+    parser.add_argument("--compression_tolerance", "Store the Schrodinger state compressed, each component within this fraction of the largest of its block (0 for uncompressed)", args.compression_tolerance);
+    parser.add_argument("--marginal", "Comma separated qubits whose marginal distribution is computed on the light cone of their measurement (e.g. 0,1,4,5)", args.marginal);
+    parser.add_argument("--noise", "Noise model of a noisy trajectories run, e.g. depolarizing=1e-3,depolarizing:CZ=1e-2,damping=1e-4,readout=2e-2", args.noise);
+    parser.add_argument("--trajectories", "Number of noisy trajectories", args.trajectories);
+    parser.add_argument("--shots", "Samples drawn per noisy trajectory", args.shots);
+    parser.add_argument("--trace", "Record the gates, cycles and Feynman paths to a Chrome trace file (json)", args.trace);
+    parser.add_argument("--batch", "Run the jobs of a manifest, one line of options per job (- for a job server reading stdin)", args.batch);
+    parser.add_argument("--batch_report", "Output the status, time and peak memory of every job of the batch to file (json)", args.batch_report);
+}
+
+/** One simulation, returns the exit code */
+int run_job(Arguments& args) {
     if (args.circuit_file.empty()) {
         fmt::println("Please provide a circuit file");
-        arg_parser.print_help();
         return 1;
     }
+    if (!args.trace.empty()) {
+        trace_recorder().enable();
+    }
 
+    Circuit circuit = read_circuit(args.circuit_file, args.verbose, true);
+    if (args.optimize > 0) {
+        OptimizationReport report;
+        circuit = optimize_circuit(circuit, args.optimize >= 2, report);
+        fmt::println("{}", report.print());
+    }
+    Schedule schedule;
+    if (args.schedule) {
+        schedule = schedule_gates(circuit);
+        fmt::println("{}", print_schedule(circuit, schedule));
+        circuit = apply_schedule(circuit, schedule);
+    }
 
-    Kokkos::initialize(argc, argv);
-    {
-        Circuit circuit = read_circuit(args.circuit_file, args.verbose, true);
+    // Every plan is checked against the budget before allocating anything
+    memory_tracker().install();
+    state_allocator() = parse_state_allocator(args.state_allocator);
+    size_t memory_size = (size_t)(args.max_memory * 1024 * 1024 * 1024);
+
+    // Statistics of the result (on request, they sweep the result once more), computed without dumping the amplitudes
+    precision fidelity = args.fidelity;
+    bool statistics = args.histogram_bins > 0 || !args.output_statistics.empty();
+    auto output_statistics = [&](const auto& vector) {
+        if (!statistics)
+            return;
+        Statistics stats = compute_statistics(vector, args.histogram_bins > 0 ? args.histogram_bins : 100, 10, fidelity);
+        fmt::println("{}", print_statistics(stats));
+        if (!args.output_statistics.empty()) {
+            output_writer().write(args.output_statistics, [stats](std::ostream& out) {
+                out << print_statistics_json(stats);
+            });
+        }
+    };
 
-        // Schrodinger simulator
-        if (args.use_feynman == 0) {
+    // Marginal distribution of a subset of the qubits, from the Schrodinger state of its light cone
+    if (!args.marginal.empty()) {
+        if (args.use_feynman != 0 || args.use_tensor_network || !args.noise.empty()) {
+            fmt::println("The marginal distributions are computed with the Schrodinger simulator");
+            return 1;
+        }
+        LightCone cone(circuit, std::vector<int>(args.marginal.begin(), args.marginal.end()));
+        fmt::println("{}", cone.print());
+        int num_measured = cone.measured.size();
+        MemoryPlan plan = SchrodingerSimulator::memory_plan(cone.reduced.num_qubits);
+        plan.add("marginal", sizeof(precision) << num_measured);
+        plan.add("marginal_partials", sizeof(precision) * MAX(1ull << num_measured, marginal_row_padding) * marginal_partials(cone.reduced.num_qubits, num_measured));
+        if (!plan.fits(memory_size)) {
+            fmt::println("The light cone needs {}, over the memory budget of {} (--max_memory):\n{}",
+                print_filesize(plan.total()), print_filesize(memory_size), plan.print());
+            return 1;
+        }
+        fmt::println("Memory plan:\n{}", plan.print());
+
+        SchrodingerSimulator simulator(cone.reduced);
+        simulator.initialise_state(true);
+        simulator.run(args.verbose);
+        Kokkos::View<precision*> marginal = marginal_probabilities(simulator.get_statevector(), cone.measured_local);
+
+        // All the outcomes, or samples of the marginal distribution
+        std::vector<std::pair<size_t, precision>> outcomes;
+        if (args.nbitstrings >= 0) {
+            uint64_t seed = run_seed(args);
+            fmt::println("Seed: {}", seed);
+            outcomes = sample_marginal(marginal, args.nbitstrings, seed);
+        }
+        else {
+            auto marginal_host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), marginal);
+            for (size_t i = 0;i < marginal_host.extent(0);i++) {
+                outcomes.push_back({ i, marginal_host(i) });
+            }
+        }
+        std::string measured;
+        for (int q : cone.measured) {
+            measured += fmt::format("{}{}", measured.empty() ? "" : ",", q);
+        }
+        fmt::println("Marginal of qubits {} ({} {}):", measured, outcomes.size(), args.nbitstrings >= 0 ? "samples" : "outcomes");
+        for (size_t i = 0;i < MIN(outcomes.size(), (size_t)20);i++) {
+            fmt::println("{:0{}b}: {}", outcomes[i].first, num_measured, outcomes[i].second);
+        }
+        std::string output = !args.output_probabilities.empty() ? args.output_probabilities : args.output_statevector;
+        if (!output.empty()) {
+            output_writer().write(output, [outcomes, num_measured](std::ostream& out) {
+                write_marginal(out, outcomes, num_measured);
+            });
+        }
+    }
+    // Noisy trajectories, sampled from Schrodinger states
+    else if (!args.noise.empty()) {
+        if (args.use_feynman != 0 || args.use_tensor_network) {
+            fmt::println("The noisy trajectories are simulated with the Schrodinger simulator");
+            return 1;
+        }
+        NoiseModel noise = NoiseModel::parse(args.noise);
+        fmt::println("{}", noise.print());
+        MemoryPlan plan = TrajectorySimulator::memory_plan(circuit.num_qubits, args.trajectories * args.shots);
+        if (!plan.fits(memory_size)) {
+            fmt::println("The trajectories need {}, over the memory budget of {} (--max_memory):\n{}",
+                print_filesize(plan.total()), print_filesize(memory_size), plan.print());
+            return 1;
+        }
+        fmt::println("Memory plan:\n{}", plan.print());
+
+        uint64_t seed = run_seed(args);
+        fmt::println("Seed: {}", seed);
+        TrajectorySimulator simulator(circuit, noise, args.trajectories, args.shots, seed);
+        SampleVector vector = simulator.run(args.verbose);
+        output_statistics(vector);
+        if (!args.output_statevector.empty()) {
+            output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                write_samplevector(out, host);
+            });
+        }
+    }
+    // Schrodinger simulator
+    else if (args.use_feynman == 0 && !args.use_tensor_network) {
+        bool compressed = args.compression_tolerance > 0;
+        bool sampling = args.nbitstrings >= 0 && args.nbitstrings < (1ull << circuit.num_qubits) && args.use_rejection;
+        bool full_vector = args.bitstrings_file.empty() && !sampling;
+        if (compressed && args.factorized) {
+            fmt::println("The compressed state starts from the uniform superposition and cannot be factorized");
+            return 1;
+        }
+        MemoryPlan plan = compressed ? CompressedSimulator::memory_plan(circuit.num_qubits, args.compression_tolerance)
+            : SchrodingerSimulator::memory_plan(circuit.num_qubits);
+        // The full statevector is decompressed once the gates are applied
+        if (compressed && full_vector)
+            plan.add("wave", wave_function_memory_size<precision>(circuit.num_qubits));
+        if (!args.output_probabilities.empty())
+            plan.add("probs", wave_function_memory_size<precision>(circuit.num_qubits));
+        // The groups are at most 3/4 of the state: n - 1 qubits being merged from n - 2 and 1
+        if (args.factorized)
+            plan.add("factors", wave_function_memory_size<precision>(circuit.num_qubits) / 4 * 3);
+        if (!plan.fits(memory_size)) {
+            fmt::println("The simulation needs {}, over the memory budget of {} (--max_memory):\n{}",
+                print_filesize(plan.total()), print_filesize(memory_size), plan.print());
+            if (compressed && full_vector)
+                fmt::println("Sample the compressed state (--nbitstrings or --bitstrings_file) instead of decompressing it");
+            else
+                fmt::println("Use the Feynman simulator (--use_feynman 1) or a compressed state (--compression_tolerance) to fit into memory");
+            return 1;
+        }
+        fmt::println("Memory plan:\n{}", plan.print());
+
+        // Amplitudes of given bitstrings are simply read from the statevector
+        std::function<Kokkos::View<cmplx*>(const Kokkos::View<size_t*>&)> read_amplitudes;
+        std::function<StateVector()> get_statevector;
+        if (compressed) {
+            auto simulator = std::make_shared<CompressedSimulator>(circuit, args.compression_tolerance);
+            fmt::println("{}", simulator->print());
+            simulator->run(args.verbose);
+            fmt::println("Compression: estimated fidelity {:.8f} (tolerance {})", simulator->fidelity, args.compression_tolerance);
+            fidelity *= simulator->fidelity;
+            read_amplitudes = [simulator](const Kokkos::View<size_t*>& bitstrings) {
+                return simulator->read_amplitudes(bitstrings);
+            };
+            get_statevector = [simulator]() {
+                return simulator->decompress();
+            };
+
+            size_t first_N = MIN((size_t)21, 1ull << circuit.num_qubits);
+            Kokkos::View<size_t*> first("first", first_N);
+            Kokkos::parallel_for("first_bitstrings", first_N, KOKKOS_LAMBDA(size_t i) { first(i) = i; });
+            SampleVector head{ circuit.num_qubits, first, read_amplitudes(first) };
+            fmt::println("Statevector:\n{}", print_samplevector(head, first_N < (1ull << circuit.num_qubits) ? 20 : -1));
+        }
+        else {
             SchrodingerSimulator simulator(circuit);
-            simulator.initialise_state(true);
-            simulator.run(args.verbose);
+            simulator.diagonal_runs = schedule.diagonal_runs();
+            if (state_allocator() != StateAllocator::Default)
+                fmt::println("{}", print_placement("wave", simulator.wave));
+            size_t first_gate = 0;
+            if (args.factorized)
+                first_gate = apply_factorized(simulator, circuit.gates, args.verbose);
+            else
+                simulator.initialise_state(true);
+            simulator.run(args.verbose, first_gate);
 
             fmt::println("Statevector:\n{}", print_statevector(simulator.get_statevector(), 20));
 
+            auto wave = simulator.wave;
+            read_amplitudes = [wave](const Kokkos::View<size_t*>& bitstrings) {
+                Kokkos::View<cmplx*> amplitudes("amplitudes", bitstrings.extent(0));
+                Kokkos::parallel_for("read_amplitudes", bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) {
+                    amplitudes(i) = wave(bitstrings(i));
+                });
+                return amplitudes;
+            };
+            StateVector vector = simulator.get_statevector();
+            get_statevector = [vector]() {
+                return vector;
+            };
+        }
+
+        if (!args.bitstrings_file.empty()) {
+            Kokkos::View<size_t*> bitstrings = read_bitstrings(args.bitstrings_file, circuit.num_qubits);
+            SampleVector vector{ circuit.num_qubits, bitstrings, read_amplitudes(bitstrings) };
+            output_statistics(vector);
             if (!args.output_statevector.empty()) {
-                std::ofstream out(args.output_statevector);
-                out << print_statevector(simulator.get_statevector());
+                output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                    write_samplevector(out, host);
+                });
             }
-            if (!args.output_probabilities.empty()) {
-                std::ofstream out(args.output_probabilities);
-                out << simulator.print_probabilities();
+        }
+        // Sample from the statevector
+        else if (sampling) {
+            uint64_t seed = run_seed(args);
+            RejectionSampler sampler(circuit.num_qubits, args.nbitstrings, args.epsilon, seed);
+            if (!sampler.feasible()) {
+                fmt::println("Too many samples for the given epsilon. Do you want to run the full simulation?");
+                return 1;
+            }
+            // The candidates and their amplitudes, next to the statevector
+            sampler.max_batch = max_fitting_amplitudes([&](size_t batch) {
+                MemoryPlan round = plan;
+                round.add("candidates", sizeof(size_t) * batch);
+                round.add("amplitudes", sizeof(cmplx) * batch);
+                round.add(sampler.memory_plan(batch));
+                return round;
+            }, sampler.N, memory_size);
+            if (sampler.max_batch == 0) {
+                fmt::println("Not enough memory left for the samples");
+                return 1;
+            }
+            SampleVector vector = sampler.sample(read_amplitudes);
+            output_statistics(vector);
+            if (!args.output_statevector.empty()) {
+                output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                    out << print_samplevector(host);
+                });
             }
         }
-        // Feynman + Schrödinger simulator
         else {
-            fmt::print("Feynman simulator");
-            if (args.recursive == 1)
-                fmt::println(" (recursive)");
+            StateVector vector = get_statevector();
+            output_statistics(vector);
+            if (!args.output_statevector.empty()) {
+                output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                    out << print_statevector(host);
+                });
+            }
+            if (!args.output_probabilities.empty()) {
+                output_writer().write(args.output_probabilities, [host = probabilities_to_host(vector)](std::ostream& out) {
+                    out << print_probabilities(host);
+                });
+            }
+        }
+    }
+    // Feynman + Schrödinger simulator
+    else {
+        if (args.use_tensor_network)
+            fmt::println("Tensor network simulator");
+        else if (args.recursive == 1)
+            fmt::println("Feynman simulator (recursive)");
+        else
+            fmt::println("Feynman simulator (flat)");
+
+        uint64_t seed = run_seed(args);
+        broadcast_value(seed);
+
+        bool is_root = process_rank() == 0;
+        if (num_processes() > 1) {
+            args.shard_id = process_rank();
+            args.num_shards = num_processes();
+        }
+        bool sharded = args.num_shards > 1 || args.path_end > 0 || !args.output_shard.empty();
+        bool sampling = args.nbitstrings >= 0 && args.nbitstrings < (1ull << circuit.num_qubits) && args.use_rejection;
+        if (sharded && sampling) {
+            fmt::println("Rejection sampling needs the complete amplitudes of every round and cannot be sharded");
+            return 1;
+        }
+        if (args.use_tensor_network && args.bitstrings_file.empty() && (args.nbitstrings < 0 || args.nbitstrings >= (1ull << circuit.num_qubits))) {
+            fmt::println("The tensor network simulator computes the amplitudes of given bitstrings (--bitstrings_file or --nbitstrings)");
+            return 1;
+        }
+        if (args.use_tensor_network && !args.checkpoint.empty()) {
+            fmt::println("The tensor network simulator cannot be checkpointed");
+            return 1;
+        }
+
+        // Resume the run from the checkpoint, with the same seed and cut plan
+        std::shared_ptr<Checkpointer> checkpointer;
+        if (!args.checkpoint.empty()) {
+            if (sampling) {
+                fmt::println("Rejection sampling runs one Feynman simulation per round and cannot be checkpointed");
+                return 1;
+            }
+            std::string filename = args.checkpoint;
+            if (num_processes() > 1)
+                filename += fmt::format(".{}", process_rank());
+            checkpointer = std::make_shared<Checkpointer>(filename, args.checkpoint_interval);
+            if (checkpointer->resumed) {
+                const auto& cuts = checkpointer->state.cuts;
+                seed = checkpointer->state.header.seed;
+                args.cuts = std::vector<double>(cuts.begin() + 1, cuts.end() - 1);
+            }
+        }
+        if (args.factorized && (args.use_tensor_network || args.use_feynman > 2 || args.cuts.size() > 1)) {
+            fmt::println("Only the Schrodinger simulator and the two-way cut (--use_feynman 1 or 2) can start from a factorized state");
+            return 1;
+        }
+
+        // Amplitudes requested per run, to plan the memory of the simulators
+        Kokkos::View<size_t*> request;
+        std::unique_ptr<RejectionSampler> sampler;
+        size_t num_amplitudes = 0;
+        if (!args.bitstrings_file.empty()) {
+            request = read_bitstrings(args.bitstrings_file, circuit.num_qubits);
+            num_amplitudes = request.extent(0);
+        }
+        else if (sampling) {
+            sampler = std::make_unique<RejectionSampler>(circuit.num_qubits, args.nbitstrings, args.epsilon, seed);
+            num_amplitudes = sampler->predict_batch_size(args.nbitstrings);
+        }
+        else if (args.nbitstrings >= 0 && args.nbitstrings < (1ull << circuit.num_qubits)) {
+            num_amplitudes = args.nbitstrings;
+        }
+
+        // Paths simulated by this process
+        PathSelection selection;
+        size_t num_paths;
+        auto configure_simulator = [&](auto& simulator) {
+            simulator.checkpointer = checkpointer;
+            simulator.prune_tolerance = args.prune_tolerance;
+            simulator.paths.seed = seed;
+            if (args.path_end > 0)
+                simulator.paths.set_range(args.path_begin, args.path_end, simulator.num_paths);
             else
-                fmt::println(" (flat)");
-
-            std::random_device dev;
-            std::mt19937 rng(dev());
-            int seed = rng();
-
-            size_t memory_size = args.max_memory * 1024 * 1024 * 1024;
-            FeynmanSimulator simulator(circuit, args.fidelity, memory_size, args.cut_at);
-            if (args.nbitstrings < 0 || args.nbitstrings >= (1ull << circuit.num_qubits)) {
-                if (memory_size < wave_function_memory_size<precision>(circuit.num_qubits)) {
-                    fmt::println("Not enough memory to run the full statevector simulation");
-                    return 1;
-                }
-
-                Kokkos::View<size_t*> bitstrings("bitstrings", 1ull << circuit.num_qubits);
-                Kokkos::parallel_for(bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) { bitstrings(i) = i; });
-
-                Kokkos::View<cmplx*> wave;
-                if (args.recursive == 1)
-                    wave = simulator.run(bitstrings, args.fidelity, args.verbose);
-                else
-                    wave = simulator.run_flat(bitstrings, args.fidelity, args.verbose);
-
-                StateVector vector;
-                vector.num_qubits = circuit.num_qubits;
-                vector.wave = wave;
-                fmt::println("Statevector (full):\n{}", print_statevector(vector, 20));
-                if (!args.output_statevector.empty()) {
-                    std::ofstream out(args.output_statevector);
-                    out << print_statevector(vector);
-                }
-                if (!args.output_probabilities.empty()) {
-                    std::ofstream out(args.output_probabilities);
-                    out << print_probabilities(vector);
-                }
+                simulator.paths.set_shard(args.shard_id, args.num_shards, simulator.num_paths);
+            selection = simulator.paths;
+            num_paths = simulator.num_paths;
+            if (sharded)
+                fmt::println("Shard: paths [{}, {}) of {}", selection.begin, selection.end, num_paths);
+        };
+
+        // Two-way cut, or k-way cut if more than two blocks are requested
+        // The simulators may fall back from the recursive to the flat mode to fit into memory
+        std::function<Kokkos::View<cmplx*>(const Kokkos::View<size_t*>&)> simulate;
+        std::function<MemoryPlan(size_t)> memory_plan;
+        if (args.use_tensor_network) {
+            // The slices are split between the shards like the Feynman paths
+            auto simulator = std::make_shared<TensorNetworkSimulator>(circuit, memory_size, num_amplitudes);
+            simulator->paths.seed = seed;
+            if (args.path_end > 0)
+                simulator->paths.set_range(args.path_begin, args.path_end, simulator->num_paths);
+            else
+                simulator->paths.set_shard(args.shard_id, args.num_shards, simulator->num_paths);
+            selection = simulator->paths;
+            num_paths = simulator->num_paths;
+            if (sharded)
+                fmt::println("Shard: slices [{}, {}) of {}", selection.begin, selection.end, num_paths);
+            simulate = [simulator, args](const Kokkos::View<size_t*>& bitstrings) {
+                return simulator->run(bitstrings, args.fidelity, args.verbose);
+            };
+            memory_plan = [simulator](size_t amplitudes) {
+                return simulator->memory_plan(amplitudes);
+            };
+        }
+        else if (args.use_feynman <= 2 && args.cuts.size() <= 1) {
+            int cut_at = args.cuts.empty() ? args.cut_at : (int)args.cuts[0];
+            auto simulator = std::make_shared<FeynmanSimulator>(circuit, args.fidelity, memory_size, cut_at, num_amplitudes,
+                args.recursive, args.factorized);
+            configure_simulator(*simulator);
+            simulate = [simulator, args](const Kokkos::View<size_t*>& bitstrings) {
+                if (simulator->recursive)
+                    return simulator->run(bitstrings, args.fidelity, args.verbose);
+                return simulator->run_flat(bitstrings, args.fidelity, args.verbose);
+            };
+            memory_plan = [simulator](size_t amplitudes) {
+                return simulator->memory_plan(simulator->cut_idx, simulator->num_xCZ, amplitudes, simulator->recursive);
+            };
+        }
+        else {
+            std::vector<int> cuts(args.cuts.begin(), args.cuts.end());
+            auto simulator = std::make_shared<MultiFeynmanSimulator>(circuit, args.use_feynman, memory_size, cuts, num_amplitudes, args.recursive);
+            configure_simulator(*simulator);
+            simulate = [simulator, args](const Kokkos::View<size_t*>& bitstrings) {
+                if (simulator->recursive)
+                    return simulator->run(bitstrings, args.fidelity, args.verbose);
+                return simulator->run_flat(bitstrings, args.fidelity, args.verbose);
+            };
+            memory_plan = [simulator](size_t amplitudes) {
+                return simulator->memory_plan(simulator->cuts, simulator->num_xCZ, amplitudes, simulator->recursive);
+            };
+        }
+
+        // Save the partial sum of this process, and combine the partial sums of all the processes
+        auto gather_paths = [&](const Kokkos::View<size_t*>& bitstrings, const Kokkos::View<cmplx*>& wave) {
+            if (!args.output_shard.empty()) {
+                ShardHeader header;
+                header.num_qubits = circuit.num_qubits;
+                header.num_paths = num_paths;
+                header.path_begin = selection.begin;
+                header.path_end = selection.end;
+                header.seed = seed;
+                std::string filename = args.output_shard;
+                if (num_processes() > 1)
+                    filename += fmt::format(".{}", process_rank());
+                write_shard(filename, header, bitstrings, wave);
             }
-            else if (args.use_rejection) {
-                // Implement frugal rejection sampling, from Google's article arXiv:1807.10749v3
-                /**
-                 * Find M' such that 2exp(-M'/(1-exp(-M'))) < epsilon
-                 */
-                int M = 1;
-                while (2 * std::exp(-M / (1 - std::exp(-M))) >= args.epsilon) {
-                    M++;
-                }
-                fmt::println("For {} bitstrings and epsilon {:.1e}, we have M': {}", args.nbitstrings, args.epsilon, M);
-                if (args.nbitstrings * M >= (1ull << circuit.num_qubits)) {
-                    fmt::println("Too many samples for the given epsilon. Do you want to run the full simulation?");
-                    return 1;
-                }
-
-                fmt::println("Seed: {}", seed);
-
-                Kokkos::View<size_t*> accepted_bitstrings("accepted_bitstrings", args.nbitstrings * 2);
-                Kokkos::View<cmplx*> accepted_amplitude("accepted_amplitude", args.nbitstrings * 2);
-                auto idx_counter = Kokkos::View<size_t*>("incr", 1); // Atomic counter
-
-                long int num_bitstring_left = args.nbitstrings;
-
-                Kokkos::Random_XorShift64_Pool<> random_pool((size_t)seed);
-
-                size_t N = 1ull << circuit.num_qubits;
-
-                Kokkos::UnorderedMap<size_t, int> bitset_map(args.nbitstrings * 2);
-
-                Kokkos::Timer timer;
-                size_t total_accepted = 0;
-                while (num_bitstring_left > 0) {
-                    Kokkos::View<size_t*> bitstrings("bitstrings", args.nbitstrings * M);
-
-                    // Generate m*l distinct bitstrings
-                    Kokkos::UnorderedMap<size_t, int> bitset_map_tmp(args.nbitstrings * 2);
-                    Kokkos::parallel_for("generate_bitstrings", bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) {
-                        auto generator = random_pool.get_state();
-                        size_t bit = generator.rand64() % N;
-                        while (bitset_map.exists(bit) || bitset_map_tmp.exists(bit)) {
-                            bit = generator.rand64() % N;
-                        }
-                        bitset_map_tmp.insert(bit, 1);
-                        random_pool.free_state(generator);
-                        bitstrings(i) = bit;
-                    });
-
-                    // Running the actual simulation on Feynman paths
-                    Kokkos::View<cmplx*> wave;
-                    if (args.recursive)
-                        wave = simulator.run(bitstrings, args.fidelity, args.verbose);
-                    else
-                        wave = simulator.run_flat(bitstrings, args.fidelity, args.verbose);
-
-                    auto accepted_counter = Kokkos::View<size_t*>("incr", 1); // Accepted counter
-                    // Accept or reject bitstrings with probability min(1, |psi|^2 N / M)
-                    Kokkos::parallel_for("accept_reject", bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) {
-                        size_t bit = bitstrings(i);
-                        cmplx amplitude = wave(i);
-                        float probability = Kokkos::abs(amplitude * amplitude);
-                        float accept_probability = Kokkos::min(1.f, probability * N);
-                        auto generator = random_pool.get_state();
-                        bool accept = generator.drand() < accept_probability;
-                        random_pool.free_state(generator);
-
-                        // This may accept a bit more than the number of bitstrings left
-                        // because of parallel execution
-                        if (accept && accepted_counter(0) < num_bitstring_left) {
-                            size_t idx = Kokkos::atomic_fetch_inc(&idx_counter(0));
-                            Kokkos::atomic_inc(&accepted_counter(0));
-                            bitset_map.insert(bit, 1);
-                            accepted_amplitude(idx) = amplitude;
-                            accepted_bitstrings(idx) = bit;
-                        }
-                    });
-                    auto accepted_counter_host = Kokkos::create_mirror_view(accepted_counter);
-                    Kokkos::deep_copy(accepted_counter_host, accepted_counter);
-                    num_bitstring_left -= accepted_counter_host(0);
-                    total_accepted += accepted_counter_host(0);
-                    fmt::println("Accepted: {} / {}", args.nbitstrings - num_bitstring_left, args.nbitstrings);
-                }
-
-                fmt::println("Total time: {}", print_time(timer.seconds()));
-
-                // Extract 
-                Kokkos::View<cmplx*> amplitudes("amplitudes", total_accepted);
-                Kokkos::View<size_t*> bitstrings("bitstrings", total_accepted);
-                fmt::println("Total accepted: {}", total_accepted);
-                Kokkos::parallel_for("extract_amplitudes", amplitudes.extent(0), KOKKOS_LAMBDA(size_t i) {
-                    amplitudes(i) = accepted_amplitude(i);
-                    bitstrings(i) = accepted_bitstrings(i);
+            reduce_amplitudes(wave);
+        };
+
+        // Amplitudes of the bitstrings of a file, computed once per distinct bitstring
+        if (!args.bitstrings_file.empty()) {
+            Kokkos::Timer timer;
+            UniqueBitstrings unique(request);
+            fmt::println("Bitstrings: {} requested, {} distinct", request.extent(0), unique.bitstrings.extent(0));
+
+            Kokkos::View<cmplx*> wave = simulate(unique.bitstrings);
+            gather_paths(unique.bitstrings, wave);
+            fmt::println("Total time: {}", print_time(timer.seconds()));
+
+            SampleVector vector{ circuit.num_qubits, request, unique.expand(wave) };
+            if (is_root)
+                output_statistics(vector);
+            if (is_root && !args.output_statevector.empty()) {
+                output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                    write_samplevector(out, host);
                 });
+            }
+        }
+        else if (args.nbitstrings < 0 || args.nbitstrings >= (1ull << circuit.num_qubits)) {
+            // An empty list of bitstrings requests the full statevector
+            Kokkos::View<size_t*> bitstrings;
 
-                SampleVector vector{ circuit.num_qubits, bitstrings, amplitudes };
+            Kokkos::View<cmplx*> wave = simulate(bitstrings);
+            gather_paths(bitstrings, wave);
 
-                if (!args.output_statevector.empty()) {
-                    std::ofstream out(args.output_statevector);
-                    out << print_samplevector(vector);
-                }
+            StateVector vector;
+            vector.num_qubits = circuit.num_qubits;
+            vector.wave = wave;
+            if (is_root) {
+                fmt::println("Statevector (full):\n{}", print_statevector(vector, 20));
+                output_statistics(vector);
             }
-            else {
-                Kokkos::Timer timer;
-                fmt::println("Seed: {}", seed);
-
-                Kokkos::View<size_t*> bitstrings("bitstrings", args.nbitstrings);
-                Kokkos::View<cmplx*> amplitudes("amplitudes", args.nbitstrings);
-
-                size_t N = 1ull << circuit.num_qubits;
-                Kokkos::Random_XorShift64_Pool<> random_pool((size_t)seed);
-
-                // Generate m*l distinct bitstrings
-                Kokkos::UnorderedMap<size_t, int> bitset_map_tmp(args.nbitstrings * 2);
-                Kokkos::parallel_for("generate_bitstrings", bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) {
-                    auto generator = random_pool.get_state();
-                    size_t bit = generator.rand64() % N;
-                    while (bitset_map_tmp.exists(bit)) {
-                        bit = generator.rand64() % N;
-                    }
-                    bitset_map_tmp.insert(bit, 1);
-                    random_pool.free_state(generator);
-                    bitstrings(i) = bit;
+            if (is_root && !args.output_statevector.empty()) {
+                output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                    out << print_statevector(host);
                 });
+            }
+            if (is_root && !args.output_probabilities.empty()) {
+                output_writer().write(args.output_probabilities, [host = probabilities_to_host(vector)](std::ostream& out) {
+                    out << print_probabilities(host);
+                });
+            }
+        }
+        else if (args.use_rejection) {
+            if (!sampler->feasible()) {
+                fmt::println("Too many samples for the given epsilon. Do you want to run the full simulation?");
+                return 1;
+            }
+            // The first round fits (it was planned with the simulator), the later ones are capped
+            sampler->max_batch = max_fitting_amplitudes([&](size_t batch) {
+                MemoryPlan round = memory_plan(batch);
+                round.add(sampler->memory_plan(batch));
+                return round;
+            }, sampler->N, memory_size);
+            if (sampler->max_batch == 0) {
+                fmt::println("Not enough memory left for the samples");
+                return 1;
+            }
+            SampleVector vector = sampler->sample(simulate);
+            output_statistics(vector);
+
+            if (!args.output_statevector.empty()) {
+                output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                    out << print_samplevector(host);
+                });
+            }
+        }
+        else {
+            Kokkos::Timer timer;
+            fmt::println("Seed: {}", seed);
+
+            Kokkos::View<size_t*> bitstrings("bitstrings", args.nbitstrings);
+
+            // Generate distinct bitstrings, from a keyed permutation of all the bitstrings
+            KeyedPermutation permutation(seed, circuit.num_qubits);
+            Kokkos::parallel_for("generate_bitstrings", bitstrings.extent(0), KOKKOS_LAMBDA(size_t i) {
+                bitstrings(i) = permutation(i);
+            });
+            broadcast_bitstrings(bitstrings);
+            if (checkpointer)
+                checkpointer->restore_bitstrings(bitstrings);
+
+            // Running the actual simulation on Feynman paths
+            Kokkos::View<cmplx*> wave = simulate(bitstrings);
+            gather_paths(bitstrings, wave);
+            fmt::println("Total time: {}", print_time(timer.seconds()));
+
+            SampleVector vector{ circuit.num_qubits, bitstrings, wave };
+            if (is_root)
+                output_statistics(vector);
+
+            if (is_root && !args.output_statevector.empty()) {
+                output_writer().write(args.output_statevector, [host = to_host(vector)](std::ostream& out) {
+                    out << print_samplevector(host);
+                });
+            }
+        }
+    }
 
-                // Running the actual simulation on Feynman paths
-                Kokkos::View<cmplx*> wave;
-                if (args.recursive)
-                    wave = simulator.run(bitstrings, args.fidelity, args.verbose);
-                else
-                    wave = simulator.run_flat(bitstrings, args.fidelity, args.verbose);
-                fmt::println("Total time: {}", print_time(timer.seconds()));
+    if (memory_tracker().installed) {
+        fmt::println("{}", memory_tracker().print(memory_size));
+    }
 
-                SampleVector vector{ circuit.num_qubits, bitstrings, wave };
+    if (!args.trace.empty()) {
+        std::string filename = args.trace;
+        if (num_processes() > 1)
+            filename += fmt::format(".{}", process_rank());
+        trace_recorder().write(filename);
+        trace_recorder().enabled = false;
+    }
+    return 0;
+}
+
+/** Outcome of a job of a batch */
+struct JobResult {
+    size_t index;
+    std::string options;
+    int status;
+    std::string error;
+    double seconds;
+    size_t peak_memory;
+};
 
-                if (!args.output_statevector.empty()) {
-                    std::ofstream out(args.output_statevector);
-                    out << print_samplevector(vector);
-                }
+/**
+ * Run the jobs of a manifest (or of stdin) in this process
+ *
+ * Each line holds the options of a job (e.g. "-c circuit.txt --use_feynman 1
+ * --output_statevector out.txt"), on top of the options of the command line.
+ * Empty lines and lines starting with # are skipped, and "quit" stops a job
+ * server. Kokkos stays initialised, the state vectors of the same size are
+ * reused from one job to the next, and the output files of a job are
+ * written in the background while the next job runs. A failed job
+ * (including options that do not parse) is reported and does not stop the
+ * batch; -h and -v are rejected on a job line.
+ */
+int run_batch(const Arguments& defaults) {
+    std::ifstream manifest;
+    bool server = defaults.batch == "-";
+    if (server && num_processes() > 1) {
+        fmt::println("The job server reads stdin and runs in a single process");
+        return 1;
+    }
+    if (!server) {
+        manifest.open(defaults.batch);
+        if (!manifest.is_open()) {
+            fmt::println("Could not open the batch manifest: {}", defaults.batch);
+            return 1;
+        }
+    }
+    std::istream& input = server ? std::cin : manifest;
+
+    output_writer().background = true;
+    state_pool().enabled = true;
+    std::vector<JobResult> results;
+    Kokkos::Timer batch_timer;
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream words(line);
+        std::vector<std::string> tokens = { "qc-simulator" };
+        std::string word;
+        while (words >> word)
+            tokens.push_back(word);
+        if (tokens.size() == 1 || tokens[1][0] == '#')
+            continue;
+        if (tokens[1] == "quit")
+            break;
+
+        JobResult result{ results.size(), line, 0, "", 0, 0 };
+        fmt::println("{}", header(fmt::format("Job {}: {}", result.index, line), false, false));
+        state_pool().next_job();
+        output_writer().job = result.index;
+        memory_tracker().reset_peak();
+        Kokkos::Timer timer;
+        try {
+            // The default actions of -h and -v exit the process, and would stop the batch
+            for (size_t t = 1;t < tokens.size();t++) {
+                if (tokens[t] == "-h" || tokens[t] == "--help" || tokens[t] == "-v" || tokens[t] == "--version")
+                    throw std::runtime_error(fmt::format("{} is not allowed in a job", tokens[t]));
             }
+            Arguments args = defaults;
+            args.batch.clear();
+            args.batch_report.clear();
+            std::vector<char*> argv;
+            for (auto& token : tokens)
+                argv.push_back(token.data());
+            Parser parser("Quantum Simulator", "0.1");
+            add_arguments(parser, args);
+            parser.parse_known_args(argv.size(), argv.data());
+
+            result.status = run_job(args);
         }
+        catch (const std::exception& e) {
+            result.status = 1;
+            result.error = e.what();
+            fmt::println("{}", warning(fmt::format("job {} failed: {}", result.index, e.what())));
+        }
+        Kokkos::fence();
+        result.seconds = timer.seconds();
+        result.peak_memory = memory_tracker().peak;
+        fmt::println("Job {} {}: {}, peak memory: {}", result.index, result.status == 0 ? "done" : "failed",
+            print_time(result.seconds), print_filesize(result.peak_memory));
+        std::fflush(stdout);
+        results.push_back(result);
+    }
+    output_writer().wait();
+    // A failed write fails the job that requested it, reported once all the files are written
+    for (const auto& write : output_writer().failures) {
+        JobResult& result = results[write.job];
+        result.status = 1;
+        result.error += (result.error.empty() ? "" : "; ") + write.error;
     }
+
+    size_t failed = 0;
+    for (const auto& result : results)
+        failed += result.status != 0;
+    fmt::println("Batch: {} jobs, {} failed, {} state vectors reused, {} failed writes, total time: {}",
+        results.size(), failed, state_pool().reused, output_writer().failures.size(), print_time(batch_timer.seconds()));
+
+    if (!defaults.batch_report.empty() && process_rank() == 0) {
+        std::ofstream out(defaults.batch_report);
+        out << "[\n";
+        for (size_t i = 0;i < results.size();i++) {
+            const auto& result = results[i];
+            out << fmt::format("  {{\"job\": {}, \"options\": \"{}\", \"status\": {}, \"error\": \"{}\", \"seconds\": {:.6f}, \"peak_memory\": {}}}{}\n",
+                result.index, escape_json(result.options), result.status, escape_json(result.error), result.seconds, result.peak_memory,
+                i + 1 < results.size() ? "," : "");
+        }
+        out << "]\n";
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+#ifdef KOKKOS_ENABLE_CUDA
+    fmt::println("Using CUDA");
+#else
+    fmt::println("Using OpenMP");
+#endif
+
+    Arguments args;
+
+    Parser arg_parser("Quantum Simulator", "0.1");
+    add_arguments(arg_parser, args);
+    arg_parser.parse_known_args(argc, argv);
+
+    if (args.circuit_file.empty() && args.batch.empty()) {
+        fmt::println("Please provide a circuit file");
+        arg_parser.print_help();
+        return 1;
+    }
+
+
+    distributed_init(&argc, &argv);
+    Kokkos::initialize(argc, argv);
+    int status = args.batch.empty() ? run_job(args) : run_batch(args);
     Kokkos::finalize();
-    return 0;
-}
\ No newline at end of file
+    distributed_finalize();
+    return status;
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include "types.h"
+#include "io/output/output.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Memory accounting of the simulations
+ *
+ * A MemoryPlan is the peak footprint that a simulator predicts before it
+ * runs, such that a plan that does not fit into the budget is rejected or
+ * adapted at startup, instead of the run being killed hours in.
+ *
+ * The MemoryTracker follows the allocations of every View in the memory
+ * space of the execution space, by label, through the Kokkos Tools
+ * callbacks, and keeps the peak usage to compare with the plan.
+ */
+struct MemoryPlan {
+    std::vector<std::pair<std::string, size_t>> entries;
+
+    void add(const std::string& label, size_t bytes, size_t count = 1) {
+        entries.push_back({ count > 1 ? fmt::format("{} (x{})", label, count) : label, bytes * count });
+    }
+
+    void add(const MemoryPlan& other) {
+        entries.insert(entries.end(), other.entries.begin(), other.entries.end());
+    }
+
+    size_t total() const {
+        size_t total = 0;
+        for (const auto& [label, bytes] : entries) {
+            total += bytes;
+        }
+        return total;
+    }
+
+    /** A budget of 0 means no limit */
+    bool fits(size_t budget) const {
+        return budget == 0 || total() <= budget;
+    }
+
+    std::string print() const {
+        std::string out;
+        for (const auto& [label, bytes] : entries) {
+            out += fmt::format("  {:<32} {:>10}\n", label, print_filesize(bytes));
+        }
+        out += fmt::format("  {:<32} {:>10}", "Total", print_filesize(total()));
+        return out;
+    }
+};
+
+/** Largest number of amplitudes in [1, max] whose plan fits into the budget, 0 if none */
+inline size_t max_fitting_amplitudes(const std::function<MemoryPlan(size_t)>& plan, size_t max, size_t budget) {
+    if (!plan(1).fits(budget)) {
+        return 0;
+    }
+    size_t low = 1;
+    size_t high = max;
+    while (low < high) {
+        size_t mid = low + (high - low + 1) / 2;
+        if (plan(mid).fits(budget))
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+struct MemoryTracker {
+    struct Usage {
+        size_t current = 0;
+        size_t peak = 0;
+        size_t allocations = 0;
+    };
+
+    bool installed = false;
+    size_t current = 0;
+    size_t peak = 0;
+    std::map<std::string, Usage> labels;
+    std::map<std::string, size_t> at_peak; // Usage by label when the peak was reached
+    std::mutex mutex;
+
+    /**
+     * Follow the allocations of the Views
+     *
+     * A profiling tool loaded with --kokkos-tools-libs already uses the
+     * callbacks, in which case the tracker stays disabled.
+     */
+    void install();
+
+    void allocate(const std::string& label, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& usage = labels[label];
+        usage.current += bytes;
+        usage.peak = MAX(usage.peak, usage.current);
+        usage.allocations++;
+        current += bytes;
+        if (current > peak) {
+            peak = current;
+            at_peak.clear();
+            for (const auto& [name, u] : labels) {
+                if (u.current > 0)
+                    at_peak[name] = u.current;
+            }
+        }
+    }
+
+    void deallocate(const std::string& label, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        labels[label].current -= bytes;
+        current -= bytes;
+    }
+
+    /** Restart the peak from the current usage (between the jobs of a batch) */
+    void reset_peak() {
+        std::lock_guard<std::mutex> lock(mutex);
+        peak = current;
+        at_peak.clear();
+        for (const auto& [name, u] : labels) {
+            if (u.current > 0)
+                at_peak[name] = u.current;
+        }
+        for (auto& [name, u] : labels) {
+            u.peak = u.current;
+            u.allocations = 0;
+        }
+    }
+
+    /** Peak usage, and the Views alive at the peak */
+    std::string print(size_t budget = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string out = fmt::format("Peak memory: {}", print_filesize(peak));
+        if (budget > 0) {
+            out += fmt::format(" ({:.1f}% of the budget of {})", 100.0 * peak / budget, print_filesize(budget));
+        }
+        std::vector<std::pair<size_t, std::string>> sorted;
+        for (const auto& [label, bytes] : at_peak) {
+            sorted.push_back({ bytes, label });
+        }
+        std::sort(sorted.rbegin(), sorted.rend());
+        for (const auto& [bytes, label] : sorted) {
+            out += fmt::format("\n  {:<32} {:>10} ({} allocations)", label, print_filesize(bytes), labels[label].allocations);
+        }
+        return out;
+    }
+};
+
+inline MemoryTracker& memory_tracker() {
+    static MemoryTracker tracker;
+    return tracker;
+}
+
+namespace memory_callbacks {
+/** Only the memory space of the execution space is accounted (not the host mirrors on GPU) */
+inline bool is_tracked(const Kokkos::Tools::SpaceHandle& handle) {
+    return std::strcmp(handle.name, ExecSpace::memory_space::name()) == 0;
+}
+
+inline void allocate(const Kokkos::Tools::SpaceHandle handle, const char* label, const void*, const uint64_t size) {
+    if (is_tracked(handle))
+        memory_tracker().allocate(label, size);
+}
+
+inline void deallocate(const Kokkos::Tools::SpaceHandle handle, const char* label, const void*, const uint64_t size) {
+    if (is_tracked(handle))
+        memory_tracker().deallocate(label, size);
+}
+}
+
+inline void MemoryTracker::install() {
+    if (installed || Kokkos::Tools::profileLibraryLoaded()) {
+        return;
+    }
+    Kokkos::Tools::Experimental::set_allocate_data_callback(memory_callbacks::allocate);
+    Kokkos::Tools::Experimental::set_deallocate_data_callback(memory_callbacks::deallocate);
+    installed = true;
+}
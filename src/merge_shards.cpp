@@ -0,0 +1,109 @@
+#include "kokkos.h"
+#include "io/output/output.h"
+#include "util/arg_parser.h"
+#include <fstream>
+#include <sstream>
+
+#include "simulator.h"
+#include "io/shard.h"
+
+/**
+ * Sum the partial amplitudes of the shards of a sharded Feynman run
+ *
+ * All the shards must come from the same run (same circuit, seed and
+ * bitstrings), and their path ranges must not overlap.
+ */
+
+struct Arguments {
+    std::string shards;
+    std::string output;
+    std::string output_statevector;
+};
+
+int main(int argc, char* argv[]) {
+    Arguments args;
+
+    Parser arg_parser("Merge Feynman shards", "0.1");
+    arg_parser.add_argument("-s,--shards", "Comma separated list of shard files", args.shards);
+    arg_parser.add_argument("-o,--output", "Output the merged amplitudes as a shard file", args.output);
+    arg_parser.add_argument("--output_statevector", "Output the merged amplitudes to file (text)", args.output_statevector);
+    arg_parser.parse_known_args(argc, argv);
+
+    std::vector<std::string> files;
+    std::istringstream ss(args.shards);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        if (!token.empty())
+            files.push_back(token);
+    }
+    if (files.empty()) {
+        fmt::println("Please provide the shard files");
+        arg_parser.print_help();
+        return 1;
+    }
+
+    Kokkos::initialize(argc, argv);
+    {
+        Shard merged = read_shard(files[0]);
+        auto& header = merged.header;
+        std::vector<std::pair<size_t, size_t>> ranges = { { header.path_begin, header.path_end } };
+        fmt::println("{}: paths [{}, {})", files[0], header.path_begin, header.path_end);
+
+        for (size_t f = 1;f < files.size();f++) {
+            Shard shard = read_shard(files[f]);
+            const auto& other = shard.header;
+            fmt::println("{}: paths [{}, {})", files[f], other.path_begin, other.path_end);
+            if (other.num_qubits != header.num_qubits || other.num_amplitudes != header.num_amplitudes
+                || other.num_paths != header.num_paths || other.seed != header.seed
+                || other.has_bitstrings != header.has_bitstrings) {
+                throw std::runtime_error("Shard " + files[f] + " does not belong to the same run");
+            }
+            for (size_t i = 0;i < other.num_amplitudes && other.has_bitstrings;i++) {
+                if (shard.bitstrings(i) != merged.bitstrings(i)) {
+                    throw std::runtime_error("Shard " + files[f] + " was computed on different bitstrings");
+                }
+            }
+            for (const auto& range : ranges) {
+                if (other.path_begin < range.second && range.first < other.path_end) {
+                    throw std::runtime_error("Shard " + files[f] + " overlaps with another shard");
+                }
+            }
+            ranges.push_back({ other.path_begin, other.path_end });
+
+            auto wave = merged.wave;
+            auto other_wave = shard.wave;
+            Kokkos::parallel_for("merge_shards", HostRangePolicy(0, wave.extent(0)), KOKKOS_LAMBDA(size_t i) {
+                wave(i) += other_wave(i);
+            });
+        }
+
+        size_t covered = 0;
+        for (const auto& range : ranges) {
+            covered += range.second - range.first;
+        }
+        fmt::println("Merged {} shards, {} / {} paths covered", files.size(), covered, header.num_paths);
+        if (covered != header.num_paths) {
+            fmt::println("{}", warning("some paths are missing, the amplitudes are partial"));
+        }
+        header.path_begin = 0;
+        header.path_end = covered;
+
+        Kokkos::View<size_t*> bitstrings("bitstrings", merged.bitstrings.extent(0));
+        Kokkos::View<cmplx*> wave("wave", merged.wave.extent(0));
+        Kokkos::deep_copy(bitstrings, merged.bitstrings);
+        Kokkos::deep_copy(wave, merged.wave);
+
+        if (!args.output.empty()) {
+            write_shard(args.output, header, bitstrings, wave);
+        }
+        if (!args.output_statevector.empty()) {
+            std::ofstream out(args.output_statevector);
+            if (header.has_bitstrings)
+                out << print_samplevector(SampleVector{ header.num_qubits, bitstrings, wave });
+            else
+                out << print_statevector(StateVector{ header.num_qubits, wave });
+        }
+    }
+    Kokkos::finalize();
+    return 0;
+}
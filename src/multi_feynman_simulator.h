@@ -0,0 +1,565 @@
+#pragma once
+
+#include "simulator.h"
+#include "path_selection.h"
+#include "checkpointer.h"
+#include "sorted_bitstrings.h"
+
+#include <vector>
+
+/**
+ * Feynman simulator with a k-way cut
+ *
+ * The qubits are partitioned into k contiguous blocks, each of them simulated
+ * with its own SchrodingerSimulator. Every two-qubit gate that crosses a block
+ * boundary is split into two paths:
+ *  - P0 on the control
+ *  - P1 on the control and Z (X for CX) on the target
+ *
+ * The amplitude of a bitstring is then the sum over all paths of the product
+ * of the k block amplitudes.
+ *
+ * Nesting a Feynman simulation inside a block is the same as cutting this
+ * block further: the cross gates of the inner cut simply become additional
+ * paths of the global plan. Hierarchical plans are thus expressed as a finer
+ * partition, and the recursive mode shares the common gate prefixes of the
+ * paths like FeynmanSimulator::run does.
+ *
+ * All the block wavefunctions of a path live in one contiguous View (each
+ * block is a subview of it), such that a path state can be copied in one go
+ * and the accumulation kernel only reads from one buffer.
+ */
+struct MultiFeynmanSimulator {
+    Circuit global_circuit;
+    std::vector<int> cuts;        // Block j covers the qubits [cuts[j], cuts[j + 1])
+    std::vector<int> block_of;    // Block index of each qubit
+    std::vector<size_t> offsets;  // Offset of each block in the concatenated wavefunction
+    int num_blocks;
+    int num_qubits;
+    int num_xCZ;
+    size_t num_paths;
+    size_t max_memory;
+    size_t num_amplitudes; // Requested amplitudes per run, 0 for the full statevector
+    bool recursive;
+    MemoryPlan memory;
+    size_t counter = 0;
+    PathSelection paths;
+    std::shared_ptr<Checkpointer> checkpointer;
+
+    // Pruning of the paths whose weight (product of the block norms) is below the tolerance
+    precision prune_tolerance = 0;
+    size_t pruned_paths = 0;
+    precision pruned_weight = 0;
+
+    // Geometry of the blocks, used by the accumulation kernel
+    Kokkos::View<size_t*> block_offset;
+    Kokkos::View<size_t*> block_shift;
+    Kokkos::View<size_t*> block_mask;
+
+    static bool is_cross_gate(const Gate& gate, const std::vector<int>& block_of) {
+        return gate.control != -1 && block_of[gate.control] != block_of[gate.target];
+    }
+
+    int count_number_of_cross_CZ(const std::vector<int>& boundaries) {
+        std::vector<int> blocks(num_qubits);
+        for (int j = 0;j + 1 < boundaries.size();j++) {
+            for (int q = boundaries[j];q < boundaries[j + 1];q++) {
+                blocks[q] = j;
+            }
+        }
+        int count = 0;
+        for (const auto& gate : global_circuit.gates) {
+            if (is_cross_gate(gate, blocks)) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Peak memory of a run with the given boundaries
+     *
+     * The flat simulation keeps the initial blocks and the blocks of the
+     * current path, the recursive one keeps a copy of the blocks per level
+     * of the tree of paths.
+     */
+    MemoryPlan memory_plan(const std::vector<int>& boundaries, int num_cross, size_t amplitudes, bool recursive) const {
+        size_t path_memory = 0;
+        for (int j = 0;j + 1 < boundaries.size();j++) {
+            path_memory += wave_function_memory_size<precision>(boundaries[j + 1] - boundaries[j]);
+        }
+        MemoryPlan plan;
+        plan.add("waves", path_memory, recursive ? num_cross + 1 : 2);
+        plan.add(SortedBitstrings::memory_plan(amplitudes, num_qubits));
+        return plan;
+    }
+
+    /** Plan of the chosen cuts, falling back to the flat simulation if the recursive one does not fit */
+    void plan_memory() {
+        memory = memory_plan(cuts, num_xCZ, num_amplitudes, recursive);
+        if (!memory.fits(max_memory) && recursive) {
+            MemoryPlan flat = memory_plan(cuts, num_xCZ, num_amplitudes, false);
+            if (flat.fits(max_memory)) {
+                fmt::println("The recursive simulation needs {} (over the budget of {}), running the flat simulation",
+                    print_filesize(memory.total()), print_filesize(max_memory));
+                recursive = false;
+                memory = flat;
+            }
+        }
+        if (!memory.fits(max_memory)) {
+            throw std::runtime_error(fmt::format("The simulation needs {}, over the memory budget of {}:\n{}",
+                print_filesize(memory.total()), print_filesize(max_memory), memory.print()));
+        }
+        fmt::println("Memory plan:\n{}", memory.print());
+    }
+
+    /**
+     * Find the k-1 cut positions that minimise the number of cross gates,
+     * with the flat plan of k blocks of the largest size fitting into max_memory
+     *
+     * A gate (lo, hi) is crossed by the boundaries b_1 < b_2 < ... if one of
+     * them is in (lo, hi]. If we count each gate on the first boundary that
+     * crosses it, the cost of placing b_j after b_{j-1} only depends on b_{j-1}:
+     *   cost(b_{j-1}, b_j) = #gates with b_{j-1} <= lo < b_j <= hi
+     * which makes the problem solvable by dynamic programming.
+     */
+    std::vector<int> find_optimal_cuts(int k) {
+        fmt::println("Finding optimal {}-way circuit cut that fits into memory", k);
+        auto uniform = [k](int size) {
+            std::vector<int> boundaries(k + 1);
+            for (int j = 0;j <= k;j++) {
+                boundaries[j] = j * size;
+            }
+            return boundaries;
+        };
+        int max_block = 0;
+        while (max_block < num_qubits && memory_plan(uniform(max_block + 1), 0, num_amplitudes, false).fits(max_memory)) {
+            max_block++;
+        }
+
+        std::vector<std::vector<int>> span_count(num_qubits, std::vector<int>(num_qubits + 1, 0));
+        for (const auto& gate : global_circuit.gates) {
+            if (gate.control != -1) {
+                span_count[MIN(gate.control, gate.target)][MAX(gate.control, gate.target)]++;
+            }
+        }
+        auto cost = [&](int prev, int b) {
+            int count = 0;
+            for (int lo = prev;lo < b;lo++) {
+                for (int hi = b;hi < num_qubits;hi++) {
+                    count += span_count[lo][hi];
+                }
+            }
+            return count;
+        };
+
+        const int inf = 1e9;
+        // best[j][b]: minimal cost with j boundaries placed, the last one at b
+        std::vector<std::vector<int>> best(k, std::vector<int>(num_qubits + 1, inf));
+        std::vector<std::vector<int>> parent(k, std::vector<int>(num_qubits + 1, -1));
+        best[0][0] = 0;
+        for (int j = 1;j < k;j++) {
+            for (int b = j;b < num_qubits;b++) {
+                for (int prev = MAX(0, b - max_block);prev < b;prev++) {
+                    if (best[j - 1][prev] == inf) {
+                        continue;
+                    }
+                    int c = best[j - 1][prev] + cost(prev, b);
+                    if (c < best[j][b]) {
+                        best[j][b] = c;
+                        parent[j][b] = prev;
+                    }
+                }
+            }
+        }
+
+        int last = -1;
+        for (int b = MAX(1, num_qubits - max_block);b < num_qubits;b++) {
+            if (best[k - 1][b] != inf && (last == -1 || best[k - 1][b] < best[k - 1][last])) {
+                last = b;
+            }
+        }
+        if (last == -1) {
+            throw std::runtime_error("Could not find a cut that fits into memory");
+        }
+
+        std::vector<int> boundaries(k + 1);
+        boundaries[0] = 0;
+        boundaries[k] = num_qubits;
+        for (int j = k - 1, b = last;j > 0;b = parent[j][b], j--) {
+            boundaries[j] = b;
+        }
+        return boundaries;
+    }
+
+    /**
+     * @param max_memory memory budget in bytes (0 for no limit)
+     * @param num_amplitudes amplitudes requested per run (0 for the full
+     * statevector), to plan the memory of the runs
+     * @param recursive planned mode, may fall back to flat to fit the budget
+     */
+    MultiFeynmanSimulator(const Circuit& global_circuit, int num_blocks, size_t max_memory, const std::vector<int>& cut_at = {},
+        size_t num_amplitudes = 0, bool recursive = false)
+        : global_circuit(global_circuit), num_blocks(num_blocks), max_memory(max_memory), num_amplitudes(num_amplitudes), recursive(recursive) {
+        num_qubits = global_circuit.num_qubits;
+        if (!cut_at.empty()) {
+            this->num_blocks = cut_at.size() + 1;
+            cuts.push_back(0);
+            for (int c : cut_at) {
+                if (c <= cuts.back() || c >= num_qubits) {
+                    throw std::runtime_error("Cuts must be strictly increasing and inside the circuit");
+                }
+                cuts.push_back(c);
+            }
+            cuts.push_back(num_qubits);
+        }
+        else {
+            cuts = find_optimal_cuts(num_blocks);
+        }
+
+        block_of.resize(num_qubits);
+        offsets.resize(this->num_blocks + 1, 0);
+        block_offset = Kokkos::View<size_t*>("block_offset", this->num_blocks);
+        block_shift = Kokkos::View<size_t*>("block_shift", this->num_blocks);
+        block_mask = Kokkos::View<size_t*>("block_mask", this->num_blocks);
+        auto offset_host = Kokkos::create_mirror_view(block_offset);
+        auto shift_host = Kokkos::create_mirror_view(block_shift);
+        auto mask_host = Kokkos::create_mirror_view(block_mask);
+        for (int j = 0;j < this->num_blocks;j++) {
+            int size = cuts[j + 1] - cuts[j];
+            for (int q = cuts[j];q < cuts[j + 1];q++) {
+                block_of[q] = j;
+            }
+            offsets[j + 1] = offsets[j] + (1ull << size);
+            offset_host(j) = offsets[j];
+            shift_host(j) = num_qubits - cuts[j + 1];
+            mask_host(j) = (1ull << size) - 1;
+        }
+        Kokkos::deep_copy(block_offset, offset_host);
+        Kokkos::deep_copy(block_shift, shift_host);
+        Kokkos::deep_copy(block_mask, mask_host);
+
+        num_xCZ = count_number_of_cross_CZ(cuts);
+        num_paths = 1ull << num_xCZ;
+        paths = PathSelection(num_paths);
+
+        fmt::print("Cuts:");
+        for (int j = 0;j < this->num_blocks;j++) {
+            fmt::print(" [{}, {})", cuts[j], cuts[j + 1]);
+        }
+        fmt::println(", number of cross CZ: {}, memory per path: {}", num_xCZ, print_filesize(offsets.back() * sizeof(cmplx)));
+        fmt::println("Number of Feynman paths: {}", num_paths);
+        plan_memory();
+    }
+
+    /** Create the block simulators on top of the concatenated wavefunction */
+    std::vector<SchrodingerSimulator> make_blocks(const Kokkos::View<cmplx*>& waves) {
+        std::vector<SchrodingerSimulator> blocks(num_blocks);
+        for (int j = 0;j < num_blocks;j++) {
+            blocks[j].N = offsets[j + 1] - offsets[j];
+            blocks[j].wave = Kokkos::subview(waves, std::make_pair(offsets[j], offsets[j + 1]));
+            blocks[j].circuit.num_qubits = cuts[j + 1] - cuts[j];
+        }
+        return blocks;
+    }
+
+    /** Copy the path state (wavefunctions and sqrt counters) into a new buffer */
+    std::vector<SchrodingerSimulator> copy_blocks(const std::vector<SchrodingerSimulator>& blocks, const Kokkos::View<cmplx*>& waves, Kokkos::View<cmplx*>& new_waves) {
+        new_waves = allocate_state("waves", offsets.back());
+        Kokkos::deep_copy(new_waves, waves);
+        auto new_blocks = make_blocks(new_waves);
+        for (int j = 0;j < num_blocks;j++) {
+            new_blocks[j].sqrt_counter = blocks[j].sqrt_counter;
+        }
+        return new_blocks;
+    }
+
+    /** Apply a gate that is local to a block */
+    void apply_local_gate(Gate gate, std::vector<SchrodingerSimulator>& blocks) {
+        int j = block_of[gate.target];
+        gate.target -= cuts[j];
+        if (gate.control != -1) {
+            gate.control -= cuts[j];
+        }
+        blocks[j].apply_gate(gate, false);
+    }
+
+    /**
+     * Apply one of the two branches of a cross gate
+     *
+     * @param left if true, P0 on the control, otherwise P1 on the control and
+     * Z (or X for CX) on the target
+     * @param norms squared norms of the blocks, updated when pruning (the
+     * projection and the norm are computed in the same sweep)
+     */
+    void apply_cross_branch(const Gate& gate, bool left, std::vector<SchrodingerSimulator>& blocks, std::vector<precision>& norms) {
+        Gate new_gate;
+        new_gate.type = left ? GateType::P0 : GateType::P1;
+        new_gate.target = gate.control;
+        if (prune_tolerance > 0) {
+            int j = block_of[gate.control];
+            norms[j] = blocks[j].apply_projection(gate.control - cuts[j], left ? 0 : 1);
+        }
+        else {
+            apply_local_gate(new_gate, blocks);
+        }
+        if (!left) {
+            new_gate.type = gate.type == GateType::CX ? GateType::X : GateType::Z;
+            new_gate.target = gate.target;
+            apply_local_gate(new_gate, blocks);
+        }
+    }
+
+    /**
+     * Add the contribution of one path to the accumulator
+     *
+     * The normalisation of all the blocks is folded into one factor instead
+     * of sweeping every block wavefunction. If bitstrings is empty, the full
+     * statevector is accumulated.
+     */
+    void accumulate(const std::vector<SchrodingerSimulator>& blocks, const Kokkos::View<cmplx*>& waves,
+        const Kokkos::View<size_t*>& bitstrings, Kokkos::View<cmplx*>& global_wave) {
+        size_t sqrt_counter = 0;
+        for (const auto& block : blocks) {
+            sqrt_counter += block.sqrt_counter;
+        }
+        precision factor = 1. / Kokkos::pow(Kokkos::sqrt(2.), sqrt_counter);
+        bool full = bitstrings.extent(0) == 0;
+        int k = num_blocks;
+        auto offset = block_offset;
+        auto shift = block_shift;
+        auto mask = block_mask;
+        // The bitstring, one amplitude per block, and the accumulator
+        double bytes = ((full ? 0. : sizeof(size_t)) + (k + 2.) * sizeof(cmplx)) * global_wave.extent(0);
+        TraceRegion region("accumulate_multi", "kernel", bytes);
+        Kokkos::parallel_for("accumulate_multi", global_wave.extent(0), KOKKOS_LAMBDA(size_t i) {
+            size_t idx = full ? i : bitstrings(i);
+            cmplx ampl = factor;
+            for (int j = 0;j < k;j++) {
+                ampl *= waves(offset(j) + ((idx >> shift(j)) & mask(j)));
+            }
+            global_wave(i) += ampl;
+        });
+    }
+
+    /**
+     * Decide whether to discard the num_discarded paths that continue from
+     * blocks of squared norms norms
+     *
+     * The rest of the circuit is unitary, so the product of the block norms is
+     * exactly the norm of what these paths add to the statevector, and the
+     * sum of the pruned weights bounds the error on the statevector (2-norm).
+     */
+    bool prune(const std::vector<precision>& norms, size_t num_discarded) {
+        if (prune_tolerance <= 0) {
+            return false;
+        }
+        precision weight = 1;
+        for (precision norm : norms) {
+            weight *= norm;
+        }
+        weight = Kokkos::sqrt(weight);
+        if (weight >= prune_tolerance) {
+            return false;
+        }
+        pruned_paths += num_discarded;
+        pruned_weight += weight;
+        return true;
+    }
+
+    void print_pruning() {
+        if (prune_tolerance > 0) {
+            fmt::println("Pruned paths: {}, discarded weight (error bound on the statevector): {:.3e}", pruned_paths, pruned_weight);
+        }
+    }
+
+    void recursive_path(
+        size_t path,
+        float fidelity,
+        const Kokkos::View<size_t*>& bitstrings,
+        Kokkos::View<cmplx*>& global_wave,
+        std::vector<SchrodingerSimulator>& blocks, Kokkos::View<cmplx*>& waves,
+        std::vector<precision> norms,
+        int gate_idx, int level, int verbose
+    ) {
+        // Skip the subtrees that do not contain any selected path
+        size_t subtree_size = 1ull << (num_xCZ - level);
+        if (!paths.overlaps(path * subtree_size, (path + 1) * subtree_size)) {
+            return;
+        }
+        TraceRegion region(level == num_xCZ ? fmt::format("path {}", path) : fmt::format("subtree {} (level {})", path, level), "path");
+        if (level == num_xCZ) { // Last level (leaf in tree of paths)
+            counter++;
+            if (checkpointer) { // All the paths before this one are done
+                checkpointer->update(global_wave, path, pruned_paths, pruned_weight);
+            }
+            if (!paths.keep(path, fidelity)) { // Discard path with probability fidelity
+                return;
+            }
+        }
+
+        int diverging_idx = -1;
+        for (int i = gate_idx;i < global_circuit.gates.size();i++) {
+            const auto& gate = global_circuit.gates[i];
+            if (is_cross_gate(gate, block_of)) {
+                diverging_idx = i;
+                break;
+            }
+            apply_local_gate(gate, blocks);
+        }
+
+        // We reached a leaf, end of recursion
+        if (diverging_idx == -1) {
+            if (verbose) {
+                fmt::println("  Finishing path {} ({:.1f}%)", counter, 100.0 * counter / num_paths);
+            }
+            accumulate(blocks, waves, bitstrings, global_wave);
+            return;
+        }
+
+        // Otherwise, we have a diverging path
+        Kokkos::View<cmplx*> waves_cpy;
+        auto blocks_cpy = copy_blocks(blocks, waves, waves_cpy);
+        const auto& gate = global_circuit.gates[diverging_idx];
+
+        size_t child_size = subtree_size / 2;
+
+        auto left_norms = norms;
+        apply_cross_branch(gate, true, blocks, left_norms);
+        if (!prune(left_norms, paths.count(2 * path * child_size, (2 * path + 1) * child_size))) {
+            recursive_path(2 * path, fidelity, bitstrings, global_wave, blocks, waves, left_norms, diverging_idx + 1, level + 1, verbose);
+        }
+        auto right_norms = norms;
+        apply_cross_branch(gate, false, blocks_cpy, right_norms);
+        if (!prune(right_norms, paths.count((2 * path + 1) * child_size, (2 * path + 2) * child_size))) {
+            recursive_path(2 * path + 1, fidelity, bitstrings, global_wave, blocks_cpy, waves_cpy, right_norms, diverging_idx + 1, level + 1, verbose);
+        }
+    }
+
+    /**
+     * Run the simulation on the requested bitstrings, sharing the gate
+     * prefixes of the paths
+     *
+     * Pass an empty bitstrings View to get the full statevector.
+     */
+    Kokkos::View<cmplx*> run(const Kokkos::View<size_t*>& request, float fidelity, int verbose = true) {
+        // Gather in the increasing order of the bitstrings, see SortedBitstrings
+        SortedBitstrings sorted(request);
+        const auto& bitstrings = sorted.bitstrings;
+
+        Kokkos::Timer timer;
+
+        Kokkos::View<cmplx*> waves = allocate_state("waves", offsets.back());
+        auto blocks = make_blocks(waves);
+        for (auto& block : blocks) {
+            block.initialise_state(true);
+        }
+
+        counter = 0;
+        pruned_paths = 0;
+        pruned_weight = 0;
+
+        size_t num_amplitudes = request.extent(0) == 0 ? 1ull << num_qubits : request.extent(0);
+        Kokkos::View<cmplx*> global_wave("global_wave", num_amplitudes);
+
+        PathSelection selection = paths;
+        if (checkpointer) {
+            paths.begin = checkpointer->start(global_circuit, fidelity, prune_tolerance, num_paths, paths, cuts, bitstrings, global_wave, pruned_paths, pruned_weight);
+        }
+
+        recursive_path(0, fidelity, bitstrings, global_wave, blocks, waves, std::vector<precision>(num_blocks, 1), 0, 0, verbose);
+
+        paths = selection;
+        if (checkpointer) {
+            checkpointer->finish();
+        }
+        print_pruning();
+
+        if (verbose) {
+            Kokkos::fence();
+            fmt::println("Total time: {}", print_time(timer.seconds()));
+        }
+        return sorted.unpermute(global_wave);
+    }
+
+    /**
+     * Run the simulation on the requested bitstrings, each path from scratch
+     *
+     * Pass an empty bitstrings View to get the full statevector.
+     */
+    Kokkos::View<cmplx*> run_flat(const Kokkos::View<size_t*>& request, float fidelity, int verbose = true) {
+        // Gather in the increasing order of the bitstrings, see SortedBitstrings
+        SortedBitstrings sorted(request);
+        const auto& bitstrings = sorted.bitstrings;
+
+        Kokkos::View<cmplx*> initial_waves = allocate_state("initial_waves", offsets.back());
+        auto initial_blocks = make_blocks(initial_waves);
+        for (auto& block : initial_blocks) {
+            block.initialise_state(true);
+        }
+
+        // The path buffer is allocated once and reset from the initial state
+        Kokkos::View<cmplx*> waves = allocate_state("waves", offsets.back());
+
+        size_t num_amplitudes = request.extent(0) == 0 ? 1ull << num_qubits : request.extent(0);
+        Kokkos::View<cmplx*> global_wave("global_wave", num_amplitudes);
+
+        // Restored by the checkpoint, if any
+        pruned_paths = 0;
+        pruned_weight = 0;
+        size_t first_path = paths.begin;
+        if (checkpointer) {
+            first_path = checkpointer->start(global_circuit, fidelity, prune_tolerance, num_paths, paths, cuts, bitstrings, global_wave, pruned_paths, pruned_weight);
+        }
+
+        Kokkos::Timer timer;
+        for (size_t p = first_path;p < paths.end;p++) {
+            if (checkpointer) { // All the paths before p are done
+                checkpointer->update(global_wave, p, pruned_paths, pruned_weight);
+            }
+            if (!paths.keep(p, fidelity)) { // Discard path with probability fidelity
+                continue;
+            }
+            TraceRegion region(fmt::format("path {}", p), "path");
+            Kokkos::Timer path_timer;
+
+            Kokkos::deep_copy(waves, initial_waves);
+            auto blocks = make_blocks(waves);
+            for (int j = 0;j < num_blocks;j++) {
+                blocks[j].sqrt_counter = initial_blocks[j].sqrt_counter;
+            }
+
+            std::vector<precision> norms(num_blocks, 1);
+            bool pruned = false;
+            int xCZ_idx = 0;
+            for (int i = 0;i < global_circuit.gates.size() && !pruned;i++) {
+                const auto& gate = global_circuit.gates[i];
+                if (is_cross_gate(gate, block_of)) {
+                    size_t xCZ_mask = 1ull << (num_xCZ - 1 - xCZ_idx);
+                    apply_cross_branch(gate, !(xCZ_mask & p), blocks, norms);
+                    pruned = prune(norms, 1);
+                    xCZ_idx++;
+                }
+                else {
+                    apply_local_gate(gate, blocks);
+                }
+            }
+            if (pruned) {
+                continue;
+            }
+
+            accumulate(blocks, waves, bitstrings, global_wave);
+            Kokkos::fence();
+            double time = path_timer.seconds();
+            if (verbose) {
+                fmt::println("Path {} ({:.0f}%) , ETA {}", p, 100.0 * (p - paths.begin) / paths.size(), print_time(time * (paths.end - p) * fidelity));
+            }
+        }
+        if (checkpointer) {
+            checkpointer->finish();
+        }
+        print_pruning();
+        fmt::println("Simulating all paths: {}", print_time(timer.seconds()));
+        return sorted.unpermute(global_wave);
+    }
+};
@@ -0,0 +1,459 @@
+#pragma once
+
+#include "simulator.h"
+#include "memory.h"
+#include "util/counter_rng.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+constexpr int num_gate_types = (int)GateType::CZ + 1;
+
+/**
+ * Noise of the gates and of the readout
+ *
+ * After a gate, a depolarizing error applies a random non-identity Pauli on
+ * its qubits (3 for a one-qubit gate, 15 for a two-qubit gate) with the
+ * probability of its gate type, then each qubit of the gate is damped with
+ * the amplitude damping rate of the gate type. The readout flips each
+ * measured bit with the readout probability.
+ *
+ * The model is given as comma separated channel[:gate]=value entries, the
+ * entries without gate applying to all the gates, e.g.
+ * "depolarizing=1e-3,depolarizing:CZ=1e-2,damping=1e-4,readout=2e-2".
+ */
+struct NoiseModel {
+    precision depolarizing[num_gate_types] = {};
+    precision damping[num_gate_types] = {};
+    precision readout = 0;
+
+    bool empty() const {
+        for (int t = 0;t < num_gate_types;t++) {
+            if (depolarizing[t] > 0 || damping[t] > 0)
+                return false;
+        }
+        return readout == 0;
+    }
+
+    static NoiseModel parse(const std::string& spec) {
+        NoiseModel model;
+        std::vector<std::string> entries;
+        std::stringstream stream(spec);
+        std::string entry;
+        while (std::getline(stream, entry, ',')) {
+            if (!entry.empty())
+                entries.push_back(entry);
+        }
+        // The entries of all the gates first, such that the ones of a gate type override them
+        for (int pass = 0;pass < 2;pass++) {
+            for (const auto& entry : entries) {
+                size_t equal = entry.find('=');
+                if (equal == std::string::npos) {
+                    throw std::runtime_error("Invalid noise entry (channel[:gate]=value): " + entry);
+                }
+                std::string channel = entry.substr(0, equal);
+                precision value = std::stod(entry.substr(equal + 1));
+                size_t colon = channel.find(':');
+                bool all_gates = colon == std::string::npos;
+                if (all_gates != (pass == 0))
+                    continue;
+                int first = 0, last = num_gate_types;
+                if (!all_gates) {
+                    first = (int)text_to_gate(channel.substr(colon + 1));
+                    last = first + 1;
+                    channel = channel.substr(0, colon);
+                }
+                if (value < 0 || value > 1 || (channel == "damping" && value >= 1)) {
+                    throw std::runtime_error("Invalid noise probability: " + entry);
+                }
+                if (channel == "readout") {
+                    if (!all_gates)
+                        throw std::runtime_error("The readout error does not depend on the gates: " + entry);
+                    model.readout = value;
+                }
+                else if (channel == "depolarizing" || channel == "damping") {
+                    precision* rates = channel == "depolarizing" ? model.depolarizing : model.damping;
+                    for (int t = first;t < last;t++)
+                        rates[t] = value;
+                }
+                else {
+                    throw std::runtime_error("Unknown noise channel: " + channel + " (depolarizing, damping or readout)");
+                }
+            }
+        }
+        return model;
+    }
+
+    std::string print() const {
+        std::string out = "Noise model:";
+        for (int t = 0;t < num_gate_types;t++) {
+            if (depolarizing[t] > 0 || damping[t] > 0)
+                out += fmt::format("\n  {:<6} depolarizing: {:.2e}, damping: {:.2e}", gate_to_text((GateType)t), depolarizing[t], damping[t]);
+        }
+        out += fmt::format("\n  readout: {:.2e}", readout);
+        return out;
+    }
+};
+
+/**
+ * Apply the no-jump Kraus operator of the amplitude damping,
+ * K0 = diag(1, sqrt(1 - gamma)), and return the probability of |1> before it
+ * (of the normalised state, in the same sweep)
+ */
+inline precision apply_damping(SchrodingerSimulator& simulator, int target, precision gamma) {
+    auto wave = simulator.wave;
+    int num_qubits = simulator.circuit.num_qubits;
+    size_t nblocks = 1ull << num_qubits - 1;
+    size_t offset = 1ull << ((num_qubits - 1) - target);
+    precision factor = Kokkos::sqrt(1 - gamma);
+
+    precision p1 = 0;
+    Kokkos::parallel_reduce("amplitude_damping", nblocks, KOKKOS_LAMBDA(size_t i, precision& local_p1) {
+        size_t idx = 2 * i - (i % offset) + offset;
+        cmplx a1 = wave(idx);
+        local_p1 += a1.real() * a1.real() + a1.imag() * a1.imag();
+        wave(idx) = a1 * factor;
+    }, p1);
+    return p1 / Kokkos::pow(2., simulator.sqrt_counter);
+}
+
+/** Turn K0 |psi> (see apply_damping) into the jump K1 |psi> = sqrt(gamma) |0><1| psi */
+inline void apply_jump(SchrodingerSimulator& simulator, int target, precision gamma) {
+    auto wave = simulator.wave;
+    int num_qubits = simulator.circuit.num_qubits;
+    size_t nblocks = 1ull << num_qubits - 1;
+    size_t offset = 1ull << ((num_qubits - 1) - target);
+    precision factor = Kokkos::sqrt(gamma / (1 - gamma));
+
+    Kokkos::parallel_for("amplitude_damping_jump", nblocks, KOKKOS_LAMBDA(size_t i) {
+        size_t block_idx = 2 * i - (i % offset);
+        wave(block_idx) = wave(block_idx + offset) * factor;
+        wave(block_idx + offset) = 0;
+    });
+}
+
+/**
+ * Monte-Carlo trajectories of a noisy circuit, sampled as one batch
+ *
+ * The depolarizing errors do not depend on the state: the errors of all the
+ * trajectories are drawn first. The amplitude damping jumps are drawn with
+ * the waiting-time method: the state evolves with the no-jump operator K0,
+ * whose squared norm is the probability of no jump so far, and jumps when
+ * the norm falls below a uniform threshold drawn per trajectory.
+ *
+ * Until its first error or jump, a trajectory is the noise-free prefix (the
+ * gates and K0), identical for all of them. A single prefix state advances
+ * through the circuit, and each trajectory is branched from it when it
+ * diverges (in the order of the circuit), then completed in the single work
+ * state, and sampled. The trajectories without any error or jump are
+ * sampled together from the final prefix. Two state vectors serve the whole
+ * batch, whatever the number of trajectories.
+ *
+ * The random numbers are counter-based (see counter_rng.h): a trajectory
+ * only depends on the seed and its index.
+ */
+struct TrajectorySimulator {
+    struct PauliError {
+        size_t gate;
+        int pauli; // 2 bits per qubit (target, then control): 1 X, 2 Y, 3 Z
+    };
+
+    struct Trajectory {
+        std::vector<PauliError> errors;
+        size_t first_error = SIZE_MAX;
+        precision threshold; // Waiting-time threshold of the first jump
+        size_t jumps = 0;
+    };
+
+    Circuit circuit;
+    NoiseModel noise;
+    uint64_t seed;
+    size_t num_trajectories;
+    size_t shots; // Samples per trajectory
+    SchrodingerSimulator prefix;
+    SchrodingerSimulator work;
+    Kokkos::View<precision*> cumulative;
+    Kokkos::View<size_t*> samples;
+    std::vector<Trajectory> trajectories;
+
+    size_t branched = 0;
+    size_t total_jumps = 0;
+    size_t applied_gates = 0;
+
+    TrajectorySimulator(const Circuit& circuit, const NoiseModel& noise, size_t num_trajectories, size_t shots, uint64_t seed)
+        : circuit(circuit), noise(noise), seed(seed), num_trajectories(num_trajectories), shots(shots),
+        prefix(circuit), work(circuit),
+        cumulative(Kokkos::view_alloc(Kokkos::WithoutInitializing, "cumulative"), 1ull << circuit.num_qubits),
+        samples("samples", num_trajectories * shots) {
+    }
+
+    /** The prefix and work states, the cumulative probabilities and the samples with their amplitudes */
+    static MemoryPlan memory_plan(int num_qubits, size_t num_samples) {
+        MemoryPlan plan;
+        plan.add("wave", wave_function_memory_size<precision>(num_qubits), 2);
+        plan.add("cumulative", sizeof(precision) << num_qubits);
+        plan.add("samples", sizeof(size_t) * num_samples);
+        plan.add("amplitudes", sizeof(cmplx) * num_samples);
+        return plan;
+    }
+
+    uint64_t stream(uint64_t id) const {
+        return counter_rand64(seed, id);
+    }
+
+    /** Threshold of the k-th jump of trajectory t */
+    precision jump_threshold(size_t t, size_t k) const {
+        return counter_drand(counter_rand64(stream(1), t), k);
+    }
+
+    /**
+     * Draw the depolarizing errors of every trajectory
+     *
+     * A uniform u < p selects an error, and u / p (uniform in [0, 1)) then
+     * selects the Pauli.
+     */
+    void draw_errors() {
+        trajectories.assign(num_trajectories, Trajectory());
+        size_t num_gates = circuit.gates.size();
+        uint64_t key = stream(0);
+        for (size_t t = 0;t < num_trajectories;t++) {
+            auto& trajectory = trajectories[t];
+            for (size_t g = 0;g < num_gates;g++) {
+                const auto& gate = circuit.gates[g];
+                precision p = noise.depolarizing[(int)gate.type];
+                if (p == 0)
+                    continue;
+                double u = counter_drand(key, t * num_gates + g);
+                if (u < p) {
+                    int num_paulis = gate.control == -1 ? 3 : 15;
+                    int pauli = 1 + MIN((int)(u / p * num_paulis), num_paulis - 1);
+                    trajectory.errors.push_back({ g, pauli });
+                }
+            }
+            if (!trajectory.errors.empty())
+                trajectory.first_error = trajectory.errors[0].gate;
+            trajectory.threshold = jump_threshold(t, 0);
+        }
+    }
+
+    static void apply_pauli(SchrodingerSimulator& simulator, int qubit, int pauli) {
+        static const GateType paulis[4] = { GateType::X, GateType::X, GateType::Y, GateType::Z };
+        if (pauli != 0) {
+            Gate gate;
+            gate.type = paulis[pauli];
+            gate.target = qubit;
+            gate.cycle = -1;
+            simulator.apply_gate(gate, false);
+        }
+    }
+
+    void apply_error(SchrodingerSimulator& simulator, const Gate& gate, int pauli) {
+        apply_pauli(simulator, gate.target, pauli & 3);
+        if (gate.control != -1)
+            apply_pauli(simulator, gate.control, pauli >> 2);
+    }
+
+    /**
+     * Complete a trajectory in the work state, from the given stage of the
+     * given gate (0: gate, 1: depolarizing error, 2 and 3: damping of the
+     * target and of the control)
+     */
+    void complete(size_t t, size_t g, int stage, precision norm, precision reference) {
+        auto& trajectory = trajectories[t];
+        size_t e = 0;
+        while (e < trajectory.errors.size() && (trajectory.errors[e].gate < g || (trajectory.errors[e].gate == g && stage > 1)))
+            e++;
+        precision threshold = jump_threshold(t, trajectory.jumps);
+        for (;g < circuit.gates.size();g++, stage = 0) {
+            const auto& gate = circuit.gates[g];
+            if (stage == 0) {
+                work.apply_gate(gate, false);
+                applied_gates++;
+            }
+            if (stage <= 1 && e < trajectory.errors.size() && trajectory.errors[e].gate == g) {
+                apply_error(work, gate, trajectory.errors[e++].pauli);
+            }
+            precision gamma = noise.damping[(int)gate.type];
+            if (gamma == 0)
+                continue;
+            for (int s = MAX(stage, 2);s <= 3;s++) {
+                int qubit = s == 2 ? gate.target : gate.control;
+                if (qubit == -1)
+                    continue;
+                precision p1 = apply_damping(work, qubit, gamma);
+                precision after = norm - gamma * p1;
+                if (after < threshold * reference) {
+                    apply_jump(work, qubit, gamma);
+                    norm = gamma * p1;
+                    reference = norm;
+                    trajectory.jumps++;
+                    threshold = jump_threshold(t, trajectory.jumps);
+                }
+                else {
+                    norm = after;
+                }
+            }
+        }
+        total_jumps += trajectory.jumps;
+    }
+
+    /** Cumulative probabilities of a state, returns the total */
+    precision accumulate_probabilities(const SchrodingerSimulator& state) {
+        auto wave = state.wave;
+        auto cum = cumulative;
+        precision scale = 1. / Kokkos::pow(2., state.sqrt_counter);
+        precision total = 0;
+        Kokkos::parallel_scan("cumulative_probabilities", state.N, KOKKOS_LAMBDA(size_t i, precision& update, const bool final) {
+            cmplx a = wave(i);
+            update += (a.real() * a.real() + a.imag() * a.imag()) * scale;
+            if (final)
+                cum(i) = update;
+        }, total);
+        return total;
+    }
+
+    /**
+     * Draw the samples [first, first + count) from the cumulative
+     * probabilities, with the readout errors
+     *
+     * The samples are found by bisection in the cumulative probabilities.
+     */
+    void draw_samples(precision total, size_t first, size_t count) {
+        auto cum = cumulative;
+        auto out = samples;
+        size_t N = cumulative.extent(0);
+        int num_qubits = circuit.num_qubits;
+        uint64_t key = stream(2);
+        uint64_t readout_key = stream(3);
+        precision readout = noise.readout;
+        Kokkos::parallel_for("sample_trajectory", count, KOKKOS_LAMBDA(size_t s) {
+            size_t shot = first + s;
+            precision u = counter_drand(key, shot) * total;
+            size_t low = 0, high = N - 1;
+            while (low < high) {
+                size_t mid = (low + high) / 2;
+                if (cum(mid) > u)
+                    high = mid;
+                else
+                    low = mid + 1;
+            }
+            for (int q = 0;q < num_qubits;q++) {
+                if (counter_drand(readout_key, shot * num_qubits + q) < readout)
+                    low ^= 1ull << (num_qubits - 1 - q);
+            }
+            out(shot) = low;
+        });
+    }
+
+    /**
+     * Branch trajectory t from the prefix and complete it from the given
+     * stage, after a jump on jump_qubit if given
+     */
+    void branch(size_t t, size_t g, int stage, precision norm, int jump_qubit = -1, precision gamma = 0) {
+        Kokkos::deep_copy(work.wave, prefix.wave);
+        work.sqrt_counter = prefix.sqrt_counter;
+        precision reference = 1;
+        if (jump_qubit != -1) {
+            apply_jump(work, jump_qubit, gamma);
+            trajectories[t].jumps = 1;
+            reference = norm;
+        }
+        complete(t, g, stage, norm, reference);
+        draw_samples(accumulate_probabilities(work), t * shots, shots);
+        branched++;
+    }
+
+    /**
+     * Run all the trajectories, and return their samples with the ideal
+     * amplitudes of the samples (for the XEB)
+     */
+    SampleVector run(bool verbose) {
+        Kokkos::Timer timer;
+        draw_errors();
+
+        // Divergence order: by first error, and by decreasing jump threshold
+        std::vector<size_t> by_error(num_trajectories);
+        std::vector<size_t> by_threshold(num_trajectories);
+        for (size_t t = 0;t < num_trajectories;t++)
+            by_error[t] = by_threshold[t] = t;
+        std::stable_sort(by_error.begin(), by_error.end(), [&](size_t a, size_t b) {
+            return trajectories[a].first_error < trajectories[b].first_error;
+        });
+        std::stable_sort(by_threshold.begin(), by_threshold.end(), [&](size_t a, size_t b) {
+            return trajectories[a].threshold > trajectories[b].threshold;
+        });
+        std::vector<bool> diverged(num_trajectories, false);
+        size_t next_error = 0;
+        size_t next_jump = 0;
+
+        prefix.initialise_state(true);
+        precision norm = 1;
+        for (size_t g = 0;g < circuit.gates.size();g++) {
+            const auto& gate = circuit.gates[g];
+            prefix.apply_gate(gate, verbose);
+            applied_gates++;
+
+            // Errors after this gate: the trajectory continues after the gate
+            for (;next_error < num_trajectories && trajectories[by_error[next_error]].first_error == g;next_error++) {
+                size_t t = by_error[next_error];
+                if (diverged[t])
+                    continue;
+                diverged[t] = true;
+                branch(t, g, 1, norm);
+            }
+
+            precision gamma = noise.damping[(int)gate.type];
+            if (gamma == 0)
+                continue;
+            for (int s = 2;s <= 3;s++) {
+                int qubit = s == 2 ? gate.target : gate.control;
+                if (qubit == -1)
+                    continue;
+                precision p1 = apply_damping(prefix, qubit, gamma);
+                precision after = norm - gamma * p1;
+                // Jumps here: the work state is the prefix after K0, turned into K1 by apply_jump
+                for (;next_jump < num_trajectories && trajectories[by_threshold[next_jump]].threshold > after;next_jump++) {
+                    size_t t = by_threshold[next_jump];
+                    if (diverged[t])
+                        continue;
+                    diverged[t] = true;
+                    if (s == 2 && gate.control != -1)
+                        branch(t, g, 3, gamma * p1, qubit, gamma);
+                    else
+                        branch(t, g + 1, 0, gamma * p1, qubit, gamma);
+                }
+                norm = after;
+            }
+        }
+
+        // The remaining trajectories are all the final prefix
+        size_t unchanged = 0;
+        precision total = accumulate_probabilities(prefix);
+        for (size_t t = 0;t < num_trajectories;t++) {
+            if (!diverged[t]) {
+                draw_samples(total, t * shots, shots);
+                unchanged++;
+            }
+        }
+
+        // Ideal amplitudes of the samples, the work state being free
+        work.initialise_state(true);
+        work.run(false);
+        auto wave = work.wave;
+        auto out = samples;
+        Kokkos::View<cmplx*> amplitudes("amplitudes", samples.extent(0));
+        Kokkos::parallel_for("read_amplitudes", samples.extent(0), KOKKOS_LAMBDA(size_t i) {
+            amplitudes(i) = wave(out(i));
+        });
+
+        size_t gates = circuit.gates.size();
+        fmt::println("Trajectories: {} ({} diverged from the noise-free prefix, {} without error, {} jumps), {} samples",
+            num_trajectories, branched, unchanged, total_jumps, samples.extent(0));
+        fmt::println("Gates applied: {} instead of {} ({:.1f}x fewer), total time: {}",
+            applied_gates, gates * num_trajectories, (double)gates * num_trajectories / MAX(applied_gates, (size_t)1), print_time(timer.seconds()));
+        return SampleVector{ circuit.num_qubits, samples, amplitudes };
+    }
+};
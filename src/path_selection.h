@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.h"
+#include "util/counter_rng.h"
+
+#include <stdexcept>
+
+/**
+ * Selection of the Feynman paths simulated by this process
+ *
+ * Path p is simulated if it is in [begin, end) and if it survives the
+ * fidelity selection. The selection draws from a counter-based generator
+ * keyed on (seed, p), such that shards of the same run (with the same seed)
+ * agree on which paths are discarded.
+ *
+ * Paths are numbered such that the i-th cross gate of the circuit (in gate
+ * order) is the i-th most significant bit of p, 0 meaning P0 on the control.
+ * A contiguous range of paths then corresponds to a subtree of the recursive
+ * simulation.
+ */
+struct PathSelection {
+    uint64_t seed = 0;
+    size_t begin = 0;
+    size_t end = 0;
+
+    PathSelection() = default;
+    PathSelection(size_t num_paths, uint64_t seed = 0) : seed(seed), begin(0), end(num_paths) {}
+
+    void set_range(size_t first, size_t last, size_t num_paths) {
+        if (first > last || last > num_paths) {
+            throw std::runtime_error("Invalid path range");
+        }
+        begin = first;
+        end = last;
+    }
+
+    /** Split the paths into num_shards contiguous ranges, and keep the shard_id-th one */
+    void set_shard(size_t shard_id, size_t num_shards, size_t num_paths) {
+        if (num_shards == 0 || shard_id >= num_shards) {
+            throw std::runtime_error("Invalid shard id");
+        }
+        size_t chunk = num_paths / num_shards;
+        size_t remainder = num_paths % num_shards;
+        size_t first = shard_id * chunk + MIN(shard_id, remainder);
+        set_range(first, first + chunk + (shard_id < remainder ? 1 : 0), num_paths);
+    }
+
+    size_t size() const {
+        return end - begin;
+    }
+
+    /** Does [first, last) intersect with the selected range */
+    bool overlaps(size_t first, size_t last) const {
+        return first < end && begin < last;
+    }
+
+    /** Number of selected paths in [first, last) */
+    size_t count(size_t first, size_t last) const {
+        return overlaps(first, last) ? MIN(last, end) - MAX(first, begin) : 0;
+    }
+
+    bool keep(size_t p, float fidelity) const {
+        return p >= begin && p < end && counter_drand(seed, p) <= fidelity;
+    }
+};
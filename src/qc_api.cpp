@@ -0,0 +1,235 @@
+#include "qc_api.h"
+
+#include "kokkos.h"
+#include "reader.h"
+#include "simulator.h"
+#include "feynman_simulator.h"
+
+#include <cstring>
+#include <sstream>
+
+struct qc_circuit {
+    Circuit circuit;
+};
+
+static_assert(sizeof(cmplx) == 2 * sizeof(double), "amplitudes must be interleaved doubles");
+static_assert(sizeof(size_t) == sizeof(uint64_t), "bitstrings must be 64 bits");
+
+namespace {
+thread_local std::string last_error;
+
+/** Run f, turning exceptions into an error code */
+template<typename F>
+int guarded(F f) {
+    try {
+        f();
+        return 0;
+    }
+    catch (const std::exception& e) {
+        last_error = e.what();
+        return 1;
+    }
+}
+
+/**
+ * Amplitudes written directly in the caller's buffer when possible,
+ * otherwise in a new View (to be copied back with copy_out)
+ */
+Kokkos::View<cmplx*> output_view(double* amplitudes, size_t n, const std::string& label) {
+    bool accessible = Kokkos::SpaceAccessibility<ExecSpace, Kokkos::HostSpace>::accessible;
+    if (accessible && reinterpret_cast<uintptr_t>(amplitudes) % alignof(cmplx) == 0) {
+        return Kokkos::View<cmplx*>(reinterpret_cast<cmplx*>(amplitudes), n);
+    }
+    return Kokkos::View<cmplx*>(label, n);
+}
+
+void copy_out(const Kokkos::View<cmplx*>& wave, double* amplitudes) {
+    Kokkos::fence();
+    if (reinterpret_cast<double*>(wave.data()) == amplitudes) {
+        return;
+    }
+    auto host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), wave);
+    std::memcpy(amplitudes, host.data(), host.extent(0) * sizeof(cmplx));
+}
+
+/** Throws for a null pointer argument */
+void check_pointer(const void* pointer, const char* name) {
+    if (pointer == nullptr) {
+        throw std::runtime_error(fmt::format("{} is null", name));
+    }
+}
+
+Kokkos::View<size_t*> device_bitstrings(const uint64_t* bitstrings, size_t n, int num_qubits) {
+    size_t N = 1ull << num_qubits;
+    for (size_t i = 0;i < n;i++) {
+        if (bitstrings[i] >= N) {
+            throw std::runtime_error(fmt::format("Bitstring {} does not fit in {} qubits", bitstrings[i], num_qubits));
+        }
+    }
+    Kokkos::View<size_t*> view("bitstrings", n);
+    Kokkos::View<const size_t*, Kokkos::HostSpace, Kokkos::MemoryTraits<Kokkos::Unmanaged>> host(reinterpret_cast<const size_t*>(bitstrings), n);
+    Kokkos::deep_copy(view, host);
+    return view;
+}
+
+/** Throws unless the qubits of the gate are within the circuit (and distinct for a 2-qubit gate) */
+void check_gate(const Gate& gate, int num_qubits) {
+    if (gate.target < 0 || gate.target >= num_qubits) {
+        throw std::runtime_error(fmt::format("Qubit {} out of range", gate.target));
+    }
+    if (gate.type == GateType::CX || gate.type == GateType::CZ) {
+        if (gate.control < 0 || gate.control >= num_qubits) {
+            throw std::runtime_error(fmt::format("Control qubit {} out of range", gate.control));
+        }
+        if (gate.control == gate.target) {
+            throw std::runtime_error(fmt::format("Control and target on the same qubit {}", gate.target));
+        }
+    }
+}
+
+/** Throws unless the circuit has a valid number of qubits (as in qc_circuit_create) and valid gates */
+void check_circuit(const Circuit& circuit) {
+    if (circuit.num_qubits <= 0 || circuit.num_qubits >= 64) {
+        throw std::runtime_error("Invalid number of qubits");
+    }
+    for (const auto& gate : circuit.gates) {
+        check_gate(gate, circuit.num_qubits);
+    }
+}
+
+/** Statevector of the circuit, in wave (of size 2^num_qubits) */
+void run_schrodinger(const Circuit& circuit, const Kokkos::View<cmplx*>& wave) {
+    SchrodingerSimulator simulator;
+    simulator.circuit = circuit;
+    simulator.N = 1ull << circuit.num_qubits;
+    simulator.wave = wave;
+    simulator.initialise_state(true);
+    simulator.run(false);
+}
+}
+
+extern "C" {
+
+int qc_initialize(void) {
+    return guarded([]() {
+        if (!Kokkos::is_initialized()) {
+            Kokkos::initialize();
+        }
+    });
+}
+
+void qc_finalize(void) {
+    if (Kokkos::is_initialized()) {
+        Kokkos::finalize();
+    }
+}
+
+const char* qc_last_error(void) {
+    return last_error.c_str();
+}
+
+qc_circuit* qc_circuit_create(int num_qubits) {
+    if (num_qubits <= 0 || num_qubits >= 64) {
+        last_error = "Invalid number of qubits";
+        return nullptr;
+    }
+    qc_circuit* circuit = new qc_circuit;
+    circuit->circuit.num_qubits = num_qubits;
+    circuit->circuit.depth = 0;
+    return circuit;
+}
+
+qc_circuit* qc_circuit_parse(const char* text) {
+    qc_circuit* circuit = nullptr;
+    guarded([&]() {
+        check_pointer(text, "text");
+        std::istringstream stream(text);
+        Circuit parsed = read_circuit(stream, true);
+        check_circuit(parsed);
+        circuit = new qc_circuit{ parsed };
+    });
+    return circuit;
+}
+
+int qc_circuit_add_gate(qc_circuit* circuit, int cycle, const char* gate, int target, int control) {
+    return guarded([&]() {
+        check_pointer(circuit, "circuit");
+        check_pointer(gate, "gate");
+        Gate new_gate;
+        new_gate.type = text_to_gate(gate);
+        new_gate.cycle = cycle;
+        new_gate.target = target;
+        if (new_gate.type == GateType::CX || new_gate.type == GateType::CZ) {
+            new_gate.control = control;
+        }
+        check_gate(new_gate, circuit->circuit.num_qubits);
+        if (cycle == 0) { // Initial Hadamard layer, see qc_circuit_create
+            return;
+        }
+        circuit->circuit.depth = cycle;
+        circuit->circuit.gates.push_back(new_gate);
+    });
+}
+
+int qc_circuit_num_qubits(const qc_circuit* circuit) {
+    return circuit->circuit.num_qubits;
+}
+
+size_t qc_circuit_num_gates(const qc_circuit* circuit) {
+    return circuit->circuit.gates.size();
+}
+
+void qc_circuit_free(qc_circuit* circuit) {
+    delete circuit;
+}
+
+int qc_schrodinger_statevector(const qc_circuit* circuit, double* amplitudes) {
+    return guarded([&]() {
+        check_pointer(circuit, "circuit");
+        check_pointer(amplitudes, "amplitudes");
+        auto wave = output_view(amplitudes, 1ull << circuit->circuit.num_qubits, "wave");
+        run_schrodinger(circuit->circuit, wave);
+        copy_out(wave, amplitudes);
+    });
+}
+
+int qc_schrodinger_amplitudes(const qc_circuit* circuit, const uint64_t* bitstrings, size_t num_bitstrings, double* amplitudes) {
+    return guarded([&]() {
+        check_pointer(circuit, "circuit");
+        check_pointer(amplitudes, "amplitudes");
+        if (num_bitstrings > 0) {
+            check_pointer(bitstrings, "bitstrings");
+        }
+        auto request = device_bitstrings(bitstrings, num_bitstrings, circuit->circuit.num_qubits);
+        Kokkos::View<cmplx*> wave("wave", 1ull << circuit->circuit.num_qubits);
+        run_schrodinger(circuit->circuit, wave);
+
+        auto out = output_view(amplitudes, num_bitstrings, "amplitudes");
+        Kokkos::parallel_for("read_amplitudes", num_bitstrings, KOKKOS_LAMBDA(size_t i) {
+            out(i) = wave(request(i));
+        });
+        copy_out(out, amplitudes);
+    });
+}
+
+int qc_feynman_amplitudes(const qc_circuit* circuit, int cut_at, size_t max_memory,
+    const uint64_t* bitstrings, size_t num_bitstrings, double* amplitudes) {
+    return guarded([&]() {
+        check_pointer(circuit, "circuit");
+        check_pointer(amplitudes, "amplitudes");
+        if (num_bitstrings > 0) {
+            check_pointer(bitstrings, "bitstrings");
+        }
+        // Both halves of the cut must hold at least one qubit
+        if (cut_at == 0 || cut_at >= circuit->circuit.num_qubits) {
+            throw std::runtime_error(fmt::format("Invalid cut {} for {} qubits (1 to {}, or -1 for automatic)",
+                cut_at, circuit->circuit.num_qubits, circuit->circuit.num_qubits - 1));
+        }
+        auto request = device_bitstrings(bitstrings, num_bitstrings, circuit->circuit.num_qubits);
+        FeynmanSimulator simulator(circuit->circuit, 1.0, max_memory, cut_at, num_bitstrings);
+        auto wave = simulator.run_flat(request, 1.0, false);
+        copy_out(wave, amplitudes);
+    });
+}
+
+}
@@ -0,0 +1,70 @@
+/**
+ * @file qc_api.h
+ *
+ * C interface of the simulator, for drivers that run many circuits in the
+ * same process (e.g. Python through ctypes or cffi).
+ *
+ * Kokkos is initialised once with qc_initialize(), circuits are built from
+ * memory, and the amplitudes are written into buffers provided by the
+ * caller: arrays of interleaved (real, imaginary) doubles. When the
+ * execution space can access host memory and the buffer is aligned to 16
+ * bytes, the Schrodinger simulator runs (or gathers) directly in the
+ * caller's buffer, without any copy.
+ *
+ * Bitstrings are integers where qubit 0 is the most significant bit, as in
+ * the output files of qc-simulator.
+ *
+ * Every function returning an int returns 0 on success. On failure, the
+ * reason is given by qc_last_error().
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct qc_circuit qc_circuit;
+
+int qc_initialize(void);
+void qc_finalize(void);
+const char* qc_last_error(void);
+
+/**
+ * Circuits
+ *
+ * As in circuit files, the gates of cycle 0 (the initial Hadamard layer) are
+ * skipped: the simulations start from the uniform superposition.
+ */
+qc_circuit* qc_circuit_create(int num_qubits);
+/** Circuit in the text format of the circuit files */
+qc_circuit* qc_circuit_parse(const char* text);
+/** Gate name as in circuit files (h, t, x_1_2, cz, ...), control is ignored for 1-qubit gates */
+int qc_circuit_add_gate(qc_circuit* circuit, int cycle, const char* gate, int target, int control);
+int qc_circuit_num_qubits(const qc_circuit* circuit);
+size_t qc_circuit_num_gates(const qc_circuit* circuit);
+void qc_circuit_free(qc_circuit* circuit);
+
+/** Full statevector, amplitudes holds 2 * 2^num_qubits doubles */
+int qc_schrodinger_statevector(const qc_circuit* circuit, double* amplitudes);
+
+/** Amplitudes of num_bitstrings bitstrings, amplitudes holds 2 * num_bitstrings doubles */
+int qc_schrodinger_amplitudes(const qc_circuit* circuit, const uint64_t* bitstrings, size_t num_bitstrings, double* amplitudes);
+
+/**
+ * Amplitudes computed by the Feynman simulator (two-way cut)
+ *
+ * cut_at is the number of qubits of the first half (1 to num_qubits - 1),
+ * cut_at < 0 chooses the cut automatically within max_memory (in bytes, 0
+ * for no limit). The run fails before allocating anything if its planned peak
+ * memory exceeds max_memory. With num_bitstrings = 0, the full statevector is
+ * computed.
+ */
+int qc_feynman_amplitudes(const qc_circuit* circuit, int cut_at, size_t max_memory,
+    const uint64_t* bitstrings, size_t num_bitstrings, double* amplitudes);
+
+#ifdef __cplusplus
+}
+#endif
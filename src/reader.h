@@ -6,13 +6,8 @@
 
 #include <fstream>
 
-Circuit read_circuit(const std::string& filename, bool verbose = true, bool skip_hadamard = true) {
-    std::ifstream file(filename);
-    fmt::println("Reading circuit from file: {}", filename);
-    if (!file.is_open()) {
-        throw std::runtime_error("Could not open file: " + filename);
-    }
-
+/** Read a circuit in the GRCS format (number of qubits, then one gate per line) */
+Circuit read_circuit(std::istream& file, bool skip_hadamard = true) {
     Circuit circuit;
     file >> circuit.num_qubits;
     while (!file.eof()) {
@@ -39,4 +34,13 @@ Circuit read_circuit(const std::string& filename, bool verbose = true, bool skip
     }
     circuit.depth--; // Last step is Hadamard, that is not counted towards depth
     return circuit;
-}
\ No newline at end of file
+}
+
+Circuit read_circuit(const std::string& filename, bool verbose = true, bool skip_hadamard = true) {
+    std::ifstream file(filename);
+    fmt::println("Reading circuit from file: {}", filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open file: " + filename);
+    }
+    return read_circuit(file, skip_hadamard);
+}
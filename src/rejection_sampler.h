@@ -0,0 +1,201 @@
+#pragma once
+
+#include "simulator.h"
+#include "util/counter_rng.h"
+#include "util/permutation.h"
+
+#include <functional>
+
+/**
+ * Frugal rejection sampling, from Google's article arXiv:1807.10749v3
+ *
+ * Candidates are drawn uniformly among the bitstrings that were not drawn
+ * yet, their amplitudes are computed by the engine and each candidate is
+ * accepted with probability min(1, |psi|^2 N / M).
+ *
+ * The engine is any function computing the amplitudes of a list of
+ * bitstrings, such that the same sampler works with every simulator.
+ *
+ * The number of candidates of a round is predicted from the acceptance rate
+ * observed so far, such that the last rounds do not pay for a full batch.
+ * The candidate buffer is kept across rounds.
+ */
+struct RejectionSampler {
+    using Engine = std::function<Kokkos::View<cmplx*>(const Kokkos::View<size_t*>&)>;
+
+    int num_qubits;
+    size_t N;
+    size_t nbitstrings;
+    double epsilon;
+    int M;
+    uint64_t seed;
+
+    KeyedPermutation permutation;
+    Kokkos::View<size_t*> candidates;
+    Kokkos::View<int*> flags;
+    Kokkos::View<size_t*> positions;
+    Kokkos::View<size_t*> accepted_bitstrings;
+    Kokkos::View<cmplx*> accepted_amplitude;
+
+    size_t total_candidates = 0;
+    size_t total_accepted = 0;
+    size_t num_rounds = 0;
+    size_t max_batch = SIZE_MAX; // Largest round that fits into the memory budget
+
+    RejectionSampler(int num_qubits, size_t nbitstrings, double epsilon, uint64_t seed)
+        : num_qubits(num_qubits), N(1ull << num_qubits), nbitstrings(nbitstrings), epsilon(epsilon), seed(seed),
+        permutation(seed, num_qubits),
+        accepted_bitstrings("accepted_bitstrings", nbitstrings),
+        accepted_amplitude("accepted_amplitude", nbitstrings) {
+        /**
+         * Find M' such that 2exp(-M'/(1-exp(-M'))) < epsilon
+         */
+        M = 1;
+        while (2 * std::exp(-M / (1 - std::exp(-M))) >= epsilon) {
+            M++;
+        }
+    }
+
+    /** Is the space of bitstrings large enough for the first round */
+    bool feasible() const {
+        return nbitstrings * M < N;
+    }
+
+    /**
+     * Number of candidates needed to accept the remaining bitstrings
+     *
+     * Before any observation, the acceptance rate of a Porter-Thomas
+     * distribution is used: E[min(1, x / M)] = (1 - exp(-M)) / M. A margin of
+     * three standard deviations is added such that most of the time the
+     * round is the last one.
+     */
+    size_t predict_batch_size(size_t remaining) const {
+        double rate = (1 - std::exp(-M)) / M;
+        if (total_candidates > 0 && total_accepted > 0) {
+            rate = (double)total_accepted / total_candidates;
+        }
+        double expected = remaining / rate;
+        size_t batch = (size_t)std::ceil(expected + 3 * std::sqrt(expected)) + 1;
+        return MIN(MIN(batch, N - total_candidates), max_batch);
+    }
+
+    /**
+     * Memory of the sampler for a round of batch candidates, on top of the
+     * engine (which holds the candidates and their amplitudes)
+     */
+    MemoryPlan memory_plan(size_t batch) const {
+        MemoryPlan plan;
+        plan.add("accepted_bitstrings", sizeof(size_t) * nbitstrings);
+        plan.add("accepted_amplitude", sizeof(cmplx) * nbitstrings);
+        plan.add("accept_flags", sizeof(int) * batch);
+        plan.add("accept_positions", sizeof(size_t) * batch);
+        return plan;
+    }
+
+    /**
+     * Draw the next distinct candidates
+     *
+     * The candidates are the next indices of a keyed permutation of the
+     * bitstrings: they are distinct from each other and from the candidates
+     * of the previous rounds, without any bookkeeping.
+     */
+    Kokkos::View<size_t*> generate_candidates(size_t batch) {
+        if (candidates.extent(0) < batch) {
+            candidates = Kokkos::View<size_t*>("candidates", batch);
+        }
+
+        auto bitstrings = Kokkos::subview(candidates, std::make_pair((size_t)0, batch));
+        auto perm = permutation;
+        size_t first = total_candidates;
+        Kokkos::parallel_for("generate_bitstrings", batch, KOKKOS_LAMBDA(size_t i) {
+            bitstrings(i) = perm(first + i);
+        });
+        return bitstrings;
+    }
+
+    /**
+     * Accept or reject the candidates, returns the number of accepted bitstrings
+     *
+     * The decision on a candidate only depends on the seed and on the index of
+     * the candidate in the run. The accepted candidates are then compacted by
+     * an exclusive scan, in the order of the candidates, and trimmed to the
+     * remaining quota. For a given seed, the sample is the same whatever the
+     * number of threads.
+     */
+    size_t accept_reject(const Kokkos::View<size_t*>& bitstrings, const Kokkos::View<cmplx*>& wave, size_t remaining) {
+        size_t n = bitstrings.extent(0);
+        if (flags.extent(0) < n) {
+            flags = Kokkos::View<int*>("accept_flags", n);
+            positions = Kokkos::View<size_t*>("accept_positions", n);
+        }
+        auto flag = flags;
+        auto position = positions;
+        auto out_bitstrings = accepted_bitstrings;
+        auto out_amplitude = accepted_amplitude;
+        uint64_t key = counter_rand64(seed, 0);
+        size_t first = total_candidates;
+        size_t offset = total_accepted;
+        precision scale = (precision)N / M;
+
+        // Accept bitstrings with probability min(1, |psi|^2 N / M)
+        Kokkos::parallel_for("accept_flags", n, KOKKOS_LAMBDA(size_t i) {
+            cmplx amplitude = wave(i);
+            precision probability = Kokkos::abs(amplitude * amplitude);
+            precision accept_probability = Kokkos::min((precision)1., probability * scale);
+            flag(i) = counter_drand(key, first + i) < accept_probability;
+        });
+
+        size_t num_accepted = 0;
+        Kokkos::parallel_scan("accept_scan", n, KOKKOS_LAMBDA(size_t i, size_t& update, const bool final) {
+            if (final)
+                position(i) = update;
+            update += flag(i);
+        }, num_accepted);
+
+        Kokkos::parallel_for("accept_scatter", n, KOKKOS_LAMBDA(size_t i) {
+            if (flag(i) && position(i) < remaining) {
+                size_t idx = offset + position(i);
+                out_amplitude(idx) = wave(i);
+                out_bitstrings(idx) = bitstrings(i);
+            }
+        });
+        return MIN(num_accepted, remaining);
+    }
+
+    SampleVector sample(const Engine& engine) {
+        fmt::println("For {} bitstrings and epsilon {:.1e}, we have M': {}", nbitstrings, epsilon, M);
+        fmt::println("Seed: {}", seed);
+
+        Kokkos::Timer timer;
+        while (total_accepted < nbitstrings) {
+            if (total_candidates == N) {
+                fmt::println("{}", warning(fmt::format("all the bitstrings were drawn, only {} samples were accepted", total_accepted)));
+                break;
+            }
+            size_t remaining = nbitstrings - total_accepted;
+            size_t batch = predict_batch_size(remaining);
+
+            auto bitstrings = generate_candidates(batch);
+
+            // Running the actual simulation
+            Kokkos::View<cmplx*> wave = engine(bitstrings);
+
+            size_t accepted = accept_reject(bitstrings, wave, remaining);
+            total_candidates += batch;
+            total_accepted += accepted;
+            num_rounds++;
+            fmt::println("Round {}: {} candidates, accepted: {} / {}", num_rounds, batch, total_accepted, nbitstrings);
+        }
+
+        fmt::println("Total time: {}", print_time(timer.seconds()));
+        fmt::println("Total accepted: {} ({} candidates in {} rounds)", total_accepted, total_candidates, num_rounds);
+
+        // Extract
+        Kokkos::View<cmplx*> amplitudes("amplitudes", total_accepted);
+        Kokkos::View<size_t*> bitstrings("bitstrings", total_accepted);
+        Kokkos::deep_copy(amplitudes, Kokkos::subview(accepted_amplitude, std::make_pair((size_t)0, total_accepted)));
+        Kokkos::deep_copy(bitstrings, Kokkos::subview(accepted_bitstrings, std::make_pair((size_t)0, total_accepted)));
+
+        return SampleVector{ num_qubits, bitstrings, amplitudes };
+    }
+};
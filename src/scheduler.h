@@ -0,0 +1,213 @@
+#pragma once
+
+#include "circuit_optimizer.h"
+#include "simulator.h"
+
+#include <algorithm>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/**
+ * Execution order of the gates of a circuit
+ *
+ * A gate depends on the earlier gates that it does not commute with (see
+ * commutes): on each of its qubits, on the last run of gates of another
+ * basis. Any topological order of these dependencies is the same circuit,
+ * and the scheduler picks, among the gates whose dependencies are
+ * scheduled, the one that best continues the current run:
+ *  - a diagonal gate after diagonal gates, such that the diagonal gates of
+ *    several cycles are applied together (one sweep, see
+ *    SchrodingerSimulator::apply_diagonal_run)
+ *  - a non-diagonal gate whose qubits stay within the schedule_run_qubits
+ *    qubits of the current run, the same target first (same stride, and the
+ *    candidates for the fusion of gates), the diagonal gates being left for
+ *    the next diagonal run
+ *  - otherwise the earliest cycle, then the order of the file. A new run
+ *    starts with a diagonal gate if there is one.
+ *
+ * The schedule also splits the new order into runs: consecutive diagonal
+ * gates, or consecutive non-diagonal gates on at most schedule_run_qubits
+ * qubits.
+ */
+constexpr int schedule_run_qubits = 2;
+
+struct Schedule {
+    struct Run {
+        size_t begin;
+        size_t end;
+        bool diagonal;
+    };
+
+    std::vector<size_t> order; // Index in the circuit of each scheduled gate
+    std::vector<Run> runs;     // Runs of the scheduled order
+
+    /** The consecutive diagonal gates [begin, end) of the scheduled order, of at least min_length gates */
+    std::vector<std::pair<size_t, size_t>> diagonal_runs(size_t min_length = 2) const {
+        std::vector<std::pair<size_t, size_t>> out;
+        for (const auto& run : runs) {
+            if (run.diagonal && run.end - run.begin >= min_length)
+                out.push_back({ run.begin, run.end });
+        }
+        return out;
+    }
+};
+
+/** Split the gates into runs of consecutive diagonal gates, or of non-diagonal gates on at most schedule_run_qubits qubits */
+inline std::vector<Schedule::Run> split_runs(const std::vector<Gate>& gates) {
+    std::vector<Schedule::Run> runs;
+    size_t i = 0;
+    while (i < gates.size()) {
+        Schedule::Run run{ i, i + 1, is_diagonal_unitary(gates[i]) };
+        std::vector<int> qubits;
+        auto add_qubits = [&](const Gate& gate) {
+            std::vector<int> merged = qubits;
+            for (int q : { gate.target, gate.control }) {
+                if (q != -1 && std::find(merged.begin(), merged.end(), q) == merged.end())
+                    merged.push_back(q);
+            }
+            if (merged.size() > schedule_run_qubits)
+                return false;
+            qubits = merged;
+            return true;
+        };
+        add_qubits(gates[i]);
+        while (run.end < gates.size()) {
+            const Gate& gate = gates[run.end];
+            if (run.diagonal ? !is_diagonal_unitary(gate) : is_diagonal_unitary(gate) || !add_qubits(gate))
+                break;
+            run.end++;
+        }
+        runs.push_back(run);
+        i = run.end;
+    }
+    return runs;
+}
+
+inline Schedule schedule_gates(const Circuit& circuit) {
+    size_t num_gates = circuit.gates.size();
+    const auto& gates = circuit.gates;
+
+    // Dependencies: on each qubit, the runs of gates of the same basis commute
+    std::vector<std::vector<size_t>> successors(num_gates);
+    std::vector<size_t> num_dependencies(num_gates, 0);
+    std::vector<QubitAction> run_action(circuit.num_qubits, QubitAction::None);
+    std::vector<std::vector<size_t>> current_run(circuit.num_qubits);
+    std::vector<std::vector<size_t>> previous_run(circuit.num_qubits);
+    for (size_t i = 0;i < num_gates;i++) {
+        std::vector<size_t> dependencies;
+        for (int q : { gates[i].target, gates[i].control }) {
+            if (q == -1)
+                continue;
+            QubitAction action = action_on(gates[i], q);
+            if (action == run_action[q] && action != QubitAction::Other) {
+                dependencies.insert(dependencies.end(), previous_run[q].begin(), previous_run[q].end());
+                current_run[q].push_back(i);
+            }
+            else {
+                dependencies.insert(dependencies.end(), current_run[q].begin(), current_run[q].end());
+                previous_run[q] = current_run[q];
+                current_run[q] = { i };
+                run_action[q] = action;
+            }
+        }
+        std::sort(dependencies.begin(), dependencies.end());
+        dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+        for (size_t j : dependencies) {
+            successors[j].push_back(i);
+        }
+        num_dependencies[i] = dependencies.size();
+    }
+
+    std::vector<size_t> ready;
+    for (size_t i = 0;i < num_gates;i++) {
+        if (num_dependencies[i] == 0)
+            ready.push_back(i);
+    }
+
+    Schedule schedule;
+    std::vector<int> run_qubits;
+    bool run_diagonal = false;
+    int last_target = -1;
+    auto within_run = [&](const Gate& gate) {
+        size_t count = run_qubits.size();
+        for (int q : { gate.target, gate.control }) {
+            if (q != -1 && std::find(run_qubits.begin(), run_qubits.end(), q) == run_qubits.end())
+                count++;
+        }
+        return count <= schedule_run_qubits;
+    };
+    while (!ready.empty()) {
+        // Lowest (continues the run, same target, cycle, index)
+        size_t best = 0;
+        auto key = [&](size_t r) {
+            const Gate& gate = gates[ready[r]];
+            bool diagonal = is_diagonal_unitary(gate);
+            bool continues = run_diagonal ? diagonal : !diagonal && within_run(gate);
+            // The diagonal gates wait for the others, and then run together
+            int rank = continues ? 0 : (diagonal ? 2 : 1);
+            return std::make_tuple(rank, gate.target != last_target, gate.cycle, ready[r]);
+        };
+        for (size_t r = 1;r < ready.size();r++) {
+            if (key(r) < key(best))
+                best = r;
+        }
+        size_t i = ready[best];
+        ready.erase(ready.begin() + best);
+        const Gate& gate = gates[i];
+
+        bool diagonal = is_diagonal_unitary(gate);
+        bool continues = !schedule.order.empty() && (run_diagonal ? diagonal : !diagonal && within_run(gate));
+        if (!continues) {
+            run_qubits.clear();
+            run_diagonal = diagonal;
+        }
+        for (int q : { gate.target, gate.control }) {
+            if (q != -1 && std::find(run_qubits.begin(), run_qubits.end(), q) == run_qubits.end())
+                run_qubits.push_back(q);
+        }
+        last_target = gate.target;
+        schedule.order.push_back(i);
+
+        for (size_t s : successors[i]) {
+            if (--num_dependencies[s] == 0)
+                ready.push_back(s);
+        }
+    }
+
+    std::vector<Gate> scheduled;
+    for (size_t i : schedule.order) {
+        scheduled.push_back(gates[i]);
+    }
+    schedule.runs = split_runs(scheduled);
+    return schedule;
+}
+
+/** The circuit with its gates in the order of the schedule */
+inline Circuit apply_schedule(const Circuit& circuit, const Schedule& schedule) {
+    Circuit scheduled = circuit;
+    scheduled.gates.clear();
+    for (size_t i : schedule.order) {
+        scheduled.gates.push_back(circuit.gates[i]);
+    }
+    return scheduled;
+}
+
+inline std::string print_runs(const std::vector<Schedule::Run>& runs) {
+    size_t gates = 0, diagonal_runs = 0, diagonal_gates = 0;
+    for (const auto& run : runs) {
+        gates += run.end - run.begin;
+        if (run.diagonal) {
+            diagonal_runs++;
+            diagonal_gates += run.end - run.begin;
+        }
+    }
+    return fmt::format("{} runs ({:.2f} gates per run), {} diagonal runs ({:.2f} gates per run)",
+        runs.size(), runs.empty() ? 0. : (double)gates / runs.size(),
+        diagonal_runs, diagonal_runs ? (double)diagonal_gates / diagonal_runs : 0.);
+}
+
+inline std::string print_schedule(const Circuit& circuit, const Schedule& schedule) {
+    return fmt::format("Schedule of {} gates:\n  file order: {}\n  scheduled:  {}", circuit.gates.size(),
+        print_runs(split_runs(circuit.gates)), print_runs(schedule.runs));
+}
@@ -2,7 +2,12 @@
 #include "complex.h"
 #include "io/output/output.h"
 #include "gates.h"
+#include "memory.h"
+#include "state_allocator.h"
+#include "trace.h"
 
+#include <memory>
+#include <ostream>
 #include <vector>
 
 template<typename T>
@@ -27,14 +32,52 @@ struct SampleVector {
     Kokkos::View<cmplx*> wave;
 };
 
-std::string print_statevector(const StateVector& vector, int first_N = -1) {
+/**
+ * Host copies of the results, to be formatted without any Kokkos call (e.g.
+ * by the background thread of the output writer). On the host backends the
+ * mirrors are the Views themselves, and nothing is copied.
+ */
+struct HostStateVector {
+    int num_qubits;
+    Kokkos::View<cmplx*, Kokkos::HostSpace> wave;
+};
+
+struct HostSampleVector {
+    int num_qubits;
+    Kokkos::View<size_t*, Kokkos::HostSpace> bitstrings;
+    Kokkos::View<cmplx*, Kokkos::HostSpace> wave;
+};
+
+struct HostProbabilities {
+    int num_qubits;
+    Kokkos::View<precision*, Kokkos::HostSpace> probs;
+};
+
+HostStateVector to_host(const StateVector& vector) {
     Kokkos::fence();
+    return { vector.num_qubits, Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), vector.wave) };
+}
+
+HostSampleVector to_host(const SampleVector& vector) {
+    Kokkos::fence();
+    return { vector.num_qubits, Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), vector.bitstrings),
+        Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), vector.wave) };
+}
+
+HostProbabilities probabilities_to_host(const StateVector& vector) {
+    Kokkos::fence();
+    Kokkos::View<precision*> probs("probs", vector.wave.extent(0));
+    auto wave = vector.wave;
+    Kokkos::parallel_for("probabilities", wave.extent(0), KOKKOS_LAMBDA(size_t idx) {
+        probs(idx) = Kokkos::abs(wave(idx) * wave(idx));
+    });
+    return { vector.num_qubits, Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), probs) };
+}
+
+std::string print_statevector(const HostStateVector& vector, int first_N = -1) {
     std::string out;
-    Kokkos::View<cmplx*, Kokkos::HostSpace> wave_host = Kokkos::create_mirror_view(vector.wave);
-    size_t N = vector.wave.extent(0);
-    Kokkos::deep_copy(wave_host, vector.wave);
-    for (size_t i = 0; i < N; ++i) {
-        out += fmt::format("{:0{}b}: {}\n", i, vector.num_qubits, wave_host(i));
+    for (size_t i = 0; i < vector.wave.extent(0); ++i) {
+        out += fmt::format("{:0{}b}: {}\n", i, vector.num_qubits, vector.wave(i));
         if (first_N > 0 && i >= first_N) {
             out += fmt::format("...\n");
             break;
@@ -43,16 +86,14 @@ std::string print_statevector(const StateVector& vector, int first_N = -1) {
     return out;
 }
 
-std::string print_samplevector(const SampleVector& vector, int first_N = -1) {
-    Kokkos::fence();
+std::string print_statevector(const StateVector& vector, int first_N = -1) {
+    return print_statevector(to_host(vector), first_N);
+}
+
+std::string print_samplevector(const HostSampleVector& vector, int first_N = -1) {
     std::string out;
-    Kokkos::View<cmplx*, Kokkos::HostSpace> wave_host = Kokkos::create_mirror_view(vector.wave);
-    Kokkos::View<size_t*, Kokkos::HostSpace> bitstring_host = Kokkos::create_mirror_view(vector.bitstrings);
-    size_t N = vector.wave.extent(0);
-    Kokkos::deep_copy(wave_host, vector.wave);
-    Kokkos::deep_copy(bitstring_host, vector.bitstrings);
-    for (size_t i = 0; i < N; ++i) {
-        out += fmt::format("{:0{}b}: {}\n", bitstring_host(i), vector.num_qubits, wave_host(i));
+    for (size_t i = 0; i < vector.wave.extent(0); ++i) {
+        out += fmt::format("{:0{}b}: {}\n", vector.bitstrings(i), vector.num_qubits, vector.wave(i));
         if (first_N > 0 && i >= first_N) {
             out += fmt::format("...\n");
             break;
@@ -61,18 +102,25 @@ std::string print_samplevector(const SampleVector& vector, int first_N = -1) {
     return out;
 }
 
-std::string print_probabilities(const StateVector& vector, int first_N = -1) {
-    Kokkos::fence();
+std::string print_samplevector(const SampleVector& vector, int first_N = -1) {
+    return print_samplevector(to_host(vector), first_N);
+}
+
+/** Write the samples line by line, without building the whole text in memory */
+void write_samplevector(std::ostream& out, const HostSampleVector& vector) {
+    for (size_t i = 0; i < vector.wave.extent(0); ++i) {
+        out << fmt::format("{:0{}b}: {}\n", vector.bitstrings(i), vector.num_qubits, vector.wave(i));
+    }
+}
+
+void write_samplevector(std::ostream& out, const SampleVector& vector) {
+    write_samplevector(out, to_host(vector));
+}
+
+std::string print_probabilities(const HostProbabilities& vector, int first_N = -1) {
     std::string out;
-    Kokkos::View<precision*> probs("probs", vector.wave.extent(0));
-    Kokkos::parallel_for(vector.wave.extent(0), KOKKOS_LAMBDA(size_t idx) {
-        probs(idx) = Kokkos::abs(vector.wave(idx) * vector.wave(idx));
-    });
-    Kokkos::View<precision*, Kokkos::HostSpace> probs_host = Kokkos::create_mirror_view(probs);
-    size_t N = vector.wave.extent(0);
-    Kokkos::deep_copy(probs_host, probs);
-    for (size_t i = 0; i < N; ++i) {
-        out += fmt::format("{:0{}b}: {}\n", i, vector.num_qubits, probs(i));
+    for (size_t i = 0; i < vector.probs.extent(0); ++i) {
+        out += fmt::format("{:0{}b}: {}\n", i, vector.num_qubits, vector.probs(i));
         if (first_N > 0 && i >= first_N) {
             out += fmt::format("...\n");
             break;
@@ -81,11 +129,16 @@ std::string print_probabilities(const StateVector& vector, int first_N = -1) {
     return out;
 }
 
+std::string print_probabilities(const StateVector& vector, int first_N = -1) {
+    return print_probabilities(probabilities_to_host(vector), first_N);
+}
+
 struct SchrodingerSimulator {
     Kokkos::View<cmplx*> wave;
     size_t sqrt_counter = 0;
     size_t N;
     Circuit circuit;
+    std::vector<std::pair<size_t, size_t>> diagonal_runs; // Gates [begin, end) applied in one sweep when it saves bytes (see fuses)
 
     /**
      * Apply a 1-qubit gate to the wavefunction
@@ -164,7 +217,7 @@ struct SchrodingerSimulator {
         size_t nblocks = 1ull << num_qubits - 1;             \
         size_t offset = 1ull << ((num_qubits - 1) - target); \
         sqrt_counter += sqrt_add;                            \
-        Kokkos::parallel_for(nblocks, KOKKOS_CLASS_LAMBDA(size_t i) { \
+        Kokkos::parallel_for("apply_1Q_gate_" #gate_func, nblocks, KOKKOS_CLASS_LAMBDA(size_t i) { \
             size_t block_idx = 2 * i - (i % offset);                  \
             size_t idx[2] = { block_idx, block_idx + offset };        \
             cmplx new_w[2];                                           \
@@ -181,13 +234,35 @@ struct SchrodingerSimulator {
         size_t offset = 1ull << ((num_qubits - 1) - target); // 2^(num_qubits - 1 - target)
 
         cmplx j = cmplx(0, 1);
-        Kokkos::parallel_for(nblocks, KOKKOS_CLASS_LAMBDA(size_t i) {
+        Kokkos::parallel_for("apply_T_gate", nblocks, KOKKOS_CLASS_LAMBDA(size_t i) {
             size_t block_idx = 2 * i - (i % offset);
             size_t idx[2] = { block_idx, block_idx + offset };
             wave(idx[1]) = wave(idx[1]) * (1 + j) / Kokkos::sqrt(2);
         });
     }
 
+    /**
+     * Project the target qubit on |value> (P0 or P1), and return the squared
+     * norm of the projected state in the same sweep
+     *
+     * The norm is the one of the normalised state (sqrt_counter accounted).
+     */
+    precision apply_projection(int target, int value) {
+        int num_qubits = circuit.num_qubits;
+        size_t nblocks = 1ull << num_qubits - 1;
+        size_t offset = 1ull << ((num_qubits - 1) - target);
+
+        precision norm = 0;
+        Kokkos::parallel_reduce("projection", nblocks, KOKKOS_CLASS_LAMBDA(size_t i, precision& local_norm) {
+            size_t block_idx = 2 * i - (i % offset);
+            size_t idx[2] = { block_idx, block_idx + offset };
+            cmplx kept = wave(idx[value]);
+            wave(idx[1 - value]) = 0;
+            local_norm += kept.real() * kept.real() + kept.imag() * kept.imag();
+        }, norm);
+        return norm / Kokkos::pow(2., sqrt_counter);
+    }
+
     void apply_CZ_gate(int ctrl, int target) {
         int num_qubits = circuit.num_qubits;
         size_t nthreads = 1ull << (num_qubits - 2);
@@ -205,7 +280,7 @@ struct SchrodingerSimulator {
         size_t right_mask = (1ull << right) - 1;
         size_t middle_mask = (1ull << gap_size) - 1;
 
-        Kokkos::parallel_for(nthreads, KOKKOS_CLASS_LAMBDA(size_t i) {
+        Kokkos::parallel_for("apply_CZ_gate", nthreads, KOKKOS_CLASS_LAMBDA(size_t i) {
             size_t right_bits = i & right_mask;
 
             // Discard the rightmost bit
@@ -243,15 +318,22 @@ struct SchrodingerSimulator {
     }
 
     SchrodingerSimulator(const Circuit& circuit) : circuit(circuit),
-        wave("wave", 1 << circuit.num_qubits),
-        N(1 << circuit.num_qubits) {
+        wave(allocate_state("wave", 1ull << circuit.num_qubits)),
+        N(1ull << circuit.num_qubits) {
     }
 
     SchrodingerSimulator() = default;
 
+    /** Memory of the statevector, the only large allocation of a run */
+    static MemoryPlan memory_plan(int num_qubits) {
+        MemoryPlan plan;
+        plan.add("wave", wave_function_memory_size<precision>(num_qubits));
+        return plan;
+    }
+
     SchrodingerSimulator copy() {
         SchrodingerSimulator copy(*this);
-        copy.wave = Kokkos::View<cmplx*>("wave", N);
+        copy.wave = allocate_state("wave", N);
         Kokkos::deep_copy(copy.wave, wave);
         return copy;
     }
@@ -259,17 +341,37 @@ struct SchrodingerSimulator {
     void initialise_state(bool hadamard = false) {
         if (hadamard) {
             precision factor = 1. / Kokkos::pow(Kokkos::sqrt(2), circuit.num_qubits);
-            Kokkos::parallel_for(N, KOKKOS_CLASS_LAMBDA(size_t idx) { wave(idx) = 1.; });
+            Kokkos::parallel_for("initialise_state", N, KOKKOS_CLASS_LAMBDA(size_t idx) { wave(idx) = 1.; });
             sqrt_counter = circuit.num_qubits;
         }
         else {
             // In case we are on GPU, we need to use parallel_for to access memory
-            Kokkos::parallel_for(1, KOKKOS_CLASS_LAMBDA(size_t) { wave(0) = 1.; });
+            Kokkos::parallel_for("initialise_state", 1, KOKKOS_CLASS_LAMBDA(size_t) { wave(0) = 1.; });
+        }
+    }
+
+    /**
+     * Bytes a gate reads and writes: every amplitude it updates is read and
+     * written once (the minimal traffic, to compare with the peak bandwidth)
+     */
+    double gate_bytes(GateType type) const {
+        double amplitude_bytes = sizeof(cmplx) * (double)(1ull << circuit.num_qubits);
+        switch (type) {
+        case GateType::T: // Only the amplitudes where the target is 1
+        case GateType::CX: // Swaps the amplitudes where the control is 1
+            return amplitude_bytes;
+        case GateType::CZ: // Only the amplitudes where both qubits are 1
+            return 0.5 * amplitude_bytes;
+        default:
+            return 2 * amplitude_bytes;
         }
     }
 
     void apply_gate(const Gate& gate, bool verbose) {
         Kokkos::Timer gate_timer;
+        TraceRegion region(gate_to_text(gate.type), "gate", gate_bytes(gate.type));
+        region.set_args("\"cycle\": {}, \"target\": {}, \"control\": {}, \"num_qubits\": {}",
+            gate.cycle, gate.target, gate.control, circuit.num_qubits);
         switch (gate.type) {
         case GateType::X:
             apply_1Q_gate(gate.target, x_gate, 0);
@@ -315,15 +417,109 @@ struct SchrodingerSimulator {
         }
     }
 
+    /** Bytes of a diagonal run: a read and a write of every amplitude */
+    double diagonal_run_bytes() const {
+        return 2. * sizeof(cmplx) * N;
+    }
+
+    /**
+     * Whether the diagonal gates [begin, end) move more bytes one by one than
+     * in a diagonal run (two CZ, or a CZ and a T, are cheaper on their own)
+     */
+    bool fuses(size_t begin, size_t end) const {
+        double bytes = 0;
+        for (size_t g = begin;g < end;g++) {
+            bytes += gate_bytes(circuit.gates[g].type);
+        }
+        return bytes > diagonal_run_bytes();
+    }
+
+    /**
+     * Apply the consecutive diagonal gates [begin, end) in one sweep, instead
+     * of reading and writing the amplitudes once per gate
+     *
+     * The phases of Z, T and CZ are eighths of a turn, applied to the
+     * amplitudes whose bits of the qubits of the gate (mask) are all 1: they
+     * are summed for each amplitude, which is then multiplied once (if its
+     * phase is not 0).
+     */
+    void apply_diagonal_run(const Kokkos::View<size_t*>& masks, const Kokkos::View<int*>& eighths_of, size_t begin, size_t end, bool verbose) {
+        Kokkos::Timer run_timer;
+        TraceRegion region("diagonal run", "gate", diagonal_run_bytes());
+        region.set_args("\"cycle\": {}, \"gates\": {}, \"num_qubits\": {}",
+            circuit.gates[begin].cycle, end - begin, circuit.num_qubits);
+        cmplx phases[8];
+        for (int k = 0;k < 8;k++) {
+            phases[k] = cmplx(Kokkos::cos(k * M_PI / 4), Kokkos::sin(k * M_PI / 4));
+        }
+        phases[2] = cmplx(0, 1);
+        phases[4] = -1;
+        phases[6] = cmplx(0, -1);
+        Kokkos::parallel_for("apply_diagonal_run", N, KOKKOS_CLASS_LAMBDA(size_t idx) {
+            int eighths = 0;
+            for (size_t g = begin;g < end;g++) {
+                eighths += ((idx & masks(g)) == masks(g)) * eighths_of(g);
+            }
+            if (eighths & 7) {
+                wave(idx) *= phases[eighths & 7];
+            }
+        });
+        if (verbose) {
+            Kokkos::fence();
+            fmt::println("Cycle: {:>3}, time: {:>10}, diagonal run of {} gates",
+                circuit.gates[begin].cycle, print_time(run_timer.seconds()), end - begin);
+        }
+    }
+
     void normalise() {
-        Kokkos::parallel_for(N, KOKKOS_CLASS_LAMBDA(size_t idx) { wave(idx) /= Kokkos::pow(Kokkos::sqrt(2), sqrt_counter); });
+        TraceRegion region("normalise", "kernel", 2. * sizeof(cmplx) * N);
+        Kokkos::parallel_for("normalise", N, KOKKOS_CLASS_LAMBDA(size_t idx) { wave(idx) /= Kokkos::pow(Kokkos::sqrt(2), sqrt_counter); });
     }
 
-    void run(bool verbose = true) {
+    /** Apply the gates from first_gate (the previous ones being already applied, see apply_factorized) */
+    void run(bool verbose = true, size_t first_gate = 0) {
         Kokkos::Timer timer;
-        for (const auto& gate : circuit.gates) {
+        // One profiling region per cycle, around the regions of its gates
+        std::unique_ptr<TraceRegion> cycle_region;
+        int cycle = -1;
+        // Mask and phase of the diagonal gates, for the diagonal runs
+        Kokkos::View<size_t*> masks;
+        Kokkos::View<int*> eighths;
+        if (!diagonal_runs.empty()) {
+            masks = Kokkos::View<size_t*>("diagonal_masks", circuit.gates.size());
+            eighths = Kokkos::View<int*>("diagonal_eighths", circuit.gates.size());
+            auto masks_host = Kokkos::create_mirror_view(masks);
+            auto eighths_host = Kokkos::create_mirror_view(eighths);
+            for (size_t i = 0;i < circuit.gates.size();i++) {
+                const auto& gate = circuit.gates[i];
+                masks_host(i) = 1ull << (circuit.num_qubits - 1 - gate.target);
+                if (gate.control != -1)
+                    masks_host(i) |= 1ull << (circuit.num_qubits - 1 - gate.control);
+                eighths_host(i) = gate.type == GateType::T ? 1 : 4;
+            }
+            Kokkos::deep_copy(masks, masks_host);
+            Kokkos::deep_copy(eighths, eighths_host);
+        }
+        size_t next_run = 0;
+        for (size_t i = first_gate;i < circuit.gates.size();i++) {
+            const auto& gate = circuit.gates[i];
+            if (gate.cycle != cycle) {
+                cycle = gate.cycle;
+                cycle_region.reset();
+                cycle_region = std::make_unique<TraceRegion>(fmt::format("cycle {}", cycle), "cycle");
+            }
+            while (next_run < diagonal_runs.size() && diagonal_runs[next_run].first < i) {
+                next_run++;
+            }
+            if (next_run < diagonal_runs.size() && diagonal_runs[next_run].first == i && fuses(i, diagonal_runs[next_run].second)) {
+                size_t end = diagonal_runs[next_run].second;
+                apply_diagonal_run(masks, eighths, i, end, verbose);
+                i = end - 1;
+                continue;
+            }
             apply_gate(gate, verbose);
         }
+        cycle_region.reset();
 
         normalise();
 
@@ -342,7 +538,7 @@ struct SchrodingerSimulator {
 
     Kokkos::View<cmplx*> get_probabilities() {
         Kokkos::View<cmplx*> probs("probs", N);
-        Kokkos::parallel_for(N, KOKKOS_CLASS_LAMBDA(size_t idx) { probs(idx) = Kokkos::abs(wave(idx) * wave(idx)); });
+        Kokkos::parallel_for("probabilities", N, KOKKOS_CLASS_LAMBDA(size_t idx) { probs(idx) = Kokkos::abs(wave(idx) * wave(idx)); });
         return probs;
     }
 
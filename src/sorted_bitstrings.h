@@ -0,0 +1,117 @@
+#pragma once
+#include "kokkos.h"
+#include "types.h"
+#include "complex.h"
+#include "memory.h"
+
+#include <Kokkos_Sort.hpp>
+
+/**
+ * Requested bitstrings in increasing order
+ *
+ * Qubit 0 being the most significant bit, the increasing order of the
+ * bitstrings is the lexicographic order of the indices in the blocks of a
+ * cut: the gathers of the Feynman paths then walk the block amplitudes
+ * monotonically instead of randomly.
+ *
+ * The amplitudes are accumulated in the sorted order, and put back in the
+ * order of the request at the end of the run.
+ */
+struct SortedBitstrings {
+    Kokkos::View<size_t*> bitstrings;
+    Kokkos::View<size_t*> order; // order(j) is the position of bitstrings(j) in the request
+
+    SortedBitstrings(const Kokkos::View<size_t*>& request) {
+        size_t n = request.extent(0);
+        if (n == 0) {
+            return;
+        }
+        bitstrings = Kokkos::View<size_t*>("sorted_bitstrings", n);
+        order = Kokkos::View<size_t*>("bitstrings_order", n);
+        Kokkos::deep_copy(bitstrings, request);
+        auto order_ = order;
+        Kokkos::parallel_for("bitstrings_order", n, KOKKOS_LAMBDA(size_t i) {
+            order_(i) = i;
+        });
+        Kokkos::Experimental::sort_by_key(ExecSpace(), bitstrings, order);
+    }
+
+    /**
+     * Memory of the requested amplitudes of a run: the request, its sorted
+     * copy and the accumulator, unpermuted at the end (the full statevector
+     * if num_amplitudes is 0)
+     */
+    static MemoryPlan memory_plan(size_t num_amplitudes, int num_qubits) {
+        MemoryPlan plan;
+        if (num_amplitudes == 0) {
+            plan.add("global_wave", sizeof(cmplx) << num_qubits);
+            return plan;
+        }
+        plan.add("bitstrings", sizeof(size_t) * num_amplitudes);
+        plan.add("sorted_bitstrings", sizeof(size_t) * num_amplitudes);
+        plan.add("bitstrings_order", sizeof(size_t) * num_amplitudes);
+        plan.add("global_wave", sizeof(cmplx) * num_amplitudes, 2);
+        return plan;
+    }
+
+    /** Amplitudes in the order of the request */
+    Kokkos::View<cmplx*> unpermute(const Kokkos::View<cmplx*>& sorted_wave) const {
+        if (order.extent(0) == 0) {
+            return sorted_wave;
+        }
+        Kokkos::View<cmplx*> wave("global_wave", sorted_wave.extent(0));
+        auto order_ = order;
+        Kokkos::parallel_for("unpermute_amplitudes", wave.extent(0), KOKKOS_LAMBDA(size_t j) {
+            wave(order_(j)) = sorted_wave(j);
+        });
+        return wave;
+    }
+};
+
+/**
+ * Distinct requested bitstrings, in increasing order
+ *
+ * A request may contain the same bitstring many times (e.g. samples of a
+ * device): the amplitudes are computed once per distinct bitstring, and
+ * expanded back to the order of the request.
+ */
+struct UniqueBitstrings {
+    Kokkos::View<size_t*> bitstrings;
+    Kokkos::View<size_t*> inverse; // inverse(i) is the position of the i-th request in bitstrings
+
+    UniqueBitstrings(const Kokkos::View<size_t*>& request) {
+        SortedBitstrings sorted(request);
+        size_t n = request.extent(0);
+        inverse = Kokkos::View<size_t*>("bitstrings_inverse", n);
+
+        // Position of every sorted bitstring among the distinct ones
+        auto sorted_ = sorted.bitstrings;
+        Kokkos::View<size_t*> positions("unique_positions", n);
+        size_t num_unique = 0;
+        Kokkos::parallel_scan("unique_scan", n, KOKKOS_LAMBDA(size_t j, size_t& update, const bool final) {
+            bool first = j == 0 || sorted_(j) != sorted_(j - 1);
+            if (final)
+                positions(j) = update - !first;
+            update += first;
+        }, num_unique);
+
+        bitstrings = Kokkos::View<size_t*>("unique_bitstrings", num_unique);
+        auto unique = bitstrings;
+        auto order = sorted.order;
+        auto inverse_ = inverse;
+        Kokkos::parallel_for("unique_scatter", n, KOKKOS_LAMBDA(size_t j) {
+            unique(positions(j)) = sorted_(j);
+            inverse_(order(j)) = positions(j);
+        });
+    }
+
+    /** Amplitudes of the request, from the amplitudes of the distinct bitstrings */
+    Kokkos::View<cmplx*> expand(const Kokkos::View<cmplx*>& unique_wave) const {
+        Kokkos::View<cmplx*> wave("wave", inverse.extent(0));
+        auto inverse_ = inverse;
+        Kokkos::parallel_for("expand_amplitudes", wave.extent(0), KOKKOS_LAMBDA(size_t i) {
+            wave(i) = unique_wave(inverse_(i));
+        });
+        return wave;
+    }
+};
@@ -0,0 +1,253 @@
+#pragma once
+#include "complex.h"
+#include "types.h"
+#include "io/output/output.h"
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Allocation of the state vectors (wavefunctions of the simulators)
+ *
+ * By default, a View is zeroed when allocated, which places all of its pages
+ * on the NUMA node of the thread that zeroes them. The other allocators
+ * allocate without initialising, and zero the state with the same static
+ * partition as the gate kernels (a RangePolicy over the amplitudes): each
+ * page is then placed on the node of the thread that updates it.
+ *
+ * The huge pages allocator also asks the kernel to back the state with
+ * transparent huge pages (2MB) before it is touched, such that the gates on
+ * the high qubits (large strides) do not miss the TLB on every amplitude.
+ * Explicit huge pages (hugetlbfs) would need a Kokkos memory space of their
+ * own, transparent huge pages only need THP to be enabled in "madvise" or
+ * "always" mode.
+ *
+ * On a device, the pages are not managed by the host: the allocators only
+ * differ by the initialisation.
+ */
+enum class StateAllocator {
+    Default,
+    FirstTouch,
+    HugePages
+};
+
+inline StateAllocator& state_allocator() {
+    static StateAllocator allocator = StateAllocator::Default;
+    return allocator;
+}
+
+inline StateAllocator parse_state_allocator(const std::string& name) {
+    if (name == "default")
+        return StateAllocator::Default;
+    if (name == "first_touch")
+        return StateAllocator::FirstTouch;
+    if (name == "huge_pages")
+        return StateAllocator::HugePages;
+    throw std::runtime_error("Unknown state allocator: " + name + " (default, first_touch or huge_pages)");
+}
+
+constexpr size_t huge_page_size = 2ull << 20;
+
+constexpr bool state_on_host = Kokkos::SpaceAccessibility<Kokkos::HostSpace, ExecSpace::memory_space>::accessible;
+
+/** Back the whole huge pages of [data, data + bytes) with transparent huge pages */
+inline void advise_huge_pages(void* data, size_t bytes) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    uintptr_t begin = ((uintptr_t)data + huge_page_size - 1) & ~(huge_page_size - 1);
+    uintptr_t end = ((uintptr_t)data + bytes) & ~(huge_page_size - 1);
+    if (end > begin) {
+        madvise((void*)begin, end - begin, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+/**
+ * State vectors kept across the jobs of a batch
+ *
+ * When enabled, every state vector is also held by the pool. A buffer is
+ * handed out again when nothing else references it any more (its simulator
+ * is gone, and the outputs of its job are written), which saves the
+ * allocation and the page faults of the state of the next job of the same
+ * shape. The free buffers that the previous job did not use are released at
+ * the start of a job, and the free buffers of other sizes on a miss, such
+ * that the pool does not hold on to the states of older jobs.
+ */
+struct StatePool {
+    struct Buffer {
+        Kokkos::View<cmplx*> wave;
+        size_t last_job;
+    };
+
+    bool enabled = false;
+    size_t job = 0;
+    std::vector<Buffer> buffers;
+    size_t reused = 0;
+
+    void add(const Kokkos::View<cmplx*>& wave) {
+        buffers.push_back({ wave, job });
+    }
+
+    /** Keep the buffers in use, and the free ones for which keep(buffer) holds */
+    template<typename F>
+    void release_free(const F& keep) {
+        std::vector<Buffer> kept;
+        for (const auto& buffer : buffers) {
+            if (buffer.wave.use_count() > 1 || keep(buffer))
+                kept.push_back(buffer);
+        }
+        buffers = kept;
+    }
+
+    void next_job() {
+        job++;
+        release_free([this](const Buffer& buffer) { return buffer.last_job + 1 >= job; });
+    }
+
+    /** A free buffer of n amplitudes (not zeroed), or an empty View */
+    Kokkos::View<cmplx*> acquire(size_t n) {
+        for (auto& buffer : buffers) {
+            if (buffer.wave.extent(0) == n && buffer.wave.use_count() == 1) {
+                buffer.last_job = job;
+                reused++;
+                return buffer.wave;
+            }
+        }
+        release_free([](const Buffer&) { return false; });
+        return Kokkos::View<cmplx*>();
+    }
+};
+
+inline StatePool& state_pool() {
+    static StatePool pool;
+    return pool;
+}
+
+/** Zeroed state vector of n amplitudes, placed by the current allocator */
+inline Kokkos::View<cmplx*> allocate_state(const std::string& label, size_t n) {
+    StatePool& pool = state_pool();
+    if (pool.enabled) {
+        Kokkos::View<cmplx*> wave = pool.acquire(n);
+        if (wave.extent(0) == n) {
+            // Same partition as the first touch, the pages stay local to their threads
+            Kokkos::parallel_for("reset_state", n, KOKKOS_LAMBDA(size_t i) {
+                wave(i) = 0;
+            });
+            return wave;
+        }
+    }
+    Kokkos::View<cmplx*> wave;
+    if (state_allocator() == StateAllocator::Default) {
+        wave = Kokkos::View<cmplx*>(label, n);
+    }
+    else {
+        wave = Kokkos::View<cmplx*>(Kokkos::view_alloc(Kokkos::WithoutInitializing, label), n);
+        if (state_on_host && state_allocator() == StateAllocator::HugePages) {
+            advise_huge_pages(wave.data(), n * sizeof(cmplx));
+        }
+        // First touch, with the partition of the gate kernels
+        auto state = wave;
+        Kokkos::parallel_for("first_touch", n, KOKKOS_LAMBDA(size_t i) {
+            state(i) = 0;
+        });
+    }
+    if (pool.enabled) {
+        pool.add(wave);
+    }
+    return wave;
+}
+
+/** Bytes of [data, data + bytes) backed by transparent huge pages, from /proc/self/smaps */
+inline size_t huge_page_bytes(const void* data, size_t bytes) {
+    uintptr_t begin = (uintptr_t)data;
+    uintptr_t end = begin + bytes;
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    bool in_range = false;
+    size_t total = 0;
+    while (std::getline(smaps, line)) {
+        unsigned long start, stop;
+        if (std::sscanf(line.c_str(), "%lx-%lx ", &start, &stop) == 2) {
+            in_range = start < end && stop > begin;
+        }
+        else if (in_range && line.rfind("AnonHugePages:", 0) == 0) {
+            size_t kb = 0;
+            std::sscanf(line.c_str(), "AnonHugePages: %zu kB", &kb);
+            total += kb * 1024;
+        }
+    }
+    return MIN(total, bytes);
+}
+
+/**
+ * Achieved placement of a state vector
+ *
+ * Evenly spaced pages are sampled. The node of each page (move_pages) is
+ * compared with the node of the thread that owns it in the static partition
+ * of the gate kernels (getcpu, in a kernel over the samples with the same
+ * partition).
+ */
+inline std::string print_placement(const std::string& label, const Kokkos::View<cmplx*>& wave) {
+    size_t bytes = wave.extent(0) * sizeof(cmplx);
+    std::string out = fmt::format("Placement of {} ({}):", label, print_filesize(bytes));
+    if (!state_on_host) {
+        return out + " device memory";
+    }
+#if defined(__linux__) && defined(SYS_move_pages) && defined(SYS_getcpu)
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t num_pages = (bytes + page_size - 1) / page_size;
+    size_t samples = MIN(num_pages, (size_t)4096);
+    if (samples == 0) {
+        return out + " empty";
+    }
+
+    std::vector<void*> pages(samples);
+    std::vector<int> status(samples, -1);
+    uintptr_t base = (uintptr_t)wave.data() & ~(uintptr_t)(page_size - 1);
+    for (size_t s = 0;s < samples;s++) {
+        pages[s] = (void*)(base + (s * num_pages / samples) * page_size);
+    }
+    syscall(SYS_move_pages, 0, samples, pages.data(), nullptr, status.data(), 0);
+
+    Kokkos::View<int*, Kokkos::HostSpace> thread_node("thread_node", samples);
+    Kokkos::parallel_for("placement_threads", HostRangePolicy(0, samples), [=](size_t s) {
+        unsigned cpu = 0, node = 0;
+        syscall(SYS_getcpu, &cpu, &node, nullptr);
+        thread_node(s) = node;
+    });
+    Kokkos::fence();
+
+    std::map<int, size_t> per_node;
+    size_t local = 0;
+    size_t placed = 0;
+    for (size_t s = 0;s < samples;s++) {
+        if (status[s] < 0) {
+            continue;
+        }
+        per_node[status[s]]++;
+        placed++;
+        local += status[s] == thread_node(s);
+    }
+    for (const auto& [node, count] : per_node) {
+        out += fmt::format(" node {}: {:.1f}%,", node, 100.0 * count / samples);
+    }
+    if (placed < samples) {
+        out += fmt::format(" not placed: {:.1f}%,", 100.0 * (samples - placed) / samples);
+    }
+    out += fmt::format(" local to its thread: {:.1f}%", placed ? 100.0 * local / placed : 0.);
+    size_t huge = huge_page_bytes(wave.data(), bytes);
+    out += fmt::format(", huge pages: {} ({:.1f}%)", print_filesize(huge), 100.0 * huge / bytes);
+    return out;
+#else
+    return out + " not available on this system";
+#endif
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "simulator.h"
+
+#include <vector>
+
+/**
+ * Cross-entropy benchmarking and Porter-Thomas statistics
+ *
+ * With p the ideal probability of a bitstring and N = 2^n:
+ *  - linear XEB: N <p> - 1
+ *  - log XEB: log N + gamma + <log p>
+ * where <.> is the mean over the samples. On a full statevector, <.> is the
+ * expectation over the ideal distribution (sum_x p(x) ...), i.e. the XEB of
+ * a perfect sampler.
+ *
+ * In sampled mode, the samples of probability 0 (num_zeros) are left out of
+ * the mean of the log XEB, whose log would be infinite.
+ *
+ * The histogram counts the amplitudes by value of N p / fidelity, in
+ * num_bins bins of [0, histogram_max), the larger values being counted in
+ * overflow.
+ */
+struct Statistics {
+    int num_qubits = 0;
+    size_t num_amplitudes = 0;
+    bool sampled = true;
+    precision fidelity = 1;
+    precision total_probability = 0;
+    precision linear_xeb = 0;
+    precision log_xeb = 0;
+    size_t num_zeros = 0; // Amplitudes left out of the log XEB
+    precision histogram_max = 10;
+    std::vector<size_t> histogram;
+    size_t overflow = 0;
+};
+
+/**
+ * Blocks of amplitudes of compute_statistics, each filling a histogram of its
+ * own: most values of N p fall in the first bins, which all the threads would
+ * otherwise increment. At least statistics_block_size amplitudes per block,
+ * and at most statistics_partial_bins bins in all.
+ */
+constexpr size_t statistics_block_size = 1024;
+constexpr size_t statistics_partial_bins = 1ull << 20;
+constexpr size_t statistics_row_padding = 8;
+
+inline size_t statistics_blocks(size_t num_amplitudes, int num_bins) {
+    size_t row = MAX((size_t)num_bins + 1, statistics_row_padding);
+    size_t blocks = MAX(num_amplitudes / statistics_block_size, (size_t)1);
+    return MAX(MIN(blocks, statistics_partial_bins / row), (size_t)1);
+}
+
+/**
+ * All the statistics in one sweep over the amplitudes: the sums are fused in
+ * one reduction over the blocks, and the histograms of the blocks are filled
+ * in the same kernel, then added
+ */
+inline Statistics compute_statistics(const Kokkos::View<cmplx*>& wave, int num_qubits, bool sampled,
+    int num_bins = 100, precision histogram_max = 10, precision fidelity = 1) {
+    Statistics stats;
+    stats.num_qubits = num_qubits;
+    stats.num_amplitudes = wave.extent(0);
+    stats.sampled = sampled;
+    stats.fidelity = fidelity;
+    stats.histogram_max = histogram_max;
+
+    size_t num_amplitudes = wave.extent(0);
+    size_t num_blocks = statistics_blocks(num_amplitudes, num_bins);
+    size_t block_size = (num_amplitudes + num_blocks - 1) / num_blocks;
+    // The histograms of two threads do not share a cache line (on the host)
+    Kokkos::View<size_t**> partials("histogram_partials", num_blocks, MAX((size_t)num_bins + 1, statistics_row_padding));
+    precision N = (precision)(1ull << num_qubits);
+    precision bin_width = histogram_max / num_bins;
+
+    precision sum_p = 0;
+    precision sum_xeb = 0;
+    precision sum_log = 0;
+    size_t num_zeros = 0;
+    Kokkos::parallel_reduce("statistics", num_blocks, KOKKOS_LAMBDA(size_t b, precision& p_, precision& xeb_, precision& log_, size_t& zeros_) {
+        size_t end = MIN((b + 1) * block_size, num_amplitudes);
+        for (size_t i = b * block_size;i < end;i++) {
+            precision p = Kokkos::abs(wave(i) * wave(i));
+            precision weight = sampled ? 1 : p;
+            p_ += p;
+            xeb_ += weight * N * p;
+            if (p > 0) {
+                log_ += weight * Kokkos::log(N * p);
+            }
+            else {
+                zeros_++;
+            }
+            precision x = N * p / fidelity / bin_width;
+            partials(b, x < num_bins ? (size_t)x : num_bins)++;
+        }
+    }, sum_p, sum_xeb, sum_log, num_zeros);
+
+    Kokkos::View<size_t*> bins("histogram", num_bins + 1);
+    Kokkos::parallel_for("statistics_histogram", num_bins + 1, KOKKOS_LAMBDA(size_t bin) {
+        size_t count = 0;
+        for (size_t b = 0;b < num_blocks;b++) {
+            count += partials(b, bin);
+        }
+        bins(bin) = count;
+    });
+
+    auto bins_host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), bins);
+    stats.histogram.assign(bins_host.data(), bins_host.data() + num_bins);
+    stats.overflow = bins_host(num_bins);
+
+    const precision euler_gamma = 0.57721566490153286;
+    precision norm = sampled ? stats.num_amplitudes : 1;
+    precision log_norm = sampled ? stats.num_amplitudes - num_zeros : 1;
+    stats.total_probability = sum_p;
+    stats.linear_xeb = sum_xeb / norm - 1;
+    stats.log_xeb = log_norm > 0 ? sum_log / log_norm + euler_gamma : 0;
+    stats.num_zeros = num_zeros;
+    return stats;
+}
+
+inline Statistics compute_statistics(const SampleVector& vector, int num_bins = 100, precision histogram_max = 10, precision fidelity = 1) {
+    return compute_statistics(vector.wave, vector.num_qubits, true, num_bins, histogram_max, fidelity);
+}
+
+inline Statistics compute_statistics(const StateVector& vector, int num_bins = 100, precision histogram_max = 10, precision fidelity = 1) {
+    return compute_statistics(vector.wave, vector.num_qubits, false, num_bins, histogram_max, fidelity);
+}
+
+inline std::string print_statistics(const Statistics& stats) {
+    return fmt::format("Linear XEB: {:.4f}, log XEB: {:.4f}, total probability: {:.4e} ({} {})",
+        stats.linear_xeb, stats.log_xeb, stats.total_probability, stats.num_amplitudes,
+        stats.sampled ? "samples" : "amplitudes");
+}
+
+inline std::string print_statistics_json(const Statistics& stats) {
+    std::string histogram;
+    for (size_t i = 0;i < stats.histogram.size();i++) {
+        histogram += fmt::format("{}{}", i ? ", " : "", stats.histogram[i]);
+    }
+    std::string out = "{\n";
+    out += fmt::format("  \"num_qubits\": {},\n", stats.num_qubits);
+    out += fmt::format("  \"num_amplitudes\": {},\n", stats.num_amplitudes);
+    out += fmt::format("  \"sampled\": {},\n", stats.sampled ? "true" : "false");
+    out += fmt::format("  \"fidelity\": {},\n", stats.fidelity);
+    out += fmt::format("  \"total_probability\": {},\n", stats.total_probability);
+    out += fmt::format("  \"linear_xeb\": {},\n", stats.linear_xeb);
+    out += fmt::format("  \"log_xeb\": {},\n", stats.log_xeb);
+    out += fmt::format("  \"num_zeros\": {},\n", stats.num_zeros);
+    out += fmt::format("  \"histogram_max\": {},\n", stats.histogram_max);
+    out += fmt::format("  \"histogram\": [{}],\n", histogram);
+    out += fmt::format("  \"overflow\": {}\n", stats.overflow);
+    out += "}\n";
+    return out;
+}
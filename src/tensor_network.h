@@ -0,0 +1,633 @@
+#pragma once
+
+#include "simulator.h"
+#include "memory.h"
+#include "path_selection.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Amplitudes of a circuit by contraction of its tensor network
+ *
+ * Every wire segment of the circuit is an index of dimension 2: the initial
+ * |+> states are vectors, the one-qubit gates are matrices (output, input)
+ * and the two-qubit gates are rank-4 tensors (outputs, inputs). The amplitude
+ * of a bitstring is the contraction of the network with the output indices
+ * fixed to its bits, such that the output indices never appear in the
+ * contraction.
+ *
+ * The contraction order is found once, by a greedy heuristic on the shapes
+ * (contract the pair of tensors which shrinks the network the most), and is
+ * reused for every bitstring. If the largest intermediate tensors do not fit
+ * into the memory budget, indices are sliced: fixed to each of their values
+ * in turn, the amplitude being the sum over the slices. Like the Feynman
+ * paths, the slices are split between the processes (see PathSelection) and
+ * the partial sums are reduced by the caller.
+ *
+ * A tensor of rank r is a flat View of 2^r amplitudes, its first index being
+ * the most significant bit.
+ */
+struct TensorNetworkSimulator {
+    struct Leaf {
+        std::vector<int> indices;
+        std::vector<cmplx> values;
+    };
+
+    /** Contraction of tensors a and b into a new tensor, in the order of the plan */
+    struct Contraction {
+        int a;
+        int b;
+        std::vector<int> indices;  // Indices of the result (all of them, before slicing)
+        int rank = 0;              // Rank of the result after slicing
+        int shared = 0;            // Number of indices summed over after slicing
+        // Bit of each index of the result in a, then in b (-1 if absent),
+        // then the bits of each summed index in a, then in b
+        Kokkos::View<int*> map;
+        Kokkos::View<int*>::HostMirror map_host;
+    };
+
+    Circuit circuit;
+    int num_qubits;
+    size_t max_memory;
+    size_t num_amplitudes;  // Requested amplitudes per run, to plan the memory
+    int num_indices = 0;
+    std::vector<Leaf> leaves;
+    std::vector<int> output_index; // Last index of each qubit
+    std::vector<Contraction> steps;
+    std::vector<int> sliced;
+    std::vector<bool> is_sliced;
+    size_t num_paths;       // Number of slices
+    PathSelection paths;
+    MemoryPlan memory;
+    int max_rank = 0;
+    double flops = 0;       // Multiply-adds per amplitude and slice
+
+    // Leaves without any fixed index, shared by all the contractions
+    std::vector<Kokkos::View<cmplx*>> static_leaves;
+
+    /** Matrix (output, input) of a one-qubit gate, normalised */
+    static void gate_matrix(GateType type, cmplx matrix[2][2]) {
+        cmplx j = cmplx(0, 1);
+        precision r = 1. / Kokkos::sqrt(2.);
+        cmplx columns[2][2];
+        for (int in = 0;in < 2;in++) {
+            cmplx a0 = in == 0 ? 1 : 0;
+            cmplx a1 = in == 1 ? 1 : 0;
+            switch (type) {
+            case GateType::X: x_gate(a0, a1, columns[in]); break;
+            case GateType::Y: y_gate(a0, a1, columns[in]); break;
+            case GateType::Z: z_gate(a0, a1, columns[in]); break;
+            case GateType::P0: p0_gate(a0, a1, columns[in]); break;
+            case GateType::P1: p1_gate(a0, a1, columns[in]); break;
+            case GateType::H:
+                h_gate(a0, a1, columns[in]);
+                columns[in][0] *= r;
+                columns[in][1] *= r;
+                break;
+            case GateType::SqrtX:
+                sqrt_x_gate(a0, a1, columns[in]);
+                columns[in][0] *= 0.5;
+                columns[in][1] *= 0.5;
+                break;
+            case GateType::SqrtY:
+                sqrt_y_gate(a0, a1, columns[in]);
+                columns[in][0] *= 0.5;
+                columns[in][1] *= 0.5;
+                break;
+            case GateType::T:
+                // Same normalisation as apply_T_gate
+                columns[in][0] = a0;
+                columns[in][1] = a1 * (1 + j) * r;
+                break;
+            default:
+                throw std::runtime_error("Not a one-qubit gate: " + gate_to_text(type));
+            }
+        }
+        for (int out = 0;out < 2;out++)
+            for (int in = 0;in < 2;in++)
+                matrix[out][in] = columns[in][out];
+    }
+
+    void build_network() {
+        std::vector<int> wire(num_qubits);
+        precision r = 1. / Kokkos::sqrt(2.);
+        for (int q = 0;q < num_qubits;q++) {
+            wire[q] = num_indices++;
+            leaves.push_back({ { wire[q] }, { r, r } });
+        }
+        for (const auto& gate : circuit.gates) {
+            if (gate.control == -1) {
+                cmplx matrix[2][2];
+                gate_matrix(gate.type, matrix);
+                int out = num_indices++;
+                leaves.push_back({ { out, wire[gate.target] }, { matrix[0][0], matrix[0][1], matrix[1][0], matrix[1][1] } });
+                wire[gate.target] = out;
+                continue;
+            }
+            if (gate.type != GateType::CZ && gate.type != GateType::CX) {
+                throw std::runtime_error("Not a two-qubit gate: " + gate_to_text(gate.type));
+            }
+            // (control out, target out, control in, target in)
+            Leaf leaf;
+            int c_out = num_indices++;
+            int t_out = num_indices++;
+            leaf.indices = { c_out, t_out, wire[gate.control], wire[gate.target] };
+            leaf.values.assign(16, 0);
+            for (int c = 0;c < 2;c++) {
+                for (int t = 0;t < 2;t++) {
+                    if (gate.type == GateType::CZ)
+                        leaf.values[c << 3 | t << 2 | c << 1 | t] = c && t ? -1 : 1;
+                    else
+                        leaf.values[c << 3 | (t ^ c) << 2 | c << 1 | t] = 1;
+                }
+            }
+            leaves.push_back(leaf);
+            wire[gate.control] = c_out;
+            wire[gate.target] = t_out;
+        }
+        output_index = wire;
+    }
+
+    static bool contains(const std::vector<int>& indices, int index) {
+        return std::find(indices.begin(), indices.end(), index) != indices.end();
+    }
+
+    /** Indices of the contraction of a and b: the ones of a then of b, without the shared ones */
+    static std::vector<int> contract_indices(const std::vector<int>& a, const std::vector<int>& b) {
+        std::vector<int> result;
+        for (int i : a)
+            if (!contains(b, i))
+                result.push_back(i);
+        for (int i : b)
+            if (!contains(a, i))
+                result.push_back(i);
+        return result;
+    }
+
+    /**
+     * Greedy contraction order
+     *
+     * Each index is shared by exactly two tensors (the output indices being
+     * fixed), the candidate pairs are then the indices. The pair whose
+     * contraction grows the network the least (size of the result minus the
+     * sizes of the operands) is contracted first. Disconnected parts end as
+     * scalars, multiplied together at the end.
+     *
+     * With a temperature, the costs are perturbed by Gumbel noise (scaled by
+     * the size of the operands), such that repeated trials explore other
+     * greedy orders.
+     */
+    std::vector<Contraction> greedy_order(uint64_t seed, double temperature) const {
+        std::vector<Contraction> steps;
+        std::vector<std::vector<int>> shapes;
+        std::vector<bool> output(num_indices, false);
+        for (int q = 0;q < num_qubits;q++)
+            output[output_index[q]] = true;
+        std::vector<std::vector<int>> owners(num_indices);
+        for (int t = 0;t < leaves.size();t++) {
+            std::vector<int> shape;
+            for (int i : leaves[t].indices) {
+                if (!output[i]) {
+                    shape.push_back(i);
+                    owners[i].push_back(t);
+                }
+            }
+            shapes.push_back(shape);
+        }
+        std::vector<bool> alive(shapes.size(), true);
+
+        struct Candidate {
+            double cost;
+            int a;
+            int b;
+            bool operator<(const Candidate& other) const {
+                if (cost != other.cost)
+                    return cost > other.cost;
+                return std::make_pair(a, b) > std::make_pair(other.a, other.b);
+            }
+        };
+        uint64_t counter = 0;
+        auto cost = [&](int a, int b) {
+            int rank = contract_indices(shapes[a], shapes[b]).size();
+            double operands = std::ldexp(1., shapes[a].size()) + std::ldexp(1., shapes[b].size());
+            double cost = std::ldexp(1., rank) - operands;
+            if (temperature > 0) {
+                double u = MAX(counter_drand(seed, counter++), 1e-300);
+                cost += temperature * operands * std::log(-std::log(u));
+            }
+            return cost;
+        };
+        std::priority_queue<Candidate> candidates;
+        for (int i = 0;i < num_indices;i++) {
+            if (owners[i].size() == 2)
+                candidates.push({ cost(owners[i][0], owners[i][1]), owners[i][0], owners[i][1] });
+        }
+
+        auto contract = [&](int a, int b) {
+            int c = shapes.size();
+            steps.push_back({ a, b, contract_indices(shapes[a], shapes[b]) });
+            shapes.push_back(steps.back().indices);
+            alive[a] = alive[b] = false;
+            alive.push_back(true);
+            return c;
+        };
+        while (!candidates.empty()) {
+            Candidate candidate = candidates.top();
+            candidates.pop();
+            if (!alive[candidate.a] || !alive[candidate.b])
+                continue;
+            int c = contract(candidate.a, candidate.b);
+            for (int i : shapes[c]) {
+                for (int& owner : owners[i]) {
+                    if (owner == candidate.a || owner == candidate.b)
+                        owner = c;
+                }
+                int other = owners[i][0] == c ? owners[i][1] : owners[i][0];
+                candidates.push({ cost(c, other), MIN(c, other), MAX(c, other) });
+            }
+        }
+
+        // Scalars of the disconnected parts
+        int last = -1;
+        for (int t = 0;t < shapes.size();t++) {
+            if (!alive[t])
+                continue;
+            last = last == -1 ? t : contract(last, t);
+        }
+        return steps;
+    }
+
+    /** Multiply-adds of a contraction order, without slicing */
+    static double order_flops(const std::vector<Contraction>& order, const std::vector<std::vector<int>>& leaf_shapes) {
+        std::vector<int> ranks;
+        for (const auto& shape : leaf_shapes)
+            ranks.push_back(shape.size());
+        double flops = 0;
+        for (const auto& step : order) {
+            int rank = step.indices.size();
+            int shared = (ranks[step.a] + ranks[step.b] - rank) / 2;
+            flops += std::ldexp(1., rank + shared);
+            ranks.push_back(rank);
+        }
+        return flops;
+    }
+
+    /** Best of the deterministic greedy order and of the given number of randomised trials */
+    void find_contraction_order(int trials) {
+        std::vector<std::vector<int>> leaf_shapes;
+        for (int t = 0;t < leaves.size();t++)
+            leaf_shapes.push_back(tensor_indices(t));
+        steps = greedy_order(0, 0);
+        double best = order_flops(steps, leaf_shapes);
+        for (int trial = 1;trial <= trials;trial++) {
+            double temperature = 0.01 * std::pow(100., (double)trial / trials);
+            auto order = greedy_order(trial, temperature);
+            double flops = order_flops(order, leaf_shapes);
+            if (flops < best) {
+                best = flops;
+                steps = order;
+            }
+        }
+    }
+
+    /** Operand shapes of the contraction steps, after slicing */
+    std::vector<int> sliced_shape(const std::vector<int>& indices) const {
+        std::vector<int> shape;
+        for (int i : indices)
+            if (!is_sliced[i])
+                shape.push_back(i);
+        return shape;
+    }
+
+    std::vector<int> tensor_indices(int t) const {
+        std::vector<int> shape;
+        if (t < leaves.size()) {
+            for (int i : leaves[t].indices)
+                if (!contains(output_index, i))
+                    shape.push_back(i);
+            return shape;
+        }
+        return steps[t - leaves.size()].indices;
+    }
+
+    /**
+     * Peak memory of the tensors during a contraction, with the current
+     * slicing: the live tensors, the result, and the offsets of the shared
+     * indices (see contract_pair). The leaves without fixed indices are kept
+     * for all the contractions.
+     */
+    size_t simulate_peak() const {
+        std::vector<size_t> sizes;
+        size_t alive = 0;
+        for (int t = 0;t < leaves.size();t++) {
+            sizes.push_back(1ull << sliced_shape(tensor_indices(t)).size());
+            alive += sizes.back();
+        }
+        size_t peak = sizeof(cmplx) * alive;
+        for (const auto& step : steps) {
+            int rank_a = sliced_shape(tensor_indices(step.a)).size();
+            int rank_b = sliced_shape(tensor_indices(step.b)).size();
+            int rank = sliced_shape(step.indices).size();
+            size_t terms = 1ull << (rank_a + rank_b - rank) / 2;
+            sizes.push_back(1ull << rank);
+            alive += sizes.back();
+            peak = MAX(peak, sizeof(cmplx) * alive + 2 * sizeof(size_t) * terms);
+            for (int t : { step.a, step.b }) {
+                if (t >= leaves.size() || sliced_shape(tensor_indices(t)).size() != leaves[t].indices.size())
+                    alive -= sizes[t];
+            }
+        }
+        return peak;
+    }
+
+    /** Peak memory of a run, with the tensors of the current slicing */
+    MemoryPlan memory_plan(size_t amplitudes) const {
+        MemoryPlan plan;
+        plan.add("tensors (peak)", simulate_peak());
+        size_t map_size = 0;
+        for (const auto& step : steps) {
+            int rank_a = sliced_shape(tensor_indices(step.a)).size();
+            int rank_b = sliced_shape(tensor_indices(step.b)).size();
+            int rank = sliced_shape(step.indices).size();
+            map_size += 2 * (rank + (rank_a + rank_b - rank) / 2);
+        }
+        plan.add("contraction_map", sizeof(int) * map_size);
+        plan.add("bitstrings", sizeof(size_t) * amplitudes);
+        plan.add("amplitudes", sizeof(cmplx) * amplitudes);
+        return plan;
+    }
+
+    /**
+     * Slice indices until the plan fits into the budget
+     *
+     * The sliced index is the one that appears in the most intermediate
+     * elements (weighted by the size of the intermediates), among the indices
+     * of the largest intermediate.
+     */
+    void slice_indices() {
+        is_sliced.assign(num_indices, false);
+        memory = memory_plan(num_amplitudes);
+        while (!memory.fits(max_memory)) {
+            size_t largest = 0;
+            const std::vector<int>* candidates = nullptr;
+            for (const auto& step : steps) {
+                size_t size = 1ull << sliced_shape(step.indices).size();
+                if (size > largest) {
+                    largest = size;
+                    candidates = &step.indices;
+                }
+            }
+            int best = -1;
+            double best_score = 0;
+            if (candidates != nullptr && sliced.size() < 62) {
+                for (int i : sliced_shape(*candidates)) {
+                    double score = 0;
+                    for (const auto& step : steps) {
+                        std::vector<int> shape = sliced_shape(step.indices);
+                        if (contains(shape, i))
+                            score += std::ldexp(1., shape.size());
+                    }
+                    if (score > best_score) {
+                        best_score = score;
+                        best = i;
+                    }
+                }
+            }
+            MemoryPlan plan;
+            if (best != -1) {
+                is_sliced[best] = true;
+                plan = memory_plan(num_amplitudes);
+            }
+            // The leaves and the amplitudes are not reduced by slicing
+            if (best == -1 || plan.total() >= memory.total()) {
+                throw std::runtime_error(fmt::format("The contraction needs {}, over the memory budget of {}:\n{}",
+                    print_filesize(memory.total()), print_filesize(max_memory), memory.print()));
+            }
+            sliced.push_back(best);
+            memory = plan;
+        }
+        num_paths = 1ull << sliced.size();
+        fmt::println("Memory plan:\n{}", memory.print());
+    }
+
+    /** Bit maps of the contraction kernels, and the leaves that no bitstring or slice changes */
+    void prepare_kernels() {
+        max_rank = 0;
+        flops = 0;
+        for (auto& step : steps) {
+            std::vector<int> a = sliced_shape(tensor_indices(step.a));
+            std::vector<int> b = sliced_shape(tensor_indices(step.b));
+            std::vector<int> c = sliced_shape(step.indices);
+            std::vector<int> shared;
+            for (int i : a)
+                if (contains(b, i))
+                    shared.push_back(i);
+            step.rank = c.size();
+            step.shared = shared.size();
+            max_rank = MAX(max_rank, step.rank);
+            flops += std::ldexp(1., step.rank + step.shared);
+
+            // Bit of index i in a tensor of the given shape
+            auto bit = [](const std::vector<int>& shape, int i) {
+                auto it = std::find(shape.begin(), shape.end(), i);
+                return it == shape.end() ? -1 : (int)(shape.end() - it) - 1;
+            };
+            int rc = step.rank;
+            int rs = step.shared;
+            step.map = Kokkos::View<int*>("contraction_map", 2 * (rc + rs));
+            step.map_host = Kokkos::create_mirror_view(step.map);
+            for (int k = 0;k < rc;k++) {
+                int i = c[rc - 1 - k];
+                step.map_host(k) = bit(a, i);
+                step.map_host(rc + k) = bit(b, i);
+            }
+            for (int m = 0;m < rs;m++) {
+                step.map_host(2 * rc + m) = bit(a, shared[m]);
+                step.map_host(2 * rc + rs + m) = bit(b, shared[m]);
+            }
+            Kokkos::deep_copy(step.map, step.map_host);
+        }
+
+        std::vector<int> no_values(num_indices, -1);
+        static_leaves.assign(leaves.size(), Kokkos::View<cmplx*>());
+        for (int t = 0;t < leaves.size();t++) {
+            if (sliced_shape(tensor_indices(t)).size() == leaves[t].indices.size())
+                static_leaves[t] = leaf_tensor(t, no_values);
+        }
+    }
+
+    /** Leaf tensor with its fixed indices set to their values */
+    Kokkos::View<cmplx*> leaf_tensor(int t, const std::vector<int>& value) const {
+        const auto& leaf = leaves[t];
+        int rank = leaf.indices.size();
+        std::vector<cmplx> values;
+        for (size_t full = 0;full < (1ull << rank);full++) {
+            bool selected = true;
+            for (int k = 0;k < rank;k++) {
+                int v = value[leaf.indices[k]];
+                if (v != -1 && v != ((full >> (rank - 1 - k)) & 1))
+                    selected = false;
+            }
+            if (selected)
+                values.push_back(leaf.values[full]);
+        }
+        Kokkos::View<cmplx*> tensor(Kokkos::view_alloc(Kokkos::WithoutInitializing, "leaf"), values.size());
+        auto tensor_host = Kokkos::create_mirror_view(tensor);
+        for (size_t i = 0;i < values.size();i++)
+            tensor_host(i) = values[i];
+        Kokkos::deep_copy(tensor, tensor_host);
+        return tensor;
+    }
+
+    /**
+     * Contraction of two tensors
+     *
+     * The offsets in a and b of every value of the shared indices are
+     * tabulated first, such that the sums only add the offsets to the bases
+     * of the element. One thread per element of the result, which sums over
+     * the values of the shared indices. A result of a few elements with more shared terms
+     * (the last contractions, down to the scalar amplitude) is instead
+     * computed one element at a time, with a reduction over the shared
+     * indices.
+     */
+    Kokkos::View<cmplx*> contract_pair(const Contraction& step, const Kokkos::View<cmplx*>& A, const Kokkos::View<cmplx*>& B) const {
+        int rc = step.rank;
+        int rs = step.shared;
+        size_t size = 1ull << rc;
+        size_t terms = 1ull << rs;
+        auto map = step.map;
+        Kokkos::View<cmplx*> C(Kokkos::view_alloc(Kokkos::WithoutInitializing, "tensor"), size);
+
+        Kokkos::View<size_t**> offsets(Kokkos::view_alloc(Kokkos::WithoutInitializing, "shared_offsets"), 2, terms);
+        Kokkos::parallel_for("shared_offsets", terms, KOKKOS_LAMBDA(size_t s) {
+            size_t ia = 0, ib = 0;
+            for (int m = 0;m < rs;m++) {
+                size_t bit = (s >> m) & 1;
+                ia |= bit << map(2 * rc + m);
+                ib |= bit << map(2 * rc + rs + m);
+            }
+            offsets(0, s) = ia;
+            offsets(1, s) = ib;
+        });
+
+        if (size > 16 || terms <= size) {
+            Kokkos::parallel_for("contract_tensors", size, KOKKOS_LAMBDA(size_t idx) {
+                size_t base_a = 0, base_b = 0;
+                for (int k = 0;k < rc;k++) {
+                    size_t bit = (idx >> k) & 1;
+                    if (map(k) >= 0)
+                        base_a |= bit << map(k);
+                    else
+                        base_b |= bit << map(rc + k);
+                }
+                cmplx sum = 0;
+                for (size_t s = 0;s < terms;s++) {
+                    sum += A(base_a + offsets(0, s)) * B(base_b + offsets(1, s));
+                }
+                C(idx) = sum;
+            });
+            return C;
+        }
+
+        auto C_host = Kokkos::create_mirror_view(C);
+        const auto& map_host = step.map_host;
+        for (size_t idx = 0;idx < size;idx++) {
+            size_t base_a = 0, base_b = 0;
+            for (int k = 0;k < rc;k++) {
+                size_t bit = (idx >> k) & 1;
+                if (map_host(k) >= 0)
+                    base_a |= bit << map_host(k);
+                else
+                    base_b |= bit << map_host(rc + k);
+            }
+            cmplx sum = 0;
+            Kokkos::parallel_reduce("contract_tensors_reduce", terms, KOKKOS_LAMBDA(size_t s, cmplx& partial) {
+                partial += A(base_a + offsets(0, s)) * B(base_b + offsets(1, s));
+            }, sum);
+            C_host(idx) = sum;
+        }
+        Kokkos::deep_copy(C, C_host);
+        return C;
+    }
+
+    /** Contraction of the network with the given values of the fixed indices (-1 if not fixed) */
+    cmplx contract(const std::vector<int>& value) const {
+        std::vector<Kokkos::View<cmplx*>> tensors(leaves.size() + steps.size());
+        for (int t = 0;t < leaves.size();t++) {
+            tensors[t] = static_leaves[t].extent(0) > 0 ? static_leaves[t] : leaf_tensor(t, value);
+        }
+        for (size_t k = 0;k < steps.size();k++) {
+            const auto& step = steps[k];
+            tensors[leaves.size() + k] = contract_pair(step, tensors[step.a], tensors[step.b]);
+            // The operands are released as soon as they are contracted
+            tensors[step.a] = Kokkos::View<cmplx*>();
+            tensors[step.b] = Kokkos::View<cmplx*>();
+        }
+        auto result = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), tensors.back());
+        return result(0);
+    }
+
+    /**
+     * @param max_memory memory budget in bytes (0 for no limit), indices are
+     * sliced until the contraction fits
+     * @param num_amplitudes amplitudes requested per run, to plan the memory
+     * @param trials number of randomised greedy orders tried
+     */
+    TensorNetworkSimulator(const Circuit& circuit, size_t max_memory, size_t num_amplitudes = 0, int trials = 64)
+        : circuit(circuit), num_qubits(circuit.num_qubits), max_memory(max_memory), num_amplitudes(num_amplitudes) {
+        Kokkos::Timer timer;
+        build_network();
+        find_contraction_order(trials);
+        slice_indices();
+        prepare_kernels();
+        paths = PathSelection(num_paths);
+        fmt::println("Tensor network: {} tensors, {} indices, {} contractions in {}",
+            leaves.size(), num_indices, steps.size(), print_time(timer.seconds()));
+        fmt::println("Largest tensor: rank {} ({}), {} sliced indices ({} slices), {:.3g} multiply-adds per amplitude",
+            max_rank, print_filesize(sizeof(cmplx) << max_rank), sliced.size(), num_paths, flops * num_paths);
+    }
+
+    /** Amplitudes of the given bitstrings, summed over the selected slices */
+    Kokkos::View<cmplx*> run(const Kokkos::View<size_t*>& bitstrings, float fidelity, int verbose) {
+        if (bitstrings.extent(0) == 0) {
+            throw std::runtime_error("The tensor network simulator computes the amplitudes of given bitstrings, not the full statevector");
+        }
+        Kokkos::Timer timer;
+        auto bitstrings_host = Kokkos::create_mirror_view_and_copy(Kokkos::HostSpace(), bitstrings);
+        Kokkos::View<cmplx*> amplitudes("amplitudes", bitstrings.extent(0));
+        auto amplitudes_host = Kokkos::create_mirror_view(amplitudes);
+
+        std::vector<int> value(num_indices, -1);
+        size_t contracted = 0;
+        for (size_t i = 0;i < bitstrings_host.extent(0);i++) {
+            size_t bitstring = bitstrings_host(i);
+            for (int q = 0;q < num_qubits;q++)
+                value[output_index[q]] = (bitstring >> (num_qubits - 1 - q)) & 1;
+            cmplx amplitude = 0;
+            for (size_t p = paths.begin;p < paths.end;p++) {
+                if (!paths.keep(p, fidelity))
+                    continue;
+                // The i-th sliced index is the i-th most significant bit of the slice
+                for (size_t k = 0;k < sliced.size();k++)
+                    value[sliced[k]] = (p >> (sliced.size() - 1 - k)) & 1;
+                TraceRegion region("slice", "path");
+                region.set_args("\"bitstring\": {}, \"slice\": {}", bitstring, p);
+                amplitude += contract(value);
+                contracted++;
+            }
+            amplitudes_host(i) = amplitude;
+            if (verbose && (i + 1) % 1000 == 0)
+                fmt::println("{} / {} amplitudes, {}", i + 1, bitstrings_host.extent(0), print_time(timer.seconds()));
+        }
+        Kokkos::deep_copy(amplitudes, amplitudes_host);
+        double seconds = timer.seconds();
+        fmt::println("Contracted {} slices for {} amplitudes in {} ({:.3g} multiply-adds/s)",
+            contracted, bitstrings.extent(0), print_time(seconds), seconds > 0 ? flops * contracted / seconds : 0.);
+        return amplitudes;
+    }
+};
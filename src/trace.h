@@ -0,0 +1,98 @@
+#pragma once
+#include "kokkos.h"
+
+#include <fmt/core.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Profiling regions and trace of a simulation
+ *
+ * Every TraceRegion is a Kokkos Tools profiling region, such that profilers
+ * show the gates, cycles and Feynman paths around the kernels. Without a
+ * tool loaded, a region costs a function pointer check.
+ *
+ * When the recorder is enabled, every region is also recorded in memory as
+ * an event of a Chrome trace (chrome://tracing or Perfetto), with the bytes
+ * it touched and the achieved bandwidth. The regions are then fenced at both
+ * ends to time the device work. When disabled, no fence is added.
+ */
+struct TraceEvent {
+    std::string name;
+    std::string category;
+    double start; // in seconds
+    double duration;
+    double bytes;
+    std::string args; // Additional JSON fields
+};
+
+struct TraceRecorder {
+    bool enabled = false;
+    Kokkos::Timer timer;
+    std::vector<TraceEvent> events;
+
+    void enable() {
+        enabled = true;
+        events.clear();
+        timer.reset();
+    }
+
+    void write(const std::string& filename) const {
+        std::ofstream out(filename);
+        if (!out.is_open()) {
+            throw std::runtime_error("Could not open file: " + filename);
+        }
+        out << "{\"traceEvents\": [\n";
+        for (size_t i = 0;i < events.size();i++) {
+            const auto& event = events[i];
+            std::string args = fmt::format("\"bytes\": {:.0f}, \"GB/s\": {:.3f}", event.bytes,
+                event.duration > 0 ? event.bytes / event.duration * 1e-9 : 0.);
+            if (!event.args.empty())
+                args += ", " + event.args;
+            out << fmt::format("  {{\"name\": \"{}\", \"cat\": \"{}\", \"ph\": \"X\", \"ts\": {:.3f}, \"dur\": {:.3f}, \"pid\": 0, \"tid\": 0, \"args\": {{{}}}}}{}\n",
+                event.name, event.category, event.start * 1e6, event.duration * 1e6, args, i + 1 < events.size() ? "," : "");
+        }
+        out << "]}\n";
+    }
+};
+
+inline TraceRecorder& trace_recorder() {
+    static TraceRecorder recorder;
+    return recorder;
+}
+
+struct TraceRegion {
+    TraceEvent event;
+    bool recorded;
+
+    TraceRegion(const std::string& name, const std::string& category, double bytes = 0) : recorded(trace_recorder().enabled) {
+        Kokkos::Profiling::pushRegion(name);
+        if (recorded) {
+            Kokkos::fence();
+            event.name = name;
+            event.category = category;
+            event.bytes = bytes;
+            event.start = trace_recorder().timer.seconds();
+        }
+    }
+
+    TraceRegion(const TraceRegion&) = delete;
+    TraceRegion& operator=(const TraceRegion&) = delete;
+
+    ~TraceRegion() {
+        if (recorded) {
+            Kokkos::fence();
+            event.duration = trace_recorder().timer.seconds() - event.start;
+            trace_recorder().events.push_back(std::move(event));
+        }
+        Kokkos::Profiling::popRegion();
+    }
+
+    /** Additional JSON fields of the event, only formatted if the trace is recorded */
+    template<typename... T>
+    void set_args(fmt::format_string<T...> format, T&&... args) {
+        if (recorded)
+            event.args = fmt::format(format, std::forward<T>(args)...);
+    }
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include "kokkos.h"
+
+#include <cstdint>
+
+/**
+ * Counter-based random numbers
+ *
+ * The i-th number of a stream only depends on (seed, i), and not on a
+ * generator state. Separate processes (or threads) thus agree on the random
+ * numbers attached to a given index without communicating.
+ */
+
+/** Finaliser of splitmix64, a bijective 64 bits mixing function */
+KOKKOS_INLINE_FUNCTION uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+KOKKOS_INLINE_FUNCTION uint64_t counter_rand64(uint64_t seed, uint64_t counter) {
+    return mix64(mix64(seed) + (counter + 1) * 0x9e3779b97f4a7c15ull);
+}
+
+/** Uniform double in [0, 1) */
+KOKKOS_INLINE_FUNCTION double counter_drand(uint64_t seed, uint64_t counter) {
+    return (counter_rand64(seed, counter) >> 11) * (1.0 / 9007199254740992.0);
+}
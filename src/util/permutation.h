@@ -0,0 +1,51 @@
+#pragma once
+#include "kokkos.h"
+#include "counter_rng.h"
+
+#include <cstdint>
+
+/**
+ * Keyed random permutation of [0, 2^num_bits)
+ *
+ * A balanced Feistel network is a bijection of [0, 4^h) for any round
+ * function. When num_bits is odd, the network works on num_bits + 1 bits and
+ * the values falling outside of the domain are walked along their cycle until
+ * they come back inside (cycle-walking), which keeps the bijection.
+ *
+ * The i-th element is computed without any state: taking the indices
+ * 0, 1, 2, ... gives distinct values, in an order fixed by the key.
+ */
+struct KeyedPermutation {
+    static constexpr int num_rounds = 6;
+
+    uint64_t key = 0;
+    int half_bits = 0;
+    uint64_t half_mask = 0;
+    uint64_t size = 1;
+
+    KeyedPermutation() = default;
+    KeyedPermutation(uint64_t seed, int num_bits) : key(mix64(seed)), half_bits((num_bits + 1) / 2) {
+        half_mask = (1ull << half_bits) - 1;
+        size = 1ull << num_bits;
+    }
+
+    KOKKOS_INLINE_FUNCTION uint64_t feistel(uint64_t x) const {
+        uint64_t left = x >> half_bits;
+        uint64_t right = x & half_mask;
+        for (int r = 0;r < num_rounds;r++) {
+            uint64_t next = left ^ (counter_rand64(key + r, right) & half_mask);
+            left = right;
+            right = next;
+        }
+        return (left << half_bits) | right;
+    }
+
+    /** i-th element of the permutation, for i < size */
+    KOKKOS_INLINE_FUNCTION uint64_t operator()(uint64_t i) const {
+        uint64_t x = feistel(i);
+        while (x >= size) {
+            x = feistel(x);
+        }
+        return x;
+    }
+};